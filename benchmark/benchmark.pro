@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Headless pipeline benchmarks, run with the offscreen QPA platform
+#
+#-------------------------------------------------
+
+QT       += core gui testlib
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = pipelinebenchmark
+TEMPLATE = app
+CONFIG  += debug_and_release_target debug_and_release console
+CONFIG  -= app_bundle
+
+SOURCES += pipelinebenchmark.cpp
+
+INCLUDEPATH += ../qdrawingarea
+
+CONFIG(debug, debug|release) {
+  LIBS += -Wl,-rpath=$$OUT_PWD/../qdrawingarea/debug/ -L../qdrawingarea/debug -lqdrawingarea
+} else {
+  LIBS += -Wl,-rpath=$$OUT_PWD/../qdrawingarea/release/ -L../qdrawingarea/release -lqdrawingarea
+}
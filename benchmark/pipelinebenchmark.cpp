@@ -0,0 +1,824 @@
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QThreadPool>
+#include <QtMath>
+#include <QtTest>
+
+#include <qdrawingarea.h>
+
+#include <algorithm>
+
+/**
+ * @brief Exposes the protected input entry points to the benchmark.
+ */
+class BenchmarkArea : public QDrawingArea
+{
+public:
+    using QDrawingArea::addStrokePoint;
+    using QDrawingArea::finishStroke;
+    using QDrawingArea::findPenFromButtons;
+};
+
+struct SyntheticSample
+{
+    quint32 deviceId;
+    qreal x;
+    qreal y;
+    qreal pressure;
+    bool release;
+};
+
+class PipelineBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    PipelineBenchmark() : pen(Qt::LeftButton, QColor(Qt::blue), 0.5, 4) {}
+
+    enum {
+        WaitTimeout = 10000 // ms
+    };
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void ingestion_data();
+    void ingestion();
+    void latency_data();
+    void latency();
+    void fullRepaint_data();
+    void fullRepaint();
+    void repaintScaling_data();
+    void repaintScaling();
+    void bulkLoad_data();
+    void bulkLoad();
+    void documentLoad_data();
+    void documentLoad();
+    void curveFitting_data();
+    void curveFitting();
+    void multiTouch_data();
+    void multiTouch();
+    void undoRedo_data();
+    void undoRedo();
+    void erasing_data();
+    void erasing();
+
+private:
+    static QVector<SyntheticSample> scribble(int strokes, int pointsPerStroke, const QSize &canvas);
+    static QVector<SyntheticSample> handwriting(int lines, const QSize &canvas);
+    static QVector<SyntheticSample> multiDevice(int devices, int strokes, const QSize &canvas);
+    static QVector<SyntheticSample> scenario(const QString &name, const QSize &canvas);
+    static qint64 peakMemory();
+
+    void feed(BenchmarkArea &area, const QVector<SyntheticSample> &samples, int begin, int end);
+    bool waitForIdle(BenchmarkArea &area);
+    void setupArea(BenchmarkArea &area, const QSize &size);
+
+    QDrawingPen pen;
+};
+
+void PipelineBenchmark::initTestCase()
+{
+    qDebug() << "Platform:" << QGuiApplication::platformName();
+    qDebug() << "Peak memory at start:" << peakMemory() << "kB";
+}
+
+void PipelineBenchmark::cleanupTestCase()
+{
+    qDebug() << "Peak memory:" << peakMemory() << "kB";
+}
+
+void PipelineBenchmark::ingestion_data()
+{
+    QTest::addColumn<QString>("scenario");
+
+    QTest::newRow("scribble") << "scribble";
+    QTest::newRow("handwriting") << "handwriting";
+    QTest::newRow("multi-device") << "multi-device";
+}
+
+void PipelineBenchmark::ingestion()
+{
+    QFETCH(QString, scenario);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+
+    QVector<SyntheticSample> samples = PipelineBenchmark::scenario(scenario, size);
+    QElapsedTimer timer;
+
+    timer.start();
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+
+    qint64 elapsed = qMax<qint64>(timer.nsecsElapsed(), 1);
+    qreal rate = samples.size() * 1e9 / elapsed;
+
+    qDebug() << scenario << ":" << samples.size() << "samples," << qRound64(rate) << "samples/s,"
+             << area.inputQueuePeakDepth() << "peak queue depth," << area.inputQueueOverflows() << "overflows,"
+             << peakMemory() << "kB peak memory";
+
+    QDrawingAreaMetrics metrics = area.metrics();
+
+    qDebug() << scenario << ": append latency us p50" << metrics.latency[QDrawingAreaMetrics::Stage_Appended].p50
+             << "p99" << metrics.latency[QDrawingAreaMetrics::Stage_Appended].p99
+             << "," << metrics.meanBatchSize << "mean /" << metrics.maxBatchSize << "max samples per batch";
+
+    QTest::setBenchmarkResult(rate, QTest::Events);
+}
+
+void PipelineBenchmark::latency_data()
+{
+    ingestion_data();
+}
+
+void PipelineBenchmark::latency()
+{
+    QFETCH(QString, scenario);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    QVector<SyntheticSample> samples = PipelineBenchmark::scenario(scenario, size);
+    QVector<qint64> latencies;
+    const int burst = 8; // Samples delivered per input event batch
+
+    for(int i = 0; i < samples.size(); i += burst)
+    {
+        QElapsedTimer timer;
+
+        updated.clear();
+        timer.start();
+        feed(area, samples, i, qMin(i + burst, samples.size()));
+
+        // Releases alone produce no new ink
+        if(updated.wait(100))
+            latencies << timer.nsecsElapsed() / 1000;
+    }
+
+    QVERIFY(!latencies.isEmpty());
+    std::sort(latencies.begin(), latencies.end());
+
+    qDebug() << scenario << ": input-to-pixmap latency us"
+             << "p50" << latencies[latencies.size() * 50 / 100]
+             << "p95" << latencies[latencies.size() * 95 / 100]
+             << "p99" << latencies[latencies.size() * 99 / 100]
+             << "max" << latencies.last()
+             << "over" << latencies.size() << "frames";
+
+    QDrawingAreaMetrics metrics = area.metrics();
+
+    for(int stage = 0; stage < QDrawingAreaMetrics::StageCount; stage++)
+    {
+        qDebug() << "  stage" << stage << ": p50" << metrics.latency[stage].p50 << "p99" << metrics.latency[stage].p99 << "us";
+    }
+
+    qDebug() << "  dropped frames" << metrics.droppedFrames << "of" << metrics.frames;
+
+    QTest::setBenchmarkResult(latencies[latencies.size() * 95 / 100] / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void PipelineBenchmark::fullRepaint_data()
+{
+    QTest::addColumn<int>("strokes");
+    QTest::addColumn<QSize>("canvas");
+
+    const int strokeCounts[] = { 100, 1000, 10000 };
+    const QSize canvases[] = { QSize(800, 600), QSize(1920, 1080), QSize(3840, 2160) };
+
+    for(int s = 0; s < 3; s++)
+    {
+        for(int c = 0; c < 3; c++)
+        {
+            QTest::newRow(qPrintable(QString("%1 strokes, %2x%3").arg(strokeCounts[s]).arg(canvases[c].width()).arg(canvases[c].height())))
+                    << strokeCounts[s] << canvases[c];
+        }
+    }
+}
+
+void PipelineBenchmark::fullRepaint()
+{
+    QFETCH(int, strokes);
+    QFETCH(QSize, canvas);
+    BenchmarkArea area;
+
+    setupArea(area, canvas);
+
+    QVector<SyntheticSample> samples = scribble(strokes, 40, canvas);
+
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    bool grow = true;
+
+    // Any zoom forces the rasterizer to redraw every stroke
+    QBENCHMARK {
+        updated.clear();
+        area.setViewport(QPointF(0, 0), grow ? 1.001 : 1);
+        grow = !grow;
+        QVERIFY(updated.wait(WaitTimeout));
+    }
+
+    qDebug() << strokes << "strokes," << canvas << ":" << peakMemory() << "kB peak memory";
+}
+
+void PipelineBenchmark::repaintScaling_data()
+{
+    QTest::addColumn<int>("threads");
+
+    for(int threads = 1; threads < QThread::idealThreadCount(); threads *= 2)
+        QTest::newRow(qPrintable(QString("%1 threads").arg(threads))) << threads;
+
+    QTest::newRow(qPrintable(QString("%1 threads").arg(QThread::idealThreadCount()))) << QThread::idealThreadCount();
+}
+
+void PipelineBenchmark::repaintScaling()
+{
+    QFETCH(int, threads);
+    QSize canvas(1920, 1080);
+    BenchmarkArea area;
+    int maxThreads = QThreadPool::globalInstance()->maxThreadCount();
+
+    setupArea(area, canvas);
+
+    QVector<SyntheticSample> samples = scribble(10000, 40, canvas);
+
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    bool grow = true;
+
+    // Tile rows are rendered on the global pool, the rasterizer's own thread helps out as well
+    QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+    QBENCHMARK {
+        updated.clear();
+        area.setViewport(QPointF(0, 0), grow ? 1.001 : 1);
+        grow = !grow;
+        QVERIFY(updated.wait(WaitTimeout));
+    }
+
+    QThreadPool::globalInstance()->setMaxThreadCount(maxThreads);
+}
+
+void PipelineBenchmark::bulkLoad_data()
+{
+    QTest::addColumn<int>("strokes");
+
+    QTest::newRow("1000 strokes") << 1000;
+    QTest::newRow("10000 strokes") << 10000;
+    QTest::newRow("100000 strokes") << 100000;
+}
+
+void PipelineBenchmark::bulkLoad()
+{
+    QFETCH(int, strokes);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+
+    QVector<SyntheticSample> samples = scribble(strokes, 40, size);
+    QVector<float> x, y, pressure;
+    QVector<int> lengths;
+
+    // Flatten into per-stroke point arrays, as a document loader would have them
+    x.reserve(samples.size());
+    y.reserve(samples.size());
+    pressure.reserve(samples.size());
+
+    for(int i = 0, start = 0; i < samples.size(); i++)
+    {
+        if(samples[i].release)
+        {
+            lengths << x.size() - start;
+            start = x.size();
+            continue;
+        }
+
+        x << samples[i].x;
+        y << samples[i].y;
+        pressure << samples[i].pressure;
+    }
+
+    QSharedPointer<QDrawingPen> drawingPen(new QDrawingPen(pen));
+    QSignalSpy inserted(area.model(), SIGNAL(strokesInserted(QList<quint32>)));
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    QElapsedTimer timer;
+
+    timer.start();
+    area.model()->beginInsert(lengths.size());
+
+    for(int i = 0, start = 0; i < lengths.size(); start += lengths[i], i++)
+        area.model()->append(drawingPen, x.constData() + start, y.constData() + start, pressure.constData() + start, lengths[i]);
+
+    area.model()->endInsert();
+
+    qint64 inserting = timer.nsecsElapsed();
+
+    QVERIFY(updated.wait(WaitTimeout));
+
+    qint64 elapsed = timer.nsecsElapsed();
+
+    QCOMPARE(inserted.count(), 1);
+    QCOMPARE(area.model()->snapshot().strokeCount(), strokes);
+
+    // Nothing else is queued up behind the single render
+    QTest::qWait(50);
+    QCOMPARE(updated.count(), 1);
+
+    qDebug() << strokes << "strokes:" << inserting / 1000000.0 << "ms to insert,"
+             << elapsed / 1000000.0 << "ms until rendered," << peakMemory() << "kB peak memory";
+
+    QTest::setBenchmarkResult(elapsed / 1000000.0, QTest::WalltimeMilliseconds);
+}
+
+void PipelineBenchmark::documentLoad_data()
+{
+    QTest::addColumn<int>("strokes");
+
+    QTest::newRow("10000 strokes") << 10000;
+    QTest::newRow("100000 strokes") << 100000;
+}
+
+void PipelineBenchmark::documentLoad()
+{
+    QFETCH(int, strokes);
+    QSize size(1920, 1080);
+    QVector<SyntheticSample> samples = scribble(strokes, 40, size);
+    QSharedPointer<QDrawingPen> drawingPen(new QDrawingPen(pen));
+    QAbstractDrawingModel source;
+    QTemporaryDir dir;
+    QString fileName = dir.path() + "/document.qdad";
+    QVector<float> x, y, pressure;
+
+    source.beginInsert(strokes);
+
+    for(int i = 0; i < samples.size(); i++)
+    {
+        if(!samples[i].release)
+        {
+            x << samples[i].x;
+            y << samples[i].y;
+            pressure << samples[i].pressure;
+            continue;
+        }
+
+        source.append(drawingPen, x.constData(), y.constData(), pressure.constData(), x.size());
+        x.clear();
+        y.clear();
+        pressure.clear();
+    }
+
+    source.endInsert();
+
+    QElapsedTimer timer;
+
+    timer.start();
+    QVERIFY(source.save(fileName));
+
+    qint64 saving = timer.nsecsElapsed();
+    qint64 fileSize = QFileInfo(fileName).size();
+    QAbstractDrawingModel model;
+
+    // Only the header and directory are read, point data stays on disk until used
+    timer.restart();
+    QVERIFY(model.load(fileName));
+
+    qint64 loading = timer.nsecsElapsed();
+
+    QCOMPARE(model.snapshot().strokeCount(), strokes);
+
+    qDebug() << strokes << "strokes," << fileSize / 1024 << "kB:" << saving / 1000000.0 << "ms to save,"
+             << loading / 1000000.0 << "ms to open," << peakMemory() << "kB peak memory";
+
+    QTest::setBenchmarkResult(loading / 1000000.0, QTest::WalltimeMilliseconds);
+}
+
+void PipelineBenchmark::curveFitting_data()
+{
+    QTest::addColumn<qreal>("tolerance");
+
+    QTest::newRow("samples") << 0.0;
+    QTest::newRow("0.05 mm") << 0.05;
+    QTest::newRow("0.2 mm") << 0.2;
+}
+
+void PipelineBenchmark::curveFitting()
+{
+    QFETCH(qreal, tolerance);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+    area.model()->setCurveTolerance(tolerance);
+
+    QVector<SyntheticSample> samples = handwriting(30, size);
+    QElapsedTimer timer;
+
+    timer.start();
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+
+    qint64 elapsed = qMax<qint64>(timer.nsecsElapsed(), 1);
+    QDrawingSnapshot snapshot = area.model()->snapshot();
+    qint64 points = 0, memory = 0, input = 0;
+
+    foreach(quint32 id, snapshot.strokeIds())
+    {
+        QDrawingStroke stroke = snapshot.stroke(id);
+
+        points += stroke.size();
+        memory += stroke.memoryUsage();
+    }
+
+    for(int i = 0; i < samples.size(); i++)
+        input += !samples[i].release;
+
+    qDebug() << tolerance << "mm:" << input << "samples stored as" << points << "points,"
+             << memory / 1024 << "kB point storage," << qRound64(input * 1e9 / elapsed) << "samples/s";
+
+    QTest::setBenchmarkResult(points, QTest::Events);
+}
+
+void PipelineBenchmark::multiTouch_data()
+{
+    QTest::addColumn<int>("contacts");
+
+    QTest::newRow("1 contact") << 1;
+    QTest::newRow("10 contacts") << 10;
+    QTest::newRow("20 contacts") << 20;
+}
+
+void PipelineBenchmark::multiTouch()
+{
+    QFETCH(int, contacts);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+
+    static QTouchDevice *device = QTest::createTouchDevice();
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    QVector<qint64> latencies;
+    const int frames = 200;
+
+    // Every contact moves in every event, as on a board full of hands
+    for(int f = 0; f <= frames; f++)
+    {
+        QTest::QTouchEventSequence sequence = QTest::touchEvent(&area, device, false);
+        QElapsedTimer timer;
+
+        for(int c = 0; c < contacts; c++)
+        {
+            QPoint point(60 + c * 90 + qRound(30 * qSin(f * 0.1 + c)), 100 + f * 4);
+
+            if(f == 0)
+                sequence.press(c, point, &area);
+            else if(f == frames)
+                sequence.release(c, point, &area);
+            else
+                sequence.move(c, point, &area);
+        }
+
+        updated.clear();
+        timer.start();
+        sequence.commit();
+
+        if(f < frames && updated.wait(100))
+            latencies << timer.nsecsElapsed() / 1000;
+    }
+
+    QVERIFY(waitForIdle(area));
+    QCOMPARE(area.model()->snapshot().strokeCount(), contacts);
+    QVERIFY(!latencies.isEmpty());
+    std::sort(latencies.begin(), latencies.end());
+
+    QDrawingAreaMetrics metrics = area.metrics();
+
+    qDebug() << contacts << "contacts: input-to-pixmap latency us"
+             << "p50" << latencies[latencies.size() * 50 / 100]
+             << "p99" << latencies[latencies.size() * 99 / 100]
+             << "," << metrics.meanBatchSize << "mean samples per batch";
+
+    QTest::setBenchmarkResult(latencies[latencies.size() * 99 / 100] / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void PipelineBenchmark::undoRedo_data()
+{
+    QTest::addColumn<int>("strokes");
+
+    QTest::newRow("100 strokes") << 100;
+    QTest::newRow("1000 strokes") << 1000;
+}
+
+void PipelineBenchmark::undoRedo()
+{
+    QFETCH(int, strokes);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+
+    setupArea(area, size);
+
+    QVector<SyntheticSample> samples = scribble(strokes, 40, size);
+
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+    QCOMPARE(area.model()->snapshot().strokeCount(), strokes);
+
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    QVector<qint64> latencies;
+    const int steps = 50;
+
+    // Every step puts back or takes out one stroke, only its tiles are rendered again
+    for(int i = 0; i < 2 * steps; i++)
+    {
+        QElapsedTimer timer;
+
+        updated.clear();
+        timer.start();
+
+        if(i < steps)
+            area.model()->undo();
+        else
+            area.model()->redo();
+
+        QVERIFY(updated.wait(WaitTimeout));
+        latencies << timer.nsecsElapsed() / 1000;
+    }
+
+    QCOMPARE(area.model()->snapshot().strokeCount(), strokes);
+    QVERIFY(!area.model()->canRedo());
+    std::sort(latencies.begin(), latencies.end());
+
+    qDebug() << strokes << "strokes: undo/redo-to-pixmap latency us"
+             << "p50" << latencies[latencies.size() * 50 / 100]
+             << "p99" << latencies[latencies.size() * 99 / 100]
+             << "," << area.model()->undoMemoryUsage() / 1024 << "kB history";
+
+    QTest::setBenchmarkResult(latencies[latencies.size() * 50 / 100] / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+void PipelineBenchmark::erasing_data()
+{
+    QTest::addColumn<int>("mode");
+
+    QTest::newRow("stroke eraser") << (int)QDrawingPen::Mode_Eraser;
+    QTest::newRow("precise eraser") << (int)QDrawingPen::Mode_PreciseEraser;
+}
+
+void PipelineBenchmark::erasing()
+{
+    QFETCH(int, mode);
+    BenchmarkArea area;
+    QSize size(1920, 1080);
+    QDrawingPen eraser(Qt::LeftButton, QColor(Qt::white), 10);
+
+    setupArea(area, size);
+    eraser.setMode(mode);
+    area.addPen(eraser, QTabletEvent::Eraser);
+
+    // A dense page, then an eraser sweeping across all of it
+    QVector<SyntheticSample> samples = scribble(2000, 40, size);
+
+    feed(area, samples, 0, samples.size());
+    QVERIFY(waitForIdle(area));
+
+    quint16 eraserPen = area.findPenFromButtons(Qt::LeftButton, QTabletEvent::Eraser);
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+    QVector<qint64> latencies;
+    const int burst = 8; // Samples delivered per input event batch
+    const int points = 2000;
+
+    for(int i = 0; i < points; i += burst)
+    {
+        QElapsedTimer timer;
+
+        updated.clear();
+        timer.start();
+
+        for(int j = i; j < i + burst; j++)
+        {
+            qreal t = j / (qreal)points;
+
+            area.addStrokePoint(1, eraserPen, size.width() * t, size.height() * (0.5 + 0.4 * qSin(t * 40)), 1);
+        }
+
+        // Sweeps that miss every stroke produce no new pixels
+        if(updated.wait(100))
+            latencies << timer.nsecsElapsed() / 1000;
+    }
+
+    area.finishStroke(1);
+    QVERIFY(waitForIdle(area));
+    QVERIFY(!latencies.isEmpty());
+    QVERIFY(area.model()->canUndo());
+    std::sort(latencies.begin(), latencies.end());
+
+    QDrawingAreaMetrics metrics = area.metrics();
+
+    qDebug() << (mode == QDrawingPen::Mode_Eraser ? "stroke" : "precise") << "eraser: input-to-pixmap latency us"
+             << "p50" << latencies[latencies.size() * 50 / 100]
+             << "p99" << latencies[latencies.size() * 99 / 100]
+             << "," << area.model()->snapshot().strokeCount() << "strokes left,"
+             << metrics.droppedFrames << "of" << metrics.frames << "frames dropped";
+
+    QTest::setBenchmarkResult(latencies[latencies.size() * 99 / 100] / 1000.0, QTest::WalltimeMilliseconds);
+}
+
+QVector<SyntheticSample> PipelineBenchmark::scribble(int strokes, int pointsPerStroke, const QSize &canvas)
+{
+    QVector<SyntheticSample> samples;
+    qsrand(1);
+
+    samples.reserve(strokes * (pointsPerStroke + 1));
+
+    for(int s = 0; s < strokes; s++)
+    {
+        qreal x = qrand() % canvas.width();
+        qreal y = qrand() % canvas.height();
+        qreal angle = (qrand() % 360) * M_PI / 180;
+
+        for(int p = 0; p < pointsPerStroke; p++)
+        {
+            SyntheticSample sample = { 0x1000 + Qt::LeftButton, x, y, 0.5 + 0.5 * qSin(p * 0.2), false };
+
+            samples << sample;
+            angle += ((qrand() % 100) - 50) / 100.0;
+            x = qBound<qreal>(0, x + 6 * qCos(angle), canvas.width() - 1);
+            y = qBound<qreal>(0, y + 6 * qSin(angle), canvas.height() - 1);
+        }
+
+        SyntheticSample release = { 0x1000 + Qt::LeftButton, 0, 0, 0, true };
+        samples << release;
+    }
+
+    return samples;
+}
+
+QVector<SyntheticSample> PipelineBenchmark::handwriting(int lines, const QSize &canvas)
+{
+    QVector<SyntheticSample> samples;
+    qreal lineHeight = canvas.height() / (qreal)(lines + 1);
+    qsrand(2);
+
+    for(int line = 0; line < lines; line++)
+    {
+        qreal baseline = (line + 1) * lineHeight;
+
+        // Glyph-sized loops with pen lifts between letters
+        for(qreal left = 20; left < canvas.width() - 40; left += 14 + qrand() % 6)
+        {
+            int points = 15 + qrand() % 20;
+
+            for(int p = 0; p < points; p++)
+            {
+                qreal t = p / (qreal)points;
+                SyntheticSample sample = { 0x1000 + Qt::LeftButton,
+                                           left + 10 * t + 3 * qSin(t * 2 * M_PI),
+                                           baseline - lineHeight * 0.3 * (1 - qCos(t * 2 * M_PI)),
+                                           0.3 + 0.7 * qSin(t * M_PI), false };
+
+                samples << sample;
+            }
+
+            SyntheticSample release = { 0x1000 + Qt::LeftButton, 0, 0, 0, true };
+            samples << release;
+        }
+    }
+
+    return samples;
+}
+
+QVector<SyntheticSample> PipelineBenchmark::multiDevice(int devices, int strokes, const QSize &canvas)
+{
+    QVector<QVector<SyntheticSample> > streams;
+    QVector<SyntheticSample> samples;
+
+    // Same scribble per device, interleaved sample by sample as concurrent tablets would be
+    for(int d = 0; d < devices; d++)
+    {
+        streams << scribble(strokes, 60, canvas);
+
+        for(int i = 0; i < streams[d].size(); i++)
+        {
+            streams[d][i].deviceId = 0x2000 + d;
+            streams[d][i].x = qBound<qreal>(0, streams[d][i].x + d * 40, canvas.width() - 1);
+        }
+    }
+
+    for(int i = 0; i < streams[0].size(); i++)
+    {
+        for(int d = 0; d < devices; d++)
+            samples << streams[d][i];
+    }
+
+    return samples;
+}
+
+QVector<SyntheticSample> PipelineBenchmark::scenario(const QString &name, const QSize &canvas)
+{
+    if(name == "scribble")
+        return scribble(50, 1000, canvas);
+    else if(name == "handwriting")
+        return handwriting(30, canvas);
+    else
+        return multiDevice(4, 50, canvas);
+}
+
+qint64 PipelineBenchmark::peakMemory()
+{
+    QFile status("/proc/self/status");
+
+    if(!status.open(QIODevice::ReadOnly))
+        return -1;
+
+    foreach(const QByteArray &line, status.readAll().split('\n'))
+    {
+        if(line.startsWith("VmHWM:"))
+            return line.mid(6).trimmed().split(' ').first().toLongLong();
+    }
+
+    return -1;
+}
+
+void PipelineBenchmark::feed(BenchmarkArea &area, const QVector<SyntheticSample> &samples, int begin, int end)
+{
+    quint16 drawingPen = area.findPenFromButtons(Qt::LeftButton);
+
+    for(int i = begin; i < end; i++)
+    {
+        const SyntheticSample &sample = samples[i];
+
+        // Keep the producer from overrunning the queue; overflows are reported separately
+        while(area.inputQueueDepth() > 3000)
+            QThread::yieldCurrentThread();
+
+        if(sample.release)
+            area.finishStroke(sample.deviceId);
+        else
+            area.addStrokePoint(sample.deviceId, drawingPen, sample.x, sample.y, sample.pressure);
+    }
+}
+
+bool PipelineBenchmark::waitForIdle(BenchmarkArea &area)
+{
+    QElapsedTimer timer;
+
+    timer.start();
+
+    while(area.inputQueueDepth() > 0)
+    {
+        if(timer.elapsed() > WaitTimeout)
+            return false;
+
+        QCoreApplication::processEvents();
+    }
+
+    // Let the last repaint batch through
+    QTest::qWait(50);
+
+    return true;
+}
+
+void PipelineBenchmark::setupArea(BenchmarkArea &area, const QSize &size)
+{
+    QSignalSpy updated(&area, SIGNAL(canvasUpdated()));
+
+    // One pixel per mm keeps the synthetic input in pixels
+    area.addPen(pen);
+    area.setUpdateRate(1000);
+    area.setViewport(QPointF(0, 0), 1);
+    area.resize(size);
+    area.show();
+    QVERIFY(QTest::qWaitForWindowExposed(&area));
+
+    // The first full render lands in the background
+    if(updated.isEmpty())
+        QVERIFY(updated.wait(WaitTimeout));
+}
+
+int main(int argc, char *argv[])
+{
+    // Headless by default
+    if(qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app(argc, argv);
+    PipelineBenchmark benchmark;
+
+    return QTest::qExec(&benchmark, argc, argv);
+}
+
+#include "pipelinebenchmark.moc"
@@ -5,4 +5,10 @@ qdrawingarea.subdir = qdrawingarea
 testui.subdir = testui
 testui.depends = qdrawingarea
 
-SUBDIRS += qdrawingarea testui
+benchmark.subdir = benchmark
+benchmark.depends = qdrawingarea
+
+tests.subdir = tests
+tests.depends = qdrawingarea
+
+SUBDIRS += qdrawingarea testui benchmark tests
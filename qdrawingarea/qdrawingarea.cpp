@@ -1,12 +1,131 @@
 #include "qdrawingarea.h"
 #include "qdrawingarea_p.h"
+#include "qdrawingdocument_p.h"
+#include "qdrawinggeometry_p.h"
 
 #include <QEvent>
 #include <QDebug>
+#include <QGuiApplication>
+#include <QLoggingCategory>
+#include <QMap>
 #include <QMouseEvent>
 #include <QPainter>
+#include <QScreen>
+#include <QScopedPointer>
+#include <QSet>
 #include <QTime>
+#include <QVarLengthArray>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
 #include <QtMath>
+#include <QWindow>
+
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(lcDrawingEvents, "qdrawingarea.events", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcDrawingInput, "qdrawingarea.input", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcDrawingRaster, "qdrawingarea.raster", QtWarningMsg)
+Q_LOGGING_CATEGORY(lcDrawingPaint, "qdrawingarea.paint", QtWarningMsg)
+
+static qreal distanceToSegment(const QPointF &p, const QPointF &a, const QPointF &b)
+{
+    QPointF ab = b - a;
+    qreal length = QPointF::dotProduct(ab, ab);
+    qreal t = length > 0 ? qBound<qreal>(0, QPointF::dotProduct(p - a, ab) / length, 1) : 0;
+    QPointF d = p - (a + t * ab);
+
+    return qSqrt(QPointF::dotProduct(d, d));
+}
+
+static qreal segmentDistance(const QPointF &a, const QPointF &b, const QPointF &c, const QPointF &d)
+{
+    QLineF first(a, b);
+
+    if(first.intersect(QLineF(c, d), 0) == QLineF::BoundedIntersection)
+        return 0;
+
+    return qMin(qMin(distanceToSegment(a, c, d), distanceToSegment(b, c, d)),
+                qMin(distanceToSegment(c, a, b), distanceToSegment(d, a, b)));
+}
+
+/**
+ * Control points of the part of the cubic `c` from `t0` to `t1`, by de Casteljau subdivision.
+ */
+static void subCurve(const float *c, qreal t0, qreal t1, float *part)
+{
+    float head[4];
+
+    for(int i = 0; i < 4; i++)
+        head[i] = c[i];
+
+    // Keep the curve up to t1, then the rest of that from t0 on
+    if(t1 < 1)
+    {
+        qreal c01 = c[0] + (c[1] - c[0]) * t1, c12 = c[1] + (c[2] - c[1]) * t1, c23 = c[2] + (c[3] - c[2]) * t1;
+        qreal c012 = c01 + (c12 - c01) * t1, c123 = c12 + (c23 - c12) * t1;
+
+        head[1] = c01;
+        head[2] = c012;
+        head[3] = c012 + (c123 - c012) * t1;
+    }
+
+    for(int i = 0; i < 4; i++)
+        part[i] = head[i];
+
+    if(t0 > 0)
+    {
+        qreal t = t0 / t1;
+        qreal c01 = head[0] + (head[1] - head[0]) * t, c12 = head[1] + (head[2] - head[1]) * t;
+        qreal c23 = head[2] + (head[3] - head[2]) * t;
+        qreal c012 = c01 + (c12 - c01) * t, c123 = c12 + (c23 - c12) * t;
+
+        part[0] = c012 + (c123 - c012) * t;
+        part[1] = c123;
+        part[2] = c23;
+    }
+}
+
+static QRectF inkBounds(const QDrawingStroke &stroke)
+{
+    qreal margin = stroke.pen()->maxWidth();
+
+    return stroke.boundingRect().adjusted(-margin, -margin, margin, margin);
+}
+
+static bool segmentIntersectsRect(const QPointF &a, const QPointF &b, const QRectF &rect)
+{
+    if(rect.contains(a) || rect.contains(b))
+        return true;
+
+    // Liang-Barsky clipping
+    qreal t0 = 0, t1 = 1;
+    qreal dx = b.x() - a.x(), dy = b.y() - a.y();
+    const qreal p[] = { -dx, dx, -dy, dy };
+    const qreal q[] = { a.x() - rect.left(), rect.right() - a.x(), a.y() - rect.top(), rect.bottom() - a.y() };
+
+    for(int i = 0; i < 4; i++)
+    {
+        if(p[i] == 0)
+        {
+            if(q[i] < 0)
+                return false;
+        }
+        else
+        {
+            qreal t = q[i] / p[i];
+
+            if(p[i] < 0)
+                t0 = qMax(t0, t);
+            else
+                t1 = qMin(t1, t);
+
+            if(t0 > t1)
+                return false;
+        }
+    }
+
+    return true;
+}
 
 QDrawingArea::QDrawingArea(QWidget *parent) : QWidget(parent),
     d_ptr(new QDrawingAreaPrivate(this))
@@ -22,7 +141,7 @@ QDrawingArea::QDrawingArea(QAbstractDrawingModel *model, QWidget *parent) : QWid
 
 QDrawingArea::~QDrawingArea()
 {
-
+    stopRecording();
 }
 
 bool QDrawingArea::event(QEvent *e)
@@ -33,14 +152,17 @@ bool QDrawingArea::event(QEvent *e)
     QTabletEvent *tabletEvent;
     QTouchEvent *touchEvent;
     QPaintEvent *paintEvent;
-    QSharedPointer<QDrawingPen> pen;
+    quint16 pen;
+
+    // Start of the input-to-ink latency measurement
+    d->eventTime = d->clock.nsecsElapsed();
 
     switch(e->type())
     {
     case QEvent::TabletPress:
-        qDebug() << "QEvent::TabletPress";
+        qCDebug(lcDrawingEvents) << "QEvent::TabletPress";
     case QEvent::TabletMove:
-        qDebug() << "QEvent::TabletMove";
+        qCDebug(lcDrawingEvents) << "QEvent::TabletMove";
         if(d->flags & IgnoreTablet)
         {
             e->ignore();
@@ -49,9 +171,9 @@ bool QDrawingArea::event(QEvent *e)
         {
             tabletEvent = dynamic_cast<QTabletEvent*>(e);
 
-            pen = findPenFromButtons(tabletEvent->buttons());
+            pen = findPenFromButtons(tabletEvent->buttons(), tabletEvent->pointerType());
 
-            if(pen) {
+            if(pen != QDrawingPen::InvalidId) {
                 if(!d->tabletIdMap.contains(tabletEvent->uniqueId()))
                 {
                     d->tabletIdMap[tabletEvent->uniqueId()] = d->tabletIdMap.size() + 0x1000;
@@ -64,7 +186,7 @@ bool QDrawingArea::event(QEvent *e)
 
         break;
     case QEvent::TabletRelease:
-        qDebug() << "QEvent::TabletRelease";
+        qCDebug(lcDrawingEvents) << "QEvent::TabletRelease";
 
         if(d->flags & IgnoreTablet)
         {
@@ -72,6 +194,8 @@ bool QDrawingArea::event(QEvent *e)
         }
         else
         {
+            tabletEvent = dynamic_cast<QTabletEvent*>(e);
+
             if(d->tabletIdMap.contains(tabletEvent->uniqueId()))
             {
                 finishStroke(d->tabletIdMap[tabletEvent->uniqueId()]);
@@ -82,9 +206,9 @@ bool QDrawingArea::event(QEvent *e)
 
         break;
     case QEvent::MouseButtonPress:
-        qDebug() << "QEvent::MouseButtonPress";
+        qCDebug(lcDrawingEvents) << "QEvent::MouseButtonPress";
     case QEvent::MouseMove:
-        qDebug() << "QEvent::MouseMove";
+        qCDebug(lcDrawingEvents) << "QEvent::MouseMove";
         if(d->flags & IgnoreMouse)
         {
             e->ignore();
@@ -93,19 +217,25 @@ bool QDrawingArea::event(QEvent *e)
         {
             mouseEvent = dynamic_cast<QMouseEvent*>(e);
 
+            // Touches already draw their own strokes
+            if(d->ignoreFakeMouse && mouseEvent->source() != Qt::MouseEventNotSynthesized)
+                break;
+
             pen = findPenFromButtons(mouseEvent->buttons());
 
-            if(pen) {
-                d->heldMouseButtons |= pen->button();
+            if(pen != QDrawingPen::InvalidId) {
+                Qt::MouseButton button = PenRegistry::pen(pen)->button();
+
+                d->heldMouseButtons |= button;
 
-                addStrokePoint(0x1000 + (int)pen->button(), pen, mouseEvent->x(), mouseEvent->y(), 1);
+                addStrokePoint(0x1000 + (int)button, pen, mouseEvent->x(), mouseEvent->y(), 1);
             }
 
             e->accept();
         }
         break;
     case QEvent::MouseButtonRelease:
-        qDebug() << "QEvent::MouseButtonRelease";
+        qCDebug(lcDrawingEvents) << "QEvent::MouseButtonRelease";
         if(d->flags & IgnoreMouse)
         {
             e->ignore();
@@ -114,6 +244,9 @@ bool QDrawingArea::event(QEvent *e)
         {
             mouseEvent = dynamic_cast<QMouseEvent*>(e);
 
+            if(d->ignoreFakeMouse && mouseEvent->source() != Qt::MouseEventNotSynthesized)
+                break;
+
             finishStroke(0x1000 + (int)mouseEvent->button());
             d->heldMouseButtons &= ~mouseEvent->button();
 
@@ -121,52 +254,116 @@ bool QDrawingArea::event(QEvent *e)
         }
         break;
     case QEvent::TouchBegin:
-        qDebug() << "QEvent::TouchBegin";
+        qCDebug(lcDrawingEvents) << "QEvent::TouchBegin";
+    case QEvent::TouchUpdate:
+        qCDebug(lcDrawingEvents) << "QEvent::TouchUpdate";
+    case QEvent::TouchEnd:
+        qCDebug(lcDrawingEvents) << "QEvent::TouchEnd";
+    case QEvent::TouchCancel:
+        qCDebug(lcDrawingEvents) << "QEvent::TouchCancel";
         if(d->flags & IgnoreTouch)
         {
+            d->ignoreFakeMouse = false;
             e->ignore();
         }
         else
         {
-            touchEvent = dynamic_cast<QTouchEvent*>(e);
+            touchEvent = static_cast<QTouchEvent*>(e);
 
-//            if(!d->touchPointMap.contains())
+            d->ignoreFakeMouse = true;
+            d->touchEvent(touchEvent);
 
             e->accept();
         }
 
-        break;
-    case QEvent::TouchEnd:
-        qDebug() << "QEvent::TouchEnd";
-
-        break;
-    case QEvent::TouchUpdate:
-        qDebug() << "QEvent::TouchUpdate";
-
-        break;
-    case QEvent::TouchCancel:
-        qDebug() << "QEvent::TouchCancel";
-
         break;
     case QEvent::Paint:
-        qDebug() << "QEvent::Paint";
+        qCDebug(lcDrawingEvents) << "QEvent::Paint";
         paintEvent = dynamic_cast<QPaintEvent*>(e);
         e->accept();
 
     {
         QPainter p(this);
-        p.drawPixmap(rect(), d->pixmap);
+        QRegion uncovered(paintEvent->rect());
+        QPoint offset = d->viewOffset();
+
+        // The current scale first, earlier ones are scaled into whatever it has not rendered yet
+        for(int l = 0; l < d->levels.size() && !uncovered.isEmpty(); l++)
+        {
+            const TileLevel &level = d->levels[l];
+            qreal factor = d->viewScale / level.scale;
+            QRect bounds = uncovered.boundingRect();
+            QRect area = QRectF(QPointF(bounds.topLeft() + offset) / factor, QSizeF(bounds.size()) / factor).toAlignedRect();
+            QVector<quint64> keys = TileLevel::keysIn(area);
+
+            if(factor != 1)
+            {
+                p.setClipRegion(uncovered);
+                p.setRenderHint(QPainter::SmoothPixmapTransform);
+            }
+
+            for(int i = 0; i < keys.size(); i++)
+            {
+                QHash<quint64, QImage>::const_iterator tile = level.tiles.constFind(keys[i]);
+
+                if(tile == level.tiles.constEnd())
+                    continue;
+
+                QRect rect = TileLevel::rect(keys[i]);
+                QRectF target(QPointF(rect.topLeft()) * factor - offset, QSizeF(rect.size()) * factor);
+
+                if(factor == 1)
+                    p.drawImage(target.topLeft().toPoint(), tile.value());
+                else
+                    p.drawImage(target, tile.value());
+
+                uncovered -= target.toRect();
+            }
+
+            p.setClipping(false);
+        }
+
+        // Area not yet covered by any rendered tile, e.g. right after a pan
+        foreach(const QRect &r, uncovered.rects())
+            p.fillRect(r, palette().color(backgroundRole()));
+
+        // Active strokes, then predicted ink ahead of the pen.  Both are replaced every frame.
+        if(!d->wet.isEmpty() || !d->prediction.isEmpty())
+        {
+            QVector<OverlayStroke> overlay = d->wet + d->prediction;
+
+            p.translate(-offset);
+            p.scale(d->viewScale, d->viewScale);
+            p.setPen(Qt::NoPen);
+
+            if(d->flags & SmoothCurves)
+                p.setRenderHint(QPainter::Antialiasing);
+
+            for(int i = 0; i < overlay.size(); i++)
+            {
+                p.setBrush(overlay[i].color);
+                p.drawPath(overlay[i].outline);
+            }
+        }
     }
+
+        if(d->paintEventTime >= 0)
+        {
+            d->metrics.stages[QDrawingAreaMetrics::Stage_Painted].add(d->clock.nsecsElapsed() - d->paintEventTime);
+            d->paintEventTime = -1;
+        }
         break;
     case QEvent::Resize:
-        qDebug() << "QEvent::Resize";
-        emit d->rasterizer->repaintLater();
+        qCDebug(lcDrawingEvents) << "QEvent::Resize";
+        d->scheduler->requestFrame();
         break;
     default:
-        qDebug() << e;
+        qCDebug(lcDrawingEvents) << e;
+        d->eventTime = -1;
         return QWidget::event(e);
     }
 
+    d->eventTime = -1;
     return true;
 }
 
@@ -183,376 +380,1338 @@ void QDrawingArea::setUpdateRate(int updatesPerSecond)
 {
     Q_D(QDrawingArea);
 
-    emit d->processor->setRepaintInterval(1000.0/updatesPerSecond);
+    d->scheduler->setRate(updatesPerSecond);
 }
 
-void QDrawingArea::addPen(QDrawingPen &p)
+void QDrawingArea::setPredictionHorizon(int ms)
 {
     Q_D(QDrawingArea);
 
-    d->pens.append(QSharedPointer<QDrawingPen>(new QDrawingPen(p)));
-}
-
-QAbstractDrawingModel *QDrawingArea::model()
-{
-    Q_D(QDrawingArea);
+    d->processor->predictionHorizon.store(qMax(ms, 0));
 
-    return d->model;
+    if(ms <= 0)
+        d->setPrediction(QVector<OverlayStroke>());
 }
 
-void QDrawingArea::setModel(QAbstractDrawingModel *model)
+int QDrawingArea::predictionHorizon() const
 {
-    Q_D(QDrawingArea);
+    Q_D(const QDrawingArea);
 
-    d->model = model;
-    d->model_d = model->d_ptr;
+    return d->processor->predictionHorizon.load();
 }
 
-void QDrawingArea::updatePixmap(QPixmap p)
+void QDrawingArea::addPen(const QDrawingPen &pen, QTabletEvent::PointerType pointer)
 {
     Q_D(QDrawingArea);
+    quint16 id = PenRegistry::add(pen);
 
-    qDebug() << "Got a new pixmap";
-
-    d->pixmap = p;
-
-    repaint();
-}
-
-void QDrawingArea::addStrokePoint(quint32 deviceId, QSharedPointer<QDrawingPen> pen, qreal x, qreal y, qreal pressure)
-{
-    Q_D(QDrawingArea);
+    if(id == QDrawingPen::InvalidId)
+        return;
 
-    qDebug() << thread();
+    if(pointer < 0 || pointer >= QDrawingAreaPrivate::PointerTypes)
+        pointer = QTabletEvent::UnknownPointer;
 
-    if(d->flags & D_EmulatePressure)
+    // Pens added earlier keep their buttons, as they did when the list was searched in order
+    for(int bit = 0; bit < QDrawingAreaPrivate::ButtonBits; bit++)
     {
-        pressure = (QTime::currentTime().second() % 2 ? QTime::currentTime().msec() : 1000 - QTime::currentTime().msec()) / 1000.0;
-//        pressure = QTime::currentTime().second() % 2;
+        if((pen.button() & (1u << bit)) && d->buttonPens[pointer][bit] < 0)
+            d->buttonPens[pointer][bit] = d->pens.size();
     }
 
-    QMetaObject::invokeMethod(d->processor, "processPoint",
-                              Qt::QueuedConnection,
-                              Q_ARG(quint32, deviceId),
-                              Q_ARG(QSharedPointer<QDrawingPen>, pen),
-                              Q_ARG(qreal, x),
-                              Q_ARG(qreal, y),
-                              Q_ARG(qreal, pressure));
+    d->pens << id;
 }
 
-void QDrawingArea::finishStroke(quint32 deviceId)
+QAbstractDrawingModel *QDrawingArea::model()
 {
     Q_D(QDrawingArea);
 
-    QMetaObject::invokeMethod(d->processor, "finishPoint",
-                              Qt::QueuedConnection,
-                              Q_ARG(quint32, deviceId));
+    return d->model;
 }
 
-QSharedPointer<QDrawingPen> QDrawingArea::findPenFromButtons(Qt::MouseButtons buttons)
+void QDrawingArea::setViewport(const QPointF &origin, qreal scale)
 {
     Q_D(QDrawingArea);
 
-    // FIXME: Add in a map of pens or something
-    for(int i = 0; i < d->pens.size(); i++)
+    if(scale <= 0)
     {
-        if(d->pens[i]->button() & buttons)
-        {
-            return d->pens[i];
-        }
+        qWarning("QDrawingArea::setViewport: Invalid scale %f", scale);
+        return;
     }
-    return QSharedPointer<QDrawingPen>();
+
+    d->viewOrigin = origin;
+    d->viewScale = scale;
+
+    if(!d->levels.isEmpty() && d->levels.first().scale == scale)
+        d->levels.first().evict(d->viewArea(Rasterizer::KeptTiles));
+
+    // Cached tiles are shown right away, the rasterizer fills in the rest
+    update();
+    d->scheduler->requestFrame();
 }
 
-InputProcessor::InputProcessor(QDrawingAreaPrivate *d) : QObject(),
-    d(d)
+QPointF QDrawingArea::viewportOrigin() const
 {
-    repaintTimer.setInterval(RepaintInterval);
+    Q_D(const QDrawingArea);
 
-    connect(&repaintTimer, &QTimer::timeout, this, &InputProcessor::repaintTimeout);
+    return d->viewOrigin;
 }
 
-InputProcessor::~InputProcessor()
+qreal QDrawingArea::viewportScale() const
 {
+    Q_D(const QDrawingArea);
 
+    return d->viewScale;
 }
 
-void InputProcessor::moveToThread(QThread *targetThread)
+QTransform QDrawingArea::viewTransform() const
 {
-    QObject::moveToThread(targetThread);
-    repaintTimer.moveToThread(targetThread);
+    Q_D(const QDrawingArea);
+    QPoint offset = d->viewOffset();
+
+    return QTransform(d->viewScale, 0, 0, d->viewScale, -offset.x(), -offset.y());
 }
 
-void InputProcessor::processPoint(quint32 deviceId, QSharedPointer<QDrawingPen> pen, qreal x, qreal y, qreal pressure)
+void QDrawingArea::setModel(QAbstractDrawingModel *model)
 {
-    QAbstractDrawingModelPrivate *md = d->model_d;
-    // TODO: Needs model validation
-    QDrawingPoint point(x, y, pressure);
+    Q_D(QDrawingArea);
 
-//    if(stroke.id() == (quint32)-1)
-    if(!deviceIdMap.contains(deviceId))
+    if(d->model)
     {
-        d->model_d->generateRandomId();
+        disconnect(d->model, &QAbstractDrawingModel::strokesInserted, d->rasterizer, &Rasterizer::invalidate);
+        disconnect(d->model, &QAbstractDrawingModel::strokesChanged, d->rasterizer, &Rasterizer::invalidateStrokes);
+    }
 
-//        QDrawingStroke &stroke = md->strokes[md->strokeMap[deviceIdMap[deviceId]]];
-        QDrawingStroke &stroke = md->strokeMap[md->currentId] = QDrawingStroke();
+    d->model = model;
+    d->model_d = model->d_ptr;
 
-        stroke.setId(d->model_d->currentId);
-        stroke.setPen(pen);
+    // Loaded strokes are rendered in one go, removed and restored ones only need their tiles redrawn
+    connect(model, &QAbstractDrawingModel::strokesInserted, d->rasterizer, &Rasterizer::invalidate);
+    connect(model, &QAbstractDrawingModel::strokesChanged, d->rasterizer, &Rasterizer::invalidateStrokes);
+}
 
-        deviceIdMap[deviceId] = md->currentId;
-    }
+void QDrawingArea::updateTiles(const RasterTileUpdate &update)
+{
+    Q_D(QDrawingArea);
+    QRegion changed;
 
-    QDrawingStroke &stroke = md->strokeMap[deviceIdMap[deviceId]];
+    qCDebug(lcDrawingPaint) << "Got" << update.keys.size() << "new tiles";
 
-    // TODO: Calculate motion of the point smoothly
-    // FIXME: Dirty
-    if(stroke.size() > 0)
+    if(update.eventTime >= 0)
     {
-        QDrawingPoint &previous = stroke[stroke.size() - 1];
-//        QLineF vector(previous, point);
-//        QLineF normal = vector.normalVector().unitVector();
-        QTransform trans;
-        QVector2D t = (QVector2D)point - (QVector2D)previous;
+        d->metrics.stages[QDrawingAreaMetrics::Stage_Delivered].add(d->clock.nsecsElapsed() - update.eventTime);
 
-        t.normalize();
-        trans.rotate(90);
-        point.setNormal(QVector2D(trans.map(t.toPointF())));
+        // Oldest ink not yet on screen
+        if(d->paintEventTime < 0 || update.eventTime < d->paintEventTime)
+            d->paintEventTime = update.eventTime;
     }
 
-    // TODO: Generate cubic curves from recent points
-
-    stroke << point;
+    if(update.full || d->levels.isEmpty() || d->levels.first().scale != update.scale)
+    {
+        TileLevel level;
 
-    qDebug() << "Added point to stroke" << stroke.id() << "with size" << stroke.size();
+        level.scale = update.scale;
 
-    if(!modifiedStrokes.contains(stroke.id()))
-        modifiedStrokes << stroke.id();
+        // Earlier renders of other scales stay around as stand-ins
+        for(int l = d->levels.size() - 1; l >= 0; l--)
+        {
+            if(d->levels[l].scale == update.scale)
+                d->levels.removeAt(l);
+        }
 
-    // Fire up repaint timer if not already started
-    if(!repaintTimer.isActive())
-    {
-        qDebug() << "Starting";
-        qDebug() << thread() << repaintTimer.thread();
-        repaintTimer.start();
-    }
-}
+        d->levels.prepend(level);
 
-void InputProcessor::finishPoint(quint32 deviceId)
-{
-    if(deviceIdMap.contains(deviceId))
-    {
-        qDebug() << "Finished stroke" << deviceIdMap[deviceId] << "from" << deviceId;
+        while(d->levels.size() > QDrawingAreaPrivate::CachedLevels)
+            d->levels.removeLast();
 
-        deviceIdMap.remove(deviceId);
+        changed = rect();
     }
-}
 
-void InputProcessor::finishAllPoints()
-{
-    deviceIdMap.clear();
-}
+    TileLevel &current = d->levels.first();
+    QPoint offset = d->viewOffset();
+    qreal factor = d->viewScale / current.scale;
 
-void InputProcessor::repaintTimeout()
-{
-    qDebug() << "Timeout";
-    if(modifiedStrokes.empty())
+    for(int i = 0; i < update.keys.size(); i++)
     {
-        repaintTimer.stop();
+        QRect tile = TileLevel::rect(update.keys[i]);
+
+        current.tiles.insert(update.keys[i], update.tiles[i]);
+        changed += QRectF(QPointF(tile.topLeft()) * factor - offset, QSizeF(tile.size()) * factor).toAlignedRect();
     }
-    else
-    {
-        qDebug() << "Triggering repaint";
-        // TODO: Other work?
-        emit repaint(modifiedStrokes);
 
-        modifiedStrokes.clear();
+    // Strokes that were finished leave the wet layer with the same update that bakes them
+    if(update.wetChanged)
+    {
+        d->wet = update.wet;
+        changed += d->mapFromDocument(update.wetDirty);
     }
-}
 
-void InputProcessor::setRepaintInterval(int timeout)
-{
-    repaintTimer.setInterval(timeout);
-}
+    // Painted with the next backing store flush instead of blocking the frame
+    update(changed);
 
-void InputProcessor::processErasing()
-{
-    // TODO: Look at a stroke and check if it collides with another stroke.  Might not need the entire stroke, just the segment from the last point to the current
-    // Also handle if it is a dot. Somehow.
+    emit canvasUpdated();
 }
 
-QDrawingPoint::QDrawingPoint() :
-    m_x(0),
-    m_y(0),
-    m_pressure(0),
-    m_normal(QVector2D())
+void QDrawingArea::addStrokePoint(quint32 deviceId, quint16 pen, qreal x, qreal y, qreal pressure)
 {
+    Q_D(QDrawingArea);
 
+    d->enqueueSample(d->pointSample(deviceId, pen, x, y, pressure));
 }
 
-QDrawingPoint::QDrawingPoint(qreal xpos, qreal ypos, qreal pressure, QVector2D normal) :
-    m_x(xpos),
-    m_y(ypos),
-    m_pressure(pressure),
-    m_normal(normal)
+void QDrawingArea::finishStroke(quint32 deviceId)
 {
-}
+    Q_D(QDrawingArea);
 
-qreal QDrawingPoint::x()
-{
-    return m_x;
+    d->enqueueSample(d->releaseSample(deviceId));
 }
 
-qreal QDrawingPoint::y()
+QDrawingAreaMetrics QDrawingArea::metrics() const
 {
-    return m_y;
-}
+    Q_D(const QDrawingArea);
 
-qreal QDrawingPoint::pressure()
-{
-    return m_pressure;
-}
+    QDrawingAreaMetrics result = d->metrics.summary();
 
-QVector2D QDrawingPoint::normal()
-{
-    return m_normal;
-}
+    result.queueOverflows = d->processor->samples.overflows();
 
-QDrawingPoint::operator QPointF()
-{
-    return QPointF(m_x, m_y);
+    return result;
 }
 
-void QDrawingPoint::setX(qreal x)
+void QDrawingArea::resetMetrics()
 {
-    m_x = x;
-}
+    Q_D(QDrawingArea);
 
-void QDrawingPoint::setY(qreal y)
-{
-    m_y = y;
+    d->metrics.reset();
 }
 
-void QDrawingPoint::setPressure(qreal pressure)
+bool QDrawingArea::startRecording(const QString &fileName)
 {
-    m_pressure = pressure;
-}
+    Q_D(QDrawingArea);
 
-void QDrawingPoint::setNormal(QVector2D normal)
-{
-    m_normal = normal;
-}
+    stopRecording();
 
+    d->recorder = new TraceRecorder;
 
-QDrawingStroke::QDrawingStroke() :
-    m_id(-1)
-{
+    if(!d->recorder->open(fileName, d->clock.nsecsElapsed()))
+    {
+        delete d->recorder;
+        d->recorder = 0;
+        return false;
+    }
 
+    return true;
 }
 
-quint32 QDrawingStroke::id()
+void QDrawingArea::stopRecording()
 {
-    return m_id;
-}
+    Q_D(QDrawingArea);
 
-QDrawingPen *QDrawingStroke::pen()
-{
-    return m_pen.data();
+    if(d->recorder)
+    {
+        d->recorder->close();
+        delete d->recorder;
+        d->recorder = 0;
+    }
 }
 
-void QDrawingStroke::setPen(QSharedPointer<QDrawingPen> pen)
+bool QDrawingArea::isRecording() const
 {
-    m_pen = pen;
+    Q_D(const QDrawingArea);
+
+    return d->recorder != 0;
 }
 
-QDrawingStroke &QDrawingStroke::operator<<(const QDrawingPoint &p)
+bool QDrawingArea::replayTrace(const QString &fileName, ReplayMode mode)
 {
-    m_newPoints.append(m_points.size());
-    m_points.append(p);
+    Q_D(QDrawingArea);
+
+    if(!d->replayer)
+    {
+        d->replayer = new TraceReplayer(d, this);
+        connect(d->replayer, &TraceReplayer::finished, this, &QDrawingArea::replayFinished);
+    }
 
-    m_dirty = true;
+    d->replayer->stop();
 
-    return *this;
-}
+    if(!d->replayer->load(fileName))
+        return false;
 
-bool QDrawingStroke::operator&(const QDrawingStroke &s)
-{
-    return false;
+    d->replayer->start(mode == ReplayOriginalTiming);
+
+    return true;
 }
 
-QDrawingPoint &QDrawingStroke::operator[](const unsigned long index)
+void QDrawingArea::stopReplay()
 {
-    return m_points[index];
+    Q_D(QDrawingArea);
+
+    if(d->replayer)
+        d->replayer->stop();
 }
 
-unsigned long QDrawingStroke::size() const
+int QDrawingArea::inputQueueDepth() const
 {
-    return m_points.size();
+    Q_D(const QDrawingArea);
+
+    return d->processor->samples.depth();
 }
 
-void QDrawingStroke::setId(quint32 id)
+int QDrawingArea::inputQueuePeakDepth() const
 {
-    m_id = id;
+    Q_D(const QDrawingArea);
+
+    return d->processor->samples.peakDepth();
 }
 
-void QDrawingStroke::setDirty(bool dirty, int at)
+int QDrawingArea::inputQueueOverflows() const
 {
-    m_dirty = dirty;
+    Q_D(const QDrawingArea);
 
-    if(at == -1)
-        m_dirtyAt = m_points.size() - 1;
-    else
-        m_dirtyAt = at;
+    return d->processor->samples.overflows();
 }
 
-bool QDrawingStroke::dirty()
+bool QDrawingArea::isInputIdle() const
 {
-    return m_dirty;
+    Q_D(const QDrawingArea);
+
+    // Samples taken off the queue still count until they are applied
+    return d->processor->processed.loadAcquire() == d->processor->samples.pushed();
 }
 
-int QDrawingStroke::dirtyAt()
+quint16 QDrawingArea::findPenFromButtons(Qt::MouseButtons buttons, QTabletEvent::PointerType pointer)
 {
-    return m_dirtyAt;
-}
+    Q_D(QDrawingArea);
+    int found = -1;
 
-QDrawingAreaPrivate::QDrawingAreaPrivate(QDrawingArea *q) : q_ptr(q), flags(0), drawingMode(0), ignoreFakeMouse(false), pixmap(1,1) {
-    qRegisterMetaType<QSharedPointer<QDrawingPen> >("QSharedPointer<QDrawingPen>");
-    processorThread = new QThread;
-    processor = new InputProcessor(this);
+    if(pointer < 0 || pointer >= QDrawingAreaPrivate::PointerTypes)
+        pointer = QTabletEvent::UnknownPointer;
 
-    processorThread->start();
-    processor->moveToThread(processorThread);
+    // Pens of the pointer on any held button come first, then the generic ones.  Within a table
+    // the earliest added pen wins.
+    int tables[] = { pointer, QTabletEvent::UnknownPointer };
 
-    rasterizerThread = new QThread;
-    rasterizer = new Rasterizer(this);
+    for(int table = 0; table < 2 && found < 0; table++)
+    {
+        quint32 held = buttons;
 
-    QObject::connect(q, &QDrawingArea::destroyed, processor, &QObject::deleteLater);
-    QObject::connect(q, &QDrawingArea::destroyed, rasterizer, &QObject::deleteLater);
-    QObject::connect(q, &QDrawingArea::destroyed, processorThread, &QObject::deleteLater);
-    QObject::connect(q, &QDrawingArea::destroyed, rasterizerThread, &QObject::deleteLater);
+        while(held)
+        {
+            int bit = qCountTrailingZeroBits(held);
+            int index = d->buttonPens[tables[table]][bit];
+
+            held &= held - 1;
+
+            if(index >= 0 && (found < 0 || index < found))
+                found = index;
+        }
+    }
 
-    // TODO: Connect repaint signal from input processor to rasterizer
-    QObject::connect(processor, &InputProcessor::repaint, rasterizer, &Rasterizer::repaint, Qt::QueuedConnection);
-    QObject::connect(rasterizer, &Rasterizer::updateRender, q, &QDrawingArea::updatePixmap);
+    return found >= 0 ? d->pens.at(found) : (quint16)QDrawingPen::InvalidId;
 }
 
-QDrawingAreaPrivate::~QDrawingAreaPrivate() {
-    processor->deleteLater();
-    processorThread->deleteLater();
+StrokePredictor::StrokePredictor() :
+    pen(QDrawingPen::InvalidId),
+    pressure(0),
+    timestamp(0),
+    samples(0)
+{
+
 }
 
-void QAbstractDrawingModelPrivate::generateRandomId()
+void StrokePredictor::add(quint16 pen, qreal x, qreal y, qreal pressure, qint64 timestamp)
 {
-    if(strokeMap.contains(currentId))
-        currentId++;
+    static const qreal Smoothing = 0.5;
+    QPointF point(x, y);
+    qreal dt = (timestamp - this->timestamp) / 1e6;
+
+    this->pen = pen;
+    this->pressure = pressure;
 
-    while(strokeMap.contains(currentId))
+    // Samples delivered in the same event carry no timing
+    if(samples > 0 && dt > 0)
     {
-        currentId = (quint32)qrand();
+        QPointF measured = (point - position) / dt;
+
+        if(samples > 1)
+        {
+            acceleration += ((measured - velocity) / dt - acceleration) * Smoothing;
+            velocity += (measured - velocity) * Smoothing;
+        }
+        else
+        {
+            velocity = measured;
+        }
     }
-}
 
-//QDrawingPen::QDrawingPen(Qt::MouseButton button, QColor color, qreal width, qreal orientationLock) :
+    if(samples == 0 || dt > 0)
+    {
+        this->timestamp = timestamp;
+        samples++;
+    }
+
+    position = point;
+}
+
+QVector<QDrawingPoint> StrokePredictor::predict(qreal horizon) const
+{
+    QVector<QDrawingPoint> points;
+
+    if(samples < 2 || horizon <= 0)
+        return points;
+
+    points.reserve(Steps);
+
+    for(int step = 1; step <= Steps; step++)
+    {
+        qreal t = horizon * step / Steps;
+        QPointF travel = velocity * t;
+        QPointF bend = samples > 2 ? acceleration * (0.5 * t * t) : QPointF();
+        qreal limit = qSqrt(QPointF::dotProduct(travel, travel));
+        qreal length = qSqrt(QPointF::dotProduct(bend, bend));
+
+        // Jittery acceleration must not swing the prediction further than the motion itself
+        if(length > limit)
+            bend *= limit / length;
+
+        QPointF point = position + travel + bend;
+
+        points << QDrawingPoint(point.x(), point.y(), pressure);
+    }
+
+    return points;
+}
+
+InputProcessor::InputProcessor(QDrawingAreaPrivate *d) : QObject(),
+    wakeupPending(0),
+    processed(0),
+    d(d),
+    pendingEventTime(-1),
+    predictionHorizon(0),
+    predicting(false)
+{
+
+}
+
+InputProcessor::~InputProcessor()
+{
+
+}
+
+void InputProcessor::moveToThread(QThread *targetThread)
+{
+    QObject::moveToThread(targetThread);
+}
+
+void InputProcessor::processPoint(quint32 deviceId, quint16 penId, qreal x, qreal y, qreal pressure)
+{
+    QAbstractDrawingModelPrivate *md = d->model_d;
+    QDrawingPen *pen = PenRegistry::pen(penId);
+    QDrawingPoint point(x, y, pressure);
+
+    // Samples from traces or callers of addStrokePoint() may name pens that were never registered
+    if(!pen)
+    {
+        qCWarning(lcDrawingInput) << "Dropped sample from" << deviceId << "with unknown pen" << penId;
+        return;
+    }
+
+    if(pen->isEraser())
+    {
+        processErasing(deviceId, pen, point);
+        return;
+    }
+
+    QMutexLocker locker(&md->writeLock);
+
+    QHash<quint32, quint32>::const_iterator active = deviceIdMap.constFind(deviceId);
+    QDrawingStroke *current = active != deviceIdMap.constEnd() ? md->strokes.modify(active.value()) : 0;
+
+    // New contact, or the stroke was replaced by loading a document
+    if(!current)
+    {
+        QDrawingStroke stroke;
+
+        stroke.d->pen = penId;
+        stroke.setCompact(md->compactStorage);
+
+        deviceIdMap[deviceId] = md->strokes.insert(stroke);
+        current = md->strokes.modify(deviceIdMap[deviceId]);
+
+        if(md->curveTolerance > 0)
+            fitters.insert(deviceId, CurveFitter(md->curveTolerance, pen->maxWidth() - pen->minWidth()));
+        else
+            fitters.remove(deviceId);
+
+        if(md->journal)
+            md->journal->strokeBegun(*current);
+    }
+
+    QDrawingStroke &stroke = *current;
+
+    // Normals are derived by the stroke itself, the predictor extrapolates its motion
+    stroke << point;
+
+    // The samples are kept until the stroke is finished, the wet layer and the journal use them
+    QHash<quint32, CurveFitter>::iterator fitter = fitters.find(deviceId);
+
+    if(fitter != fitters.end())
+        fitter->add(point.x(), point.y(), point.pressure());
+
+    if(stroke.size() > 1)
+    {
+        QDrawingPoint previous = stroke[stroke.size() - 2];
+
+        // The first segment replaces the dot the first point was indexed as
+        if(stroke.size() == 2)
+            md->spatialIndex.removeStroke(stroke.id());
+
+        md->spatialIndex.insert(stroke.id(), stroke.size() - 2, previous, point,
+                                qMax(stroke.pen()->calcWidth(previous.pressure()), stroke.pen()->calcWidth(point.pressure())));
+    }
+    else
+    {
+        md->spatialIndex.insert(stroke.id(), 0, point, point, stroke.pen()->calcWidth(point.pressure()));
+    }
+
+    qCDebug(lcDrawingInput) << "Added point to stroke" << stroke.id() << "with size" << stroke.size();
+
+    if(!modifiedStrokes.contains(stroke.id()))
+        modifiedStrokes << stroke.id();
+}
+
+void InputProcessor::finishPoint(quint32 deviceId)
+{
+    if(erasers.remove(deviceId))
+    {
+        HistoryEntry step = erasures.take(deviceId);
+        QAbstractDrawingModelPrivate *md = d->model_d;
+
+        if(!step.ids.isEmpty())
+        {
+            QMutexLocker locker(&md->writeLock);
+
+            md->record(step);
+        }
+    }
+    else if(deviceIdMap.contains(deviceId))
+    {
+        qCDebug(lcDrawingInput) << "Finished stroke" << deviceIdMap[deviceId] << "from" << deviceId;
+
+        quint32 id = deviceIdMap.take(deviceId);
+        QAbstractDrawingModelPrivate *md = d->model_d;
+        QMutexLocker locker(&md->writeLock);
+        QDrawingStroke *stroke = md->strokes.modify(id);
+        QHash<quint32, CurveFitter>::iterator fitter = fitters.find(deviceId);
+
+        if(stroke && fitter != fitters.end())
+        {
+            fitter->finish();
+
+            // Stored as curves once they are smaller than the samples
+            if(fitter->size() < (int)stroke->size())
+            {
+                qCDebug(lcDrawingInput) << "Fitted" << stroke->size() << "samples with" << fitter->size() << "control points";
+                stroke->setCurves(fitter->x.constData(), fitter->y.constData(), fitter->pressure.constData(), fitter->size());
+                md->spatialIndex.insertStroke(*stroke);
+            }
+        }
+
+        if(fitter != fitters.end())
+            fitters.erase(fitter);
+
+        if(stroke)
+        {
+            stroke->simplify();
+
+            if(md->journal)
+                md->journal->strokeFinished(*stroke);
+
+            HistoryEntry entry;
+
+            entry.ids << id;
+            entry.before << QDrawingStroke();
+            entry.after << *stroke;
+            md->record(entry);
+        }
+
+        md->publish();
+        d->scheduler->finish(id);
+    }
+}
+
+void InputProcessor::finishAllPoints()
+{
+    // Leaves the wet layer, whatever was drawn stays
+    foreach(quint32 id, deviceIdMap)
+        d->scheduler->finish(id);
+
+    deviceIdMap.clear();
+    fitters.clear();
+    predictors.clear();
+
+    // Erasing so far stays undoable
+    QList<quint32> devices = erasers.keys();
+
+    for(int i = 0; i < devices.size(); i++)
+        finishPoint(devices[i]);
+}
+
+QVector<OverlayStroke> InputProcessor::predict(qreal horizon) const
+{
+    QVector<OverlayStroke> prediction;
+
+    for(QHash<quint32, StrokePredictor>::const_iterator predictor = predictors.constBegin(); predictor != predictors.constEnd(); ++predictor)
+    {
+        QVector<QDrawingPoint> points = predictor->predict(horizon);
+
+        if(points.isEmpty())
+            continue;
+
+        // Throwaway stroke from the last real sample on, it never enters the model
+        QDrawingStroke stroke;
+        OverlayStroke predicted;
+
+        stroke.d->pen = predictor->pen;
+        stroke << QDrawingPoint(predictor->position.x(), predictor->position.y(), predictor->pressure);
+
+        for(int i = 0; i < points.size(); i++)
+            stroke << points[i];
+
+        predicted.color = stroke.pen()->color();
+        predicted.outline = StrokeTessellator::outline(stroke, stroke.pen(), 0, stroke.size() - 1);
+        prediction << predicted;
+    }
+
+    return prediction;
+}
+
+void InputProcessor::drainSamples()
+{
+    InputSample batch[DrainBatchSize];
+    int count, total = 0;
+    int horizon = predictionHorizon.load();
+
+    if(horizon <= 0)
+        predictors.clear();
+
+    // Samples pushed after this point post a new wakeup
+    wakeupPending.storeRelease(0);
+
+    while((count = samples.pop(batch, DrainBatchSize)) > 0)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            const InputSample &sample = batch[i];
+
+            if(sample.type == InputSample::Release)
+            {
+                finishPoint(sample.deviceId);
+                predictors.remove(sample.deviceId);
+            }
+            else if(PenRegistry::pen(sample.pen))
+            {
+                processPoint(sample.deviceId, sample.pen, sample.x, sample.y, sample.pressure);
+
+                if(horizon > 0 && !erasers.contains(sample.deviceId))
+                    predictors[sample.deviceId].add(sample.pen, sample.x, sample.y, sample.pressure, sample.timestamp);
+
+                if(pendingEventTime < 0 || sample.timestamp < pendingEventTime)
+                    pendingEventTime = sample.timestamp;
+            }
+        }
+
+        qint64 now = d->clock.nsecsElapsed();
+
+        for(int i = 0; i < count; i++)
+            d->metrics.stages[QDrawingAreaMetrics::Stage_Appended].add(now - batch[i].timestamp);
+
+        processed.fetchAndAddRelease(count);
+        total += count;
+    }
+
+    d->metrics.recordBatch(total);
+
+    // Replaces the overlay of the last batch, an empty one clears it
+    if(horizon > 0 || predicting)
+    {
+        QVector<OverlayStroke> prediction;
+
+        if(horizon > 0)
+            prediction = predict(horizon);
+
+        predicting = !prediction.isEmpty();
+        d->scheduler->setPrediction(prediction);
+    }
+
+    // The whole batch goes into the next frame
+    if(!modifiedStrokes.isEmpty())
+    {
+        d->scheduler->post(modifiedStrokes, pendingEventTime);
+        modifiedStrokes.clear();
+        pendingEventTime = -1;
+    }
+
+    if(total > 0)
+        QMetaObject::invokeMethod(d->q_ptr, "inputProcessed", Qt::QueuedConnection);
+}
+
+static void addChange(HistoryEntry &entry, quint32 id, const QDrawingStroke &before, const QDrawingStroke &after)
+{
+    int i = entry.ids.indexOf(id);
+
+    // A stroke erased more than once in one step keeps its state from before the step
+    if(i >= 0)
+    {
+        entry.after[i] = after;
+        return;
+    }
+
+    entry.ids << id;
+    entry.before << before;
+    entry.after << after;
+}
+
+void InputProcessor::processErasing(quint32 deviceId, const QDrawingPen *eraser, const QDrawingPoint &point)
+{
+    QAbstractDrawingModelPrivate *md = d->model_d;
+    QHash<quint32, QPointF>::const_iterator last = erasers.constFind(deviceId);
+    QPointF from = last != erasers.constEnd() ? last.value() : (QPointF)point;  // A new contact erases a dot
+    QPointF to = point;
+    qreal radius = eraser->calcWidth(point.pressure());    // Half-width, like the ink of any pen
+
+    erasers[deviceId] = to;
+
+    QMap<quint32, QVector<quint32> > cuts;     // By stroke id
+    QList<QDrawingStroke> removed, changed, inserted;
+    QList<int> changedAt;
+    QList<quint32> ids;
+    QList<quint32> active = deviceIdMap.values();
+    QRectF area;
+
+    {
+        QMutexLocker locker(&md->writeLock);
+
+        // Only the eraser segment since the last sample is tested, against the stroke segments near it
+        md->refineIndex(QRectF(from, to).normalized().adjusted(-radius, -radius, radius, radius));
+
+        QVector<StrokeSpatialIndex::Segment> hits = md->spatialIndex.segmentsAlong(from, to, radius);
+
+        for(int i = 0; i < hits.size(); i++)
+            cuts[hits[i].stroke] << hits[i].index;
+
+        HistoryEntry &step = erasures[deviceId];
+
+        for(QMap<quint32, QVector<quint32> >::const_iterator cut = cuts.constBegin(); cut != cuts.constEnd(); ++cut)
+        {
+            quint32 id = cut.key();
+            const QDrawingStroke *found = md->strokes.find(id);
+            QList<QDrawingStroke> pieces;
+            int unchanged = 0;
+
+            // Strokes that are still being drawn are left alone
+            if(!found || active.contains(id))
+                continue;
+
+            QDrawingStroke before = *found;
+
+            if(eraser->mode() == QDrawingPen::Mode_PreciseEraser &&
+                    !cutStroke(before, cut.value(), from, to, radius, &pieces, &unchanged))
+                continue;
+
+            area |= inkBounds(before);
+            ids << id;
+
+            if(md->journal)
+                md->journal->strokeRemoved(id);
+
+            if(pieces.isEmpty())
+            {
+                md->strokes.remove(id);
+                md->spatialIndex.removeStroke(id);
+                addChange(step, id, before, QDrawingStroke());
+                removed << before;
+                continue;
+            }
+
+            // The first piece keeps the id, the others follow it in drawing order
+            quint32 pieceId = id;
+
+            for(int i = 0; i < pieces.size(); i++)
+            {
+                if(i == 0)
+                {
+                    pieces[0].setId(id);
+                    *md->strokes.modify(id) = pieces[0];
+                }
+                else
+                {
+                    pieceId = md->strokes.insertAfter(pieceId, pieces[i]);
+                    ids << pieceId;
+                }
+
+                const QDrawingStroke &piece = *md->strokes.find(pieceId);
+
+                md->spatialIndex.insertStroke(piece);
+
+                if(md->journal)
+                {
+                    md->journal->strokeBegun(piece);
+                    md->journal->strokeFinished(piece);
+                }
+
+                addChange(step, pieceId, i == 0 ? before : QDrawingStroke(), piece);
+
+                if(i == 0)
+                {
+                    changed << piece;
+                    changedAt << unchanged;
+                }
+                else
+                {
+                    inserted << piece;
+                }
+            }
+        }
+
+        if(!ids.isEmpty())
+            md->publish();
+    }
+
+    if(ids.isEmpty())
+        return;
+
+    qCDebug(lcDrawingInput) << "Erased" << removed.size() << "strokes and cut" << changed.size() << "from" << deviceId;
+
+    // Emitted on the thread of the model like its other changes, views may connect directly
+    QAbstractDrawingModel *model = d->model;
+
+    for(int i = 0; i < removed.size(); i++)
+        QMetaObject::invokeMethod(model, "strokeRemoved", Qt::QueuedConnection, Q_ARG(QDrawingStroke, removed[i]));
+
+    for(int i = 0; i < changed.size(); i++)
+    {
+        QMetaObject::invokeMethod(model, "strokeChanged", Qt::QueuedConnection,
+                                  Q_ARG(QDrawingStroke, changed[i]), Q_ARG(int, changedAt[i]));
+    }
+
+    for(int i = 0; i < inserted.size(); i++)
+        QMetaObject::invokeMethod(model, "strokeInserted", Qt::QueuedConnection, Q_ARG(QDrawingStroke, inserted[i]));
+
+    // Only the tiles under the erased strokes are rendered again
+    QMetaObject::invokeMethod(model, "strokesChanged", Qt::QueuedConnection,
+                              Q_ARG(QList<quint32>, ids), Q_ARG(QRectF, area));
+}
+
+bool InputProcessor::cutStroke(const QDrawingStroke &stroke, const QVector<quint32> &cuts, const QPointF &from,
+                               const QPointF &to, qreal radius, QList<QDrawingStroke> *pieces, int *unchanged)
+{
+    int count = stroke.size();
+    QVector<float> x(count), y(count);
+    QVector<quint16> pressure(count);
+    bool fromStart = false;
+
+    if(count < 2)
+        return true;
+
+    stroke.d->copyPoints(0, count, x.data(), y.data(), pressure.data());
+
+    if(stroke.hasCurves() ? !cutCurves(stroke, x, y, pressure, cuts, from, to, radius, pieces, &fromStart)
+                          : !cutPoints(stroke, x, y, pressure, cuts, pieces, &fromStart))
+        return false;
+
+    *unchanged = 0;
+
+    // Views redraw from the first point the piece no longer shares with the stroke
+    if(fromStart && !pieces->isEmpty())
+    {
+        const QDrawingStroke &piece = pieces->first();
+        int size = qMin((int)piece.size(), count), same = 0;
+        QVector<float> pieceX(size), pieceY(size);
+        QVector<quint16> piecePressure(size);
+
+        piece.d->copyPoints(0, size, pieceX.data(), pieceY.data(), piecePressure.data());
+
+        while(same < size && pieceX[same] == x[same] && pieceY[same] == y[same] &&
+              piecePressure[same] == pressure[same])
+            same++;
+
+        *unchanged = same;
+    }
+
+    return true;
+}
+
+bool InputProcessor::cutPoints(const QDrawingStroke &stroke, const QVector<float> &x, const QVector<float> &y,
+                               const QVector<quint16> &pressure, const QVector<quint32> &cuts,
+                               QList<QDrawingStroke> *pieces, bool *fromStart)
+{
+    int count = x.size();
+    QVector<float> floatPressure(count);
+
+    // Segment i runs from point i to point i + 1
+    QVector<bool> cut(count, false);
+
+    for(int i = 0; i < cuts.size(); i++)
+    {
+        if(cuts[i] + 1 < (quint32)count)
+            cut[cuts[i]] = true;
+    }
+
+    if(!cut.contains(true))
+        return false;
+
+    for(int i = 0; i < count; i++)
+        floatPressure[i] = pressure[i] / 65535.0f;
+
+    *fromStart = !cut[0];
+
+    // What is left between cut segments, lone points are erased along with them
+    for(int start = 0, i = 0; i < count; i++)
+    {
+        if(i + 1 < count && !cut[i])
+            continue;
+
+        if(i > start)
+            addPiece(stroke, x.constData() + start, y.constData() + start, floatPressure.constData() + start, i - start + 1, pieces);
+
+        start = i + 1;
+    }
+
+    return true;
+}
+
+bool InputProcessor::cutCurves(const QDrawingStroke &stroke, const QVector<float> &x, const QVector<float> &y,
+                               const QVector<quint16> &pressure, const QVector<quint32> &cuts, const QPointF &from,
+                               const QPointF &to, qreal radius, QList<QDrawingStroke> *pieces, bool *fromStart)
+{
+    int count = x.size();
+    QDrawingPen *pen = stroke.pen();
+    QVector<float> pieceX, pieceY, piecePressure;   // Control points of the piece being built
+    bool hit = false;
+
+    // Curves the eraser missed keep their control points, hit curves are split where it crossed them
+    for(int s = 0; s + 3 < count; s += 3)
+    {
+        float cx[4], cy[4], cp[4];
+        QVector<bool> cut;
+
+        for(int i = 0; i < 4; i++)
+        {
+            cx[i] = x[s + i];
+            cy[i] = y[s + i];
+            cp[i] = pressure[s + i] / 65535.0f;
+        }
+
+        // Tested along the same flattened path the index holds
+        if(cuts.contains(s))
+        {
+            QVector<float> flatX, flatY;
+            QVector<quint16> flatPressure;
+
+            CurveFitter::flatten(x.constData() + s, y.constData() + s, pressure.constData() + s, 4, IndexFlatness,
+                                 flatX, flatY, flatPressure);
+
+            for(int i = 0; i + 1 < flatX.size(); i++)
+            {
+                qreal width = qMax(pen->calcWidth(flatPressure[i] / 65535.0), pen->calcWidth(flatPressure[i + 1] / 65535.0));
+
+                cut << (segmentDistance(from, to, QPointF(flatX[i], flatY[i]), QPointF(flatX[i + 1], flatY[i + 1])) <= width + radius);
+            }
+        }
+
+        if(!cut.contains(true))
+        {
+            if(pieceX.isEmpty())
+            {
+                pieceX << cx[0];
+                pieceY << cy[0];
+                piecePressure << cp[0];
+                *fromStart = *fromStart || s == 0;
+            }
+
+            pieceX << cx[1] << cx[2] << cx[3];
+            pieceY << cy[1] << cy[2] << cy[3];
+            piecePressure << cp[1] << cp[2] << cp[3];
+            continue;
+        }
+
+        // Flattening steps evenly in t, so what is left between cut steps is the curve between their t
+        int steps = cut.size();
+
+        hit = true;
+
+        for(int start = 0, i = 0; i <= steps; i++)
+        {
+            if(i < steps && !cut[i])
+                continue;
+
+            if(i > start)
+            {
+                float px[4], py[4], pp[4];
+
+                subCurve(cx, (qreal)start / steps, (qreal)i / steps, px);
+                subCurve(cy, (qreal)start / steps, (qreal)i / steps, py);
+                subCurve(cp, (qreal)start / steps, (qreal)i / steps, pp);
+
+                if(pieceX.isEmpty())
+                {
+                    pieceX << px[0];
+                    pieceY << py[0];
+                    piecePressure << pp[0];
+                    *fromStart = *fromStart || (s == 0 && start == 0);
+                }
+
+                pieceX << px[1] << px[2] << px[3];
+                pieceY << py[1] << py[2] << py[3];
+                piecePressure << pp[1] << pp[2] << pp[3];
+            }
+
+            // A cut step ends the piece, lone points are erased along with it
+            if(i < steps)
+            {
+                if(pieceX.size() > 1)
+                    addPiece(stroke, pieceX.constData(), pieceY.constData(), piecePressure.constData(), pieceX.size(), pieces);
+
+                pieceX.clear();
+                pieceY.clear();
+                piecePressure.clear();
+            }
+
+            start = i + 1;
+        }
+    }
+
+    if(!hit)
+        return false;
+
+    if(pieceX.size() > 1)
+        addPiece(stroke, pieceX.constData(), pieceY.constData(), piecePressure.constData(), pieceX.size(), pieces);
+
+    return true;
+}
+
+void InputProcessor::addPiece(const QDrawingStroke &stroke, const float *x, const float *y, const float *pressure,
+                              int count, QList<QDrawingStroke> *pieces)
+{
+    QDrawingStroke piece;
+
+    piece.d->pen = stroke.d->pen;
+    piece.setCompact(stroke.isCompact());
+
+    if(stroke.hasCurves())
+        piece.setCurves(x, y, pressure, count);
+    else
+        piece.append(x, y, pressure, count);
+
+    piece.simplify();
+    *pieces << piece;
+}
+
+QDrawingPoint::QDrawingPoint() :
+    m_x(0),
+    m_y(0),
+    m_pressure(0),
+    m_normal(QVector2D())
+{
+
+}
+
+QDrawingPoint::QDrawingPoint(qreal xpos, qreal ypos, qreal pressure, QVector2D normal) :
+    m_x(xpos),
+    m_y(ypos),
+    m_pressure(pressure),
+    m_normal(normal)
+{
+}
+
+qreal QDrawingPoint::x() const
+{
+    return m_x;
+}
+
+qreal QDrawingPoint::y() const
+{
+    return m_y;
+}
+
+qreal QDrawingPoint::pressure() const
+{
+    return m_pressure;
+}
+
+QVector2D QDrawingPoint::normal() const
+{
+    return m_normal;
+}
+
+QDrawingPoint::operator QPointF() const
+{
+    return QPointF(m_x, m_y);
+}
+
+void QDrawingPoint::setX(qreal x)
+{
+    m_x = x;
+}
+
+void QDrawingPoint::setY(qreal y)
+{
+    m_y = y;
+}
+
+void QDrawingPoint::setPressure(qreal pressure)
+{
+    m_pressure = pressure;
+}
+
+void QDrawingPoint::setNormal(QVector2D normal)
+{
+    m_normal = normal;
+}
+
+
+QDrawingAreaPrivate::QDrawingAreaPrivate(QDrawingArea *q) : q_ptr(q), flags(0), drawingMode(0), eventTime(-1), paintEventTime(-1), recorder(0), replayer(0), ignoreFakeMouse(false), viewScale(q->logicalDpiX() / 25.4), nextTouchId(0), model(0), model_d(0) {
+    qRegisterMetaType<RasterTileUpdate>("RasterTileUpdate");
+    qRegisterMetaType<QDrawingStroke>("QDrawingStroke");
+    qRegisterMetaType<QList<quint32> >("QList<quint32>");
+    clock.start();
+    q->setAttribute(Qt::WA_AcceptTouchEvents);
+    std::fill(&buttonPens[0][0], &buttonPens[0][0] + PointerTypes * ButtonBits, -1);
+    scheduler = new FrameScheduler(this);
+    processorThread = new QThread;
+    processor = new InputProcessor(this);
+
+    processorThread->start();
+    processor->moveToThread(processorThread);
+
+    rasterizerThread = new QThread;
+    rasterizer = new Rasterizer(this);
+
+    QObject::connect(q, &QDrawingArea::destroyed, processor, &QObject::deleteLater);
+    QObject::connect(q, &QDrawingArea::destroyed, rasterizer, &QObject::deleteLater);
+    QObject::connect(q, &QDrawingArea::destroyed, processorThread, &QObject::deleteLater);
+    QObject::connect(q, &QDrawingArea::destroyed, rasterizerThread, &QObject::deleteLater);
+
+    QObject::connect(rasterizer, &Rasterizer::updateRender, q, &QDrawingArea::updateTiles);
+}
+
+void QDrawingAreaPrivate::wakeProcessor()
+{
+    // One queued call per batch, not per sample
+    if(processor->wakeupPending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(processor, "drainSamples", Qt::QueuedConnection);
+}
+
+InputSample QDrawingAreaPrivate::pointSample(quint32 deviceId, quint16 pen, qreal x, qreal y, qreal pressure) const
+{
+    if(flags & QDrawingArea::D_EmulatePressure)
+    {
+        pressure = (QTime::currentTime().second() % 2 ? QTime::currentTime().msec() : 1000 - QTime::currentTime().msec()) / 1000.0;
+//        pressure = QTime::currentTime().second() % 2;
+    }
+
+    InputSample sample;
+    QPointF position = mapToDocument(QPointF(x, y));
+
+    sample.deviceId = deviceId;
+    sample.pen = pen;
+    sample.type = InputSample::Move;
+    sample.x = position.x();
+    sample.y = position.y();
+    sample.pressure = pressure;
+    sample.timestamp = eventTime >= 0 ? eventTime : clock.nsecsElapsed();
+
+    return sample;
+}
+
+InputSample QDrawingAreaPrivate::releaseSample(quint32 deviceId) const
+{
+    InputSample sample;
+
+    sample.deviceId = deviceId;
+    sample.pen = QDrawingPen::InvalidId;
+    sample.type = InputSample::Release;
+    sample.x = sample.y = sample.pressure = 0;
+    sample.timestamp = eventTime >= 0 ? eventTime : clock.nsecsElapsed();
+
+    return sample;
+}
+
+void QDrawingAreaPrivate::touchEvent(QTouchEvent *event)
+{
+    const QTouchDevice *device = event->device();
+    const QList<QTouchEvent::TouchPoint> &points = event->touchPoints();
+    QVarLengthArray<InputSample, 32> batch;
+    // Fingers draw with the pen of the primary button
+    quint16 pen = q_ptr->findPenFromButtons(Qt::LeftButton);
+    bool pressure = device && (device->capabilities() & QTouchDevice::Pressure);
+
+    // A cancelled sequence ends every contact of its device, whatever the points say
+    if(event->type() == QEvent::TouchCancel)
+    {
+        for(QHash<TouchKey, quint32>::iterator contact = touchPointMap.begin(); contact != touchPointMap.end();)
+        {
+            if(contact.key().first == device)
+            {
+                batch.append(releaseSample(contact.value()));
+                contact = touchPointMap.erase(contact);
+            }
+            else
+            {
+                ++contact;
+            }
+        }
+    }
+    else
+    {
+        for(int i = 0; i < points.size(); i++)
+        {
+            const QTouchEvent::TouchPoint &point = points[i];
+            TouchKey key(device, point.id());
+
+            if(point.state() == Qt::TouchPointReleased)
+            {
+                QHash<TouchKey, quint32>::iterator contact = touchPointMap.find(key);
+
+                if(contact != touchPointMap.end())
+                {
+                    batch.append(releaseSample(contact.value()));
+                    touchPointMap.erase(contact);
+                }
+            }
+            else if(point.state() != Qt::TouchPointStationary && pen != QDrawingPen::InvalidId)
+            {
+                QHash<TouchKey, quint32>::iterator contact = touchPointMap.find(key);
+
+                if(contact == touchPointMap.end())
+                    contact = touchPointMap.insert(key, TouchIdBase | (nextTouchId++ & TouchIdMask));
+
+                batch.append(pointSample(contact.value(), pen, point.pos().x(), point.pos().y(),
+                                         pressure ? point.pressure() : 1));
+            }
+        }
+    }
+
+    if(!batch.isEmpty())
+        enqueueSamples(batch.constData(), batch.size());
+}
+
+bool QDrawingAreaPrivate::enqueueSamples(const InputSample *samples, int count)
+{
+    int pushed = processor->samples.push(samples, count);
+    qint64 now = clock.nsecsElapsed();
+
+    metrics.samples.fetchAndAddRelaxed(pushed);
+
+    for(int i = 0; i < pushed; i++)
+        metrics.stages[QDrawingAreaMetrics::Stage_Enqueued].add(now - samples[i].timestamp);
+
+    for(int i = pushed; i < count; i++)
+    {
+        // See enqueueSample(), releases are never dropped
+        if(samples[i].type == InputSample::Release)
+        {
+            QMetaObject::invokeMethod(processor, "finishPoint",
+                                      Qt::QueuedConnection,
+                                      Q_ARG(quint32, samples[i].deviceId));
+        }
+    }
+
+    if(pushed > 0)
+        wakeProcessor();
+
+    if(recorder)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(i < pushed || samples[i].type == InputSample::Release)
+                recordSample(samples[i]);
+        }
+    }
+
+    return pushed == count;
+}
+
+bool QDrawingAreaPrivate::enqueueSample(const InputSample &sample)
+{
+    if(processor->samples.push(sample))
+    {
+        metrics.samples.ref();
+        metrics.stages[QDrawingAreaMetrics::Stage_Enqueued].add(clock.nsecsElapsed() - sample.timestamp);
+        wakeProcessor();
+    }
+    else if(sample.type == InputSample::Release)
+    {
+        // A lost release would leave the stroke open forever.  The queue is full, so a drain is
+        // already pending and this call is delivered after it.
+        QMetaObject::invokeMethod(processor, "finishPoint",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(quint32, sample.deviceId));
+    }
+    else
+    {
+        // Dropped samples are counted by the queue
+        return false;
+    }
+
+    if(recorder)
+        recordSample(sample);
+
+    return true;
+}
+
+void QDrawingAreaPrivate::recordSample(const InputSample &sample)
+{
+    InputSample recorded = sample;
+
+    // Registry ids differ between runs, traces refer to pens by the order they were added
+    recorded.pen = pens.indexOf(sample.pen);
+    recorder->record(recorded);
+}
+
+QDrawingAreaPrivate::~QDrawingAreaPrivate() {
+    delete scheduler;
+    processor->deleteLater();
+    processorThread->deleteLater();
+}
+
+QPoint QDrawingAreaPrivate::viewOffset() const
+{
+    return (viewOrigin * viewScale).toPoint();
+}
+
+QRect QDrawingAreaPrivate::viewArea(int margin) const
+{
+    int grow = margin * TileLevel::TileSize;
+
+    return QRect(viewOffset(), q_ptr->size()).adjusted(-grow, -grow, grow, grow);
+}
+
+QPointF QDrawingAreaPrivate::mapToDocument(const QPointF &position) const
+{
+    return (position + viewOffset()) / viewScale;
+}
+
+QRect QDrawingAreaPrivate::mapFromDocument(const QRectF &rect) const
+{
+    QPoint offset = viewOffset();
+
+    // Antialiasing reaches a pixel past the outline
+    return QRectF(rect.topLeft() * viewScale - offset, rect.size() * viewScale).toAlignedRect().adjusted(-2, -2, 2, 2);
+}
+
+void QDrawingAreaPrivate::setPrediction(const QVector<OverlayStroke> &strokes)
+{
+    QRect bounds;
+
+    for(int i = 0; i < strokes.size(); i++)
+        bounds |= mapFromDocument(strokes[i].outline.boundingRect());
+
+    q_ptr->update(predictionRect | bounds);
+    prediction = strokes;
+    predictionRect = bounds;
+}
+
+//QDrawingPen::QDrawingPen(Qt::MouseButton button, QColor color, qreal width, qreal orientationLock) :
 //    m_button(button),
 //    m_color(color),
 //    m_minWidth(width),
@@ -562,262 +1721,1688 @@ void QAbstractDrawingModelPrivate::generateRandomId()
 //
 //}
 
-QDrawingPen::QDrawingPen(Qt::MouseButton button, QColor color, qreal minWidth, qreal maxWidth, qreal orientationLock) :
-    m_button(button),
-    m_color(color),
-    m_minWidth(minWidth),
-    m_maxWidth(maxWidth == 0 ? minWidth : maxWidth),
-    m_orientationLock(orientationLock)
+QDrawingPen::QDrawingPen(Qt::MouseButton button, QColor color, qreal minWidth, qreal maxWidth, qreal orientationLock) :
+    m_button(button),
+    m_color(color),
+    m_minWidth(minWidth),
+    m_maxWidth(maxWidth == 0 ? minWidth : maxWidth),
+    m_orientationLock(orientationLock),
+    m_mode(Mode_FeltTipPen)
+{
+
+}
+
+QDrawingPen::QDrawingPen(const QDrawingPen &other) :
+    m_button(other.m_button),
+    m_color(other.m_color),
+    m_minWidth(other.m_minWidth),
+    m_maxWidth(other.m_maxWidth),
+    m_orientationLock(other.m_orientationLock),
+    m_mode(other.m_mode)
+{
+
+}
+
+Qt::MouseButton QDrawingPen::button() const
+{
+    return m_button;
+}
+
+QColor QDrawingPen::color() const
+{
+    return m_color;
+}
+
+qreal QDrawingPen::minWidth() const
+{
+    return m_minWidth;
+}
+
+qreal QDrawingPen::maxWidth() const
+{
+    return m_maxWidth;
+}
+
+bool QDrawingPen::isVariableWidth() const
+{
+    // No fuzzy comparison needed
+    return m_minWidth != m_maxWidth;
+}
+
+bool QDrawingPen::isOrientationLocked() const
+{
+    return !qIsNaN(m_orientationLock);
+}
+
+qreal QDrawingPen::orientationLock() const
+{
+    return m_orientationLock;
+}
+
+int QDrawingPen::mode() const
+{
+    return m_mode;
+}
+
+void QDrawingPen::setMode(int mode)
+{
+    m_mode = mode;
+}
+
+bool QDrawingPen::isEraser() const
+{
+    return m_mode == Mode_Eraser || m_mode == Mode_PreciseEraser;
+}
+
+
+FrameScheduler::FrameScheduler(QDrawingAreaPrivate *d) :
+    d(d),
+    pendingEventTime(-1),
+    predictionPending(false),
+    requested(0),
+    requestTime(0),
+    rate(0),
+    lastFrame(-1),
+    target(-1)
+{
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+
+    predictionTimer.setSingleShot(true);
+
+    connect(&timer, &QTimer::timeout, this, &FrameScheduler::frame);
+    connect(&predictionTimer, &QTimer::timeout, this, &FrameScheduler::expirePrediction);
+}
+
+void FrameScheduler::post(const QList<int> &modifiedStrokes, qint64 eventTime)
+{
+    lock.lock();
+
+    for(int i = 0; i < modifiedStrokes.size(); i++)
+    {
+        if(!pendingStrokes.contains(modifiedStrokes[i]))
+            pendingStrokes << modifiedStrokes[i];
+    }
+
+    if(eventTime >= 0 && (pendingEventTime < 0 || eventTime < pendingEventTime))
+        pendingEventTime = eventTime;
+
+    lock.unlock();
+
+    requestFrame();
+}
+
+void FrameScheduler::finish(int stroke)
+{
+    lock.lock();
+    pendingFinished << stroke;
+    lock.unlock();
+
+    requestFrame();
+}
+
+void FrameScheduler::setPrediction(const QVector<OverlayStroke> &prediction)
+{
+    lock.lock();
+    pendingPrediction = prediction;
+    predictionPending = true;
+    lock.unlock();
+
+    requestFrame();
+}
+
+void FrameScheduler::requestFrame()
+{
+    // One queued call per frame, however many batches arrive before it
+    if(requested.testAndSetOrdered(0, 1))
+    {
+        requestTime.store(d->clock.nsecsElapsed());
+        QMetaObject::invokeMethod(this, "schedule", Qt::QueuedConnection);
+    }
+}
+
+void FrameScheduler::setRate(int framesPerSecond)
+{
+    rate = qMax(framesPerSecond, 0);
+}
+
+qint64 FrameScheduler::interval() const
+{
+    qreal perSecond = rate;
+
+    if(perSecond <= 0)
+    {
+        QWindow *window = d->q_ptr->window()->windowHandle();
+        QScreen *screen = window ? window->screen() : QGuiApplication::primaryScreen();
+
+        perSecond = screen ? screen->refreshRate() : 0;
+    }
+
+    if(perSecond <= 0)
+        perSecond = 60;
+
+    return qRound64(1e9 / perSecond);
+}
+
+void FrameScheduler::schedule()
+{
+    if(timer.isActive())
+        return;
+
+    qint64 now = d->clock.nsecsElapsed();
+
+    // Input after an idle period is drawn right away, bursts wait for the next refresh
+    target = requestTime.load();
+
+    if(lastFrame >= 0)
+        target = qMax(target, lastFrame + interval());
+
+    if(target <= now)
+        frame();
+    else
+        timer.start((target - now + 999999) / 1000000);
+}
+
+void FrameScheduler::frame()
+{
+    QAbstractDrawingModelPrivate *md = d->model_d;
+    qint64 now = d->clock.nsecsElapsed();
+    qint64 period = interval();
+    QList<int> strokes, finished;
+    qint64 eventTime;
+    QVector<OverlayStroke> prediction;
+    bool predicted;
+
+    // Requests from here on are for the next frame
+    requested.storeRelease(0);
+
+    // Refreshes that passed while this frame was due, e.g. behind an overlong previous one
+    if(target >= 0 && now - target >= period)
+        d->metrics.droppedFrames.fetchAndAddRelaxed((now - target) / period);
+
+    lastFrame = now;
+    target = -1;
+
+    lock.lock();
+    strokes.swap(pendingStrokes);
+    finished.swap(pendingFinished);
+    eventTime = pendingEventTime;
+    pendingEventTime = -1;
+    prediction.swap(pendingPrediction);
+    predicted = predictionPending;
+    predictionPending = false;
+    lock.unlock();
+
+    if(!strokes.isEmpty())
+    {
+        qCDebug(lcDrawingInput) << "Frame with" << strokes.size() << "strokes";
+        d->metrics.frames.ref();
+        d->metrics.frameStrokes.fetchAndAddRelaxed(strokes.size());
+
+        md->writeLock.lock();
+
+        if(md->journal)
+        {
+            for(int i = 0; i < strokes.size(); i++)
+            {
+                const QDrawingStroke *stroke = md->strokes.find(strokes[i]);
+
+                if(stroke)
+                    md->journal->appendPoints(*stroke);
+            }
+        }
+
+        md->publish();
+        md->writeLock.unlock();
+    }
+
+    d->rasterizer->repaint(strokes, finished, eventTime);
+
+    // Drawn over the ink of the same batch, and dropped if no sample follows it up in time
+    if(predicted)
+    {
+        d->setPrediction(prediction);
+
+        if(prediction.isEmpty())
+            predictionTimer.stop();
+        else
+            predictionTimer.start(qMax<qint64>(2 * d->processor->predictionHorizon.load(), 2 * period / 1000000));
+    }
+}
+
+void FrameScheduler::expirePrediction()
+{
+    d->setPrediction(QVector<OverlayStroke>());
+}
+
+QRect TileLevel::rect(quint64 key)
+{
+    int column = (qint32)(key >> 32);
+    int row = (qint32)(quint32)key;
+
+    return QRect(column * TileSize, row * TileSize, TileSize, TileSize);
+}
+
+QVector<quint64> TileLevel::keysIn(const QRect &area)
+{
+    QVector<quint64> keys;
+
+    if(area.isEmpty())
+        return keys;
+
+    int left = qFloor(area.left() / (qreal)TileSize), right = qFloor(area.right() / (qreal)TileSize);
+    int top = qFloor(area.top() / (qreal)TileSize), bottom = qFloor(area.bottom() / (qreal)TileSize);
+
+    keys.reserve((right - left + 1) * (bottom - top + 1));
+
+    for(int row = top; row <= bottom; row++)
+    {
+        for(int column = left; column <= right; column++)
+            keys << key(column, row);
+    }
+
+    return keys;
+}
+
+void TileLevel::evict(const QRect &area)
+{
+    QHash<quint64, QImage>::iterator tile = tiles.begin();
+
+    while(tile != tiles.end())
+    {
+        if(rect(tile.key()).intersects(area))
+            ++tile;
+        else
+            tile = tiles.erase(tile);
+    }
+}
+
+
+/**
+ * @brief Renders one tile row of a frame, for QtConcurrent.
+ */
+struct Rasterizer::Band
+{
+    typedef void result_type;
+
+    explicit Band(const Frame *frame) : frame(frame) {}
+
+    void operator()(int band) const
+    {
+        Rasterizer::renderBand(*frame, band);
+    }
+
+    const Frame *frame;
+};
+
+Rasterizer::Rasterizer(QDrawingAreaPrivate *d) :
+    d(d),
+    invalidated(false),
+    deferredEventTime(-1)
+{
+    connect(&refineWatcher, &QFutureWatcherBase::finished, this, &Rasterizer::refineFinished);
+}
+
+void Rasterizer::moveToThread(QThread *targetThread)
+{
+    QObject::moveToThread(targetThread);
+    refineWatcher.moveToThread(targetThread);
+}
+
+void Rasterizer::repaint(QList<int> modifiedStrokes, QList<int> finishedStrokes, qint64 eventTime)
+{
+    // New ink waits for the tiles being rendered and is drawn once they are in
+    if(refineWatcher.isRunning())
+    {
+        defer(modifiedStrokes, finishedStrokes, eventTime);
+        return;
+    }
+
+    qreal scale = d->viewScale;
+    QRect view = d->viewArea();
+
+    if(!changedStrokes.isEmpty())
+    {
+        QDrawingSnapshot snapshot = d->model_d->snapshot();
+        QRect area = QRectF(invalidArea.topLeft() * level.scale, invalidArea.bottomRight() * level.scale)
+                .toAlignedRect().adjusted(-2, -2, 2, 2);
+        QVector<quint64> keys = TileLevel::keysIn(area & d->viewArea(KeptTiles));
+
+        // Tiles under the change are rendered again below with the strokes as they are now
+        for(int i = 0; i < changedStrokes.size(); i++)
+        {
+            const QDrawingStroke *stroke = snapshot.d->strokes.find(changedStrokes[i]);
+
+            if(stroke)
+                drawnPoints[stroke->id()] = stroke->size();
+            else
+                drawnPoints.remove(changedStrokes[i]);
+        }
+
+        for(int i = 0; i < keys.size(); i++)
+            level.tiles.remove(keys[i]);
+
+        qCDebug(lcDrawingRaster) << "Invalidated" << keys.size() << "tiles for" << changedStrokes.size() << "strokes";
+        changedStrokes.clear();
+        invalidArea = QRectF();
+    }
+
+    if(invalidated || scale != level.scale)
+    {
+        qCDebug(lcDrawingRaster) << "Full repaint at" << scale << "px/mm";
+        invalidated = false;
+        defer(modifiedStrokes, finishedStrokes, eventTime);
+        startRefine(true, TileLevel::keysIn(view));
+        return;
+    }
+
+    QRect kept = d->viewArea(KeptTiles);
+    QVector<quint64> visible = TileLevel::keysIn(view);
+    QVector<quint64> missing;
+
+    level.evict(kept);
+
+    for(int i = 0; i < visible.size(); i++)
+    {
+        if(!level.tiles.contains(visible[i]))
+            missing << visible[i];
+    }
+
+    // Panned or resized, only the newly exposed tiles are rendered
+    if(!missing.isEmpty())
+    {
+        qCDebug(lcDrawingRaster) << "Rendering" << missing.size() << "exposed tiles";
+        defer(modifiedStrokes, finishedStrokes, eventTime);
+        startRefine(false, missing);
+        return;
+    }
+
+    if(modifiedStrokes.isEmpty() && finishedStrokes.isEmpty())
+        return;
+
+    RasterTileUpdate update;
+    Frame frame;
+    QSet<quint64> dirty;
+    QRectF wetDirty;
+    QElapsedTimer duration;
+    qCDebug(lcDrawingRaster) << "Rasterize";
+
+    duration.start();
+
+    // Consistent for the whole frame while the InputProcessor keeps appending
+    QDrawingSnapshot snapshot = d->model_d->snapshot();
+    const StrokeStore &store = snapshot.d->strokes;
+
+    frame.scale = scale;
+    frame.smooth = d->flags & QDrawingArea::SmoothCurves;
+
+    // Active strokes only grow their wet outline, the tiles are left alone
+    for(int i = 0; i < modifiedStrokes.size(); i++)
+    {
+        const QDrawingStroke *stroke = store.find(modifiedStrokes[i]);
+        QMap<quint32, WetStroke>::iterator w = wet.find(modifiedStrokes[i]);
+
+        if(!stroke)
+        {
+            if(w != wet.end())
+            {
+                wetDirty |= w->outline.boundingRect();
+                wet.erase(w);
+            }
+
+            continue;
+        }
+
+        if(w == wet.end())
+        {
+            WetStroke added;
+
+            added.drawn = drawnPoints.value(stroke->id(), 0);
+            added.color = stroke->pen()->color();
+            added.outline.setFillRule(Qt::WindingFill);
+            w = wet.insert(stroke->id(), added);
+        }
+
+        int last = stroke->size() - 1;
+        int from = qMax(w->drawn - 1, 0);
+
+        if(w->drawn > last)
+            continue;
+
+        // One winding path per stroke, so overlapping pieces are filled once
+        QPainterPath piece = StrokeTessellator::outline(*stroke, stroke->pen(), from, last);
+
+        w->outline.addPath(piece);
+        w->drawn = last + 1;
+        wetDirty |= piece.boundingRect();
+    }
+
+    // Finished strokes are baked into the tiles once, from where the tiles left off
+    for(int i = 0; i < finishedStrokes.size(); i++)
+    {
+        const QDrawingStroke *stroke = store.find(finishedStrokes[i]);
+        QMap<quint32, WetStroke>::iterator w = wet.find(finishedStrokes[i]);
+
+        if(w != wet.end())
+        {
+            wetDirty |= w->outline.boundingRect();
+            wet.erase(w);
+        }
+
+        if(!stroke)
+            continue;
+
+        int drawn = drawnPoints.value(stroke->id(), 0);
+
+        // Samples the tiles may have drawn were replaced by curves
+        if(stroke->hasCurves())
+            drawn = 0;
+
+        if(drawn >= (int)stroke->size())
+            continue;
+
+        frame.strokes << stroke;
+        frame.from << qMax(drawn - 1, 0);
+        frame.to << stroke->size() - 1;
+        frame.bounds << strokeBounds(*stroke, frame.from.last(), scale);
+
+        QVector<quint64> keys = TileLevel::keysIn(frame.bounds.last() & kept);
+
+        for(int k = 0; k < keys.size(); k++)
+        {
+            if(level.tiles.contains(keys[k]))
+                dirty.insert(keys[k]);
+        }
+    }
+
+    foreach(quint64 key, dirty)
+    {
+        update.keys << key;
+        frame.rects << TileLevel::rect(key);
+        frame.images << &level.tiles[key];
+    }
+
+    render(frame);
+
+    for(int i = 0; i < frame.images.size(); i++)
+        update.tiles << *frame.images[i];
+
+    // Dry
+    for(int i = 0; i < frame.strokes.size(); i++)
+        drawnPoints[frame.strokes[i]->id()] = frame.strokes[i]->size();
+
+    update.scale = scale;
+    update.eventTime = eventTime;
+    update.wetChanged = !wetDirty.isNull();
+
+    if(update.wetChanged)
+    {
+        update.wetDirty = wetDirty;
+        update.wet.reserve(wet.size());
+
+        for(QMap<quint32, WetStroke>::const_iterator w = wet.constBegin(); w != wet.constEnd(); ++w)
+        {
+            OverlayStroke stroke;
+
+            stroke.color = w->color;
+            stroke.outline = w->outline;
+            update.wet << stroke;
+        }
+    }
+
+    d->metrics.repaint.add(duration.nsecsElapsed());
+
+    if(eventTime >= 0)
+        d->metrics.stages[QDrawingAreaMetrics::Stage_Rasterized].add(d->clock.nsecsElapsed() - eventTime);
+
+    emit updateRender(update);
+}
+
+void Rasterizer::invalidate()
+{
+    invalidated = true;
+    d->scheduler->requestFrame();
+}
+
+void Rasterizer::invalidateStrokes(const QList<quint32> &strokes, const QRectF &area)
+{
+    changedStrokes << strokes;
+    invalidArea |= area;
+    d->scheduler->requestFrame();
+}
+
+void Rasterizer::startRefine(bool full, const QVector<quint64> &keys)
+{
+    RefineJob job;
+
+    job.snapshot = d->model_d->snapshot();
+    job.scale = d->viewScale;
+    job.full = full;
+    job.smooth = d->flags & QDrawingArea::SmoothCurves;
+    job.background = d->q_ptr->palette().color(d->q_ptr->backgroundRole());
+    job.keys = keys;
+
+    // Wet strokes stay out of the tiles past what they already had
+    if(full)
+    {
+        for(QMap<quint32, WetStroke>::const_iterator w = wet.constBegin(); w != wet.constEnd(); ++w)
+            job.drawn.insert(w.key(), drawnPoints.value(w.key(), 0));
+    }
+    else
+    {
+        job.drawn = drawnPoints;
+    }
+
+    refineDuration.start();
+    refineWatcher.setFuture(QtConcurrent::run(&Rasterizer::refine, job));
+}
+
+Rasterizer::RefineResult Rasterizer::refine(const RefineJob &job)
+{
+    RefineResult result;
+    Frame frame;
+    QRect area;
+    const StrokeStore &store = job.snapshot.d->strokes;
+
+    result.scale = job.scale;
+    result.full = job.full;
+    frame.scale = job.scale;
+    frame.smooth = job.smooth;
+
+    for(int i = 0; i < job.keys.size(); i++)
+    {
+        QImage tile(TileLevel::TileSize, TileLevel::TileSize, QImage::Format_ARGB32_Premultiplied);
+
+        tile.fill(job.background);
+        result.tiles.insert(job.keys[i], tile);
+        area |= TileLevel::rect(job.keys[i]);
+    }
+
+    // The hash is complete, pointers into it stay valid from here on
+    for(int i = 0; i < job.keys.size(); i++)
+    {
+        frame.rects << TileLevel::rect(job.keys[i]);
+        frame.images << &result.tiles[job.keys[i]];
+    }
+
+    // Slot order is drawing order
+    for(int slot = 0; slot < store.slotCount(); slot++)
+    {
+        if(!store.isLive(slot))
+            continue;
+
+        const QDrawingStroke &stroke = store.at(slot);
+        QHash<quint32, int>::const_iterator drawn = job.drawn.constFind(stroke.id());
+        int count = stroke.size();
+
+        // Full renders take every stroke but the wet ones, exposed tiles only what the others have
+        if(drawn != job.drawn.constEnd())
+            count = qMin(count, drawn.value());
+        else if(!job.full)
+            count = 0;
+
+        if(job.full)
+            result.drawnPoints.insert(stroke.id(), count);
+
+        if(count == 0)
+            continue;
+
+        QRect bounds = strokeBounds(stroke, 0, job.scale);
+
+        if(!bounds.intersects(area))
+            continue;
+
+        frame.strokes << &stroke;
+        frame.from << 0;
+        frame.to << count - 1;
+        frame.bounds << bounds;
+    }
+
+    render(frame);
+
+    return result;
+}
+
+void Rasterizer::refineFinished()
+{
+    RefineResult result = refineWatcher.result();
+    RasterTileUpdate update;
+
+    if(result.full)
+    {
+        level.scale = result.scale;
+        level.tiles = result.tiles;
+        drawnPoints = result.drawnPoints;
+        d->metrics.fullRepaint.add(refineDuration.nsecsElapsed());
+    }
+
+    update.scale = result.scale;
+    update.full = result.full;
+
+    // Exposed tiles of a scale that was zoomed away from in the meantime are dropped
+    if(result.scale == level.scale)
+    {
+        for(QHash<quint64, QImage>::const_iterator tile = result.tiles.constBegin(); tile != result.tiles.constEnd(); ++tile)
+        {
+            if(!result.full)
+                level.tiles.insert(tile.key(), tile.value());
+
+            update.keys << tile.key();
+            update.tiles << tile.value();
+        }
+
+        emit updateRender(update);
+    }
+
+    // Catch up with ink and viewport changes from while the tiles were rendering
+    QList<int> strokes, finished;
+    qint64 eventTime = deferredEventTime;
+
+    strokes.swap(deferredStrokes);
+    finished.swap(deferredFinished);
+    deferredEventTime = -1;
+
+    repaint(strokes, finished, eventTime);
+}
+
+void Rasterizer::defer(const QList<int> &strokes, const QList<int> &finished, qint64 eventTime)
+{
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        if(!deferredStrokes.contains(strokes[i]))
+            deferredStrokes << strokes[i];
+    }
+
+    deferredFinished << finished;
+
+    if(eventTime >= 0 && (deferredEventTime < 0 || eventTime < deferredEventTime))
+        deferredEventTime = eventTime;
+}
+
+QRect Rasterizer::strokeBounds(const QDrawingStroke &stroke, int from, qreal scale)
+{
+    QRectF bounds = stroke.boundingRect(from);
+    qreal margin = qMax(stroke.pen()->minWidth(), stroke.pen()->maxWidth()) * scale + 2; // Outline pen and antialiasing
+
+    return QRectF(bounds.topLeft() * scale, bounds.bottomRight() * scale).adjusted(-margin, -margin, margin, margin).toAlignedRect();
+}
+
+void Rasterizer::render(Frame &frame)
+{
+    QMap<int, int> bandOfRow;
+    QVector<int> bands;
+
+    frame.bands.clear();
+
+    for(int i = 0; i < frame.rects.size(); i++)
+    {
+        int row = qFloor(frame.rects[i].top() / (qreal)TileLevel::TileSize);
+        QMap<int, int>::const_iterator band = bandOfRow.constFind(row);
+
+        if(band == bandOfRow.constEnd())
+        {
+            bandOfRow.insert(row, frame.bands.size());
+            bands << frame.bands.size();
+            frame.bands << (QVector<int>() << i);
+        }
+        else
+        {
+            frame.bands[band.value()] << i;
+        }
+    }
+
+    // Tile rows touch disjoint tiles, so larger frames spread them over the global thread pool
+    if(bands.size() > 1)
+        QtConcurrent::blockingMap(bands, Band(&frame));
+    else if(bands.size() == 1)
+        renderBand(frame, 0);
+}
+
+void Rasterizer::renderBand(const Frame &frame, int band)
+{
+    const QVector<int> &tiles = frame.bands[band];
+    QRect area;
+    QScopedArrayPointer<QPainter> painters(new QPainter[tiles.size()]);
+
+    for(int i = 0; i < tiles.size(); i++)
+    {
+        QPainter &p = painters[i];
+        const QRect &rect = frame.rects[tiles[i]];
+
+        area |= rect;
+        p.begin(frame.images[tiles[i]]);
+        p.translate(-rect.topLeft());
+        p.scale(frame.scale, frame.scale);
+        p.setPen(Qt::NoPen);
+
+        if(frame.smooth)
+            p.setRenderHints(QPainter::Antialiasing | QPainter::HighQualityAntialiasing);
+    }
+
+    // Strokes are culled against the band, then tessellated once for all of its tiles
+    for(int s = 0; s < frame.strokes.size(); s++)
+    {
+        const QRect &bounds = frame.bounds[s];
+
+        if(!bounds.intersects(area))
+            continue;
+
+        QPainterPath outline;
+        bool tessellated = false;
+
+        for(int i = 0; i < tiles.size(); i++)
+        {
+            if(!bounds.intersects(frame.rects[tiles[i]]))
+                continue;
+
+            if(!tessellated)
+            {
+                outline = strokeOutline(*frame.strokes[s], frame.from[s], frame.to[s], frame.scale);
+                tessellated = true;
+
+                if(outline.isEmpty())
+                    break;
+            }
+
+            painters[i].setBrush(frame.strokes[s]->pen()->color());
+            painters[i].drawPath(outline);
+        }
+    }
+}
+
+QPainterPath Rasterizer::strokeOutline(const QDrawingStroke &stroke, int point, int last, qreal scale)
+{
+    // A lone point is a dot, otherwise only continue from a point that was already drawn
+    if(last < 0 || (point >= last && point > 0))
+        return QPainterPath();
+
+    // One fill per stroke range instead of one polygon per segment.  Whole strokes may come from a
+    // simplified level that stays within half a device pixel.
+    return StrokeTessellator::outline(stroke, stroke.pen(), point, last, 0.5 / scale);
+}
+
+
+QAbstractDrawingModelPrivate::QAbstractDrawingModelPrivate(QAbstractDrawingModel *q) : q_ptr(q),
+    compactStorage(false),
+    curveTolerance(0.05),
+    batchDepth(0),
+    journal(0),
+    journalThread(0),
+    published(new QDrawingSnapshotData),
+    historyUsage(0),
+    historyLimit(64 * 1024 * 1024)
+{
+
+}
+
+void QAbstractDrawingModelPrivate::publish()
+{
+    QDrawingSnapshotData *next = new QDrawingSnapshotData;
+
+    // Shares every block of strokes until the writer touches it again
+    next->version = published->version + 1;
+    next->strokes = strokes;
+
+    QSharedPointer<const QDrawingSnapshotData> previous(next);
+
+    snapshotLock.lock();
+    published.swap(previous);
+    snapshotLock.unlock();
+
+    // The previous snapshot is freed here unless a reader still holds it
+}
+
+void QAbstractDrawingModelPrivate::commitPending(bool reset)
+{
+    QList<QDrawingStroke> batch;
+    QList<quint32> ids;
+
+    batch.swap(pending);
+    ids.reserve(batch.size());
+
+    // Loaded documents are left alone, simplifying them would read every mapped point
+    if(!reset)
+    {
+        for(int i = 0; i < batch.size(); i++)
+            batch[i].simplify();
+    }
+
+    writeLock.lock();
+
+    if(reset)
+    {
+        strokes.clear();
+        clearHistory();
+    }
+
+    strokes.reserve(strokes.slotCount() + batch.size());
+
+    for(int i = 0; i < batch.size(); i++)
+        ids << strokes.insert(batch[i]);
+
+    // A reset is saved as a whole by the caller
+    if(journal && !reset)
+    {
+        for(int i = 0; i < ids.size(); i++)
+        {
+            const QDrawingStroke &stroke = *strokes.find(ids[i]);
+
+            journal->strokeBegun(stroke);
+            journal->strokeFinished(stroke);
+        }
+    }
+
+    if(!reset && !ids.isEmpty())
+    {
+        HistoryEntry entry;
+
+        entry.ids = ids;
+
+        for(int i = 0; i < ids.size(); i++)
+        {
+            entry.before << QDrawingStroke();
+            entry.after << *strokes.find(ids[i]);
+        }
+
+        record(entry);
+    }
+
+    publish();
+    writeLock.unlock();
+
+    if(reset)
+        spatialIndex.clear();
+
+    // Segments are indexed on the first query that needs them, this never touches the points
+    for(int i = 0; i < batch.size(); i++)
+    {
+        qreal margin = batch[i].pen()->maxWidth();
+
+        spatialIndex.insertBounds(ids[i], batch[i].boundingRect().adjusted(-margin, -margin, margin, margin));
+    }
+
+    qCDebug(lcDrawingInput) << "Committed" << ids.size() << "strokes";
+
+    emit q_ptr->strokesInserted(ids);
+}
+
+void QAbstractDrawingModelPrivate::refineIndex(const QRectF &area)
+{
+    QList<quint32> ids = spatialIndex.unrefinedIn(area);
+
+    // Against the live strokes, so a removal or cut can not be undone by a stale copy
+    for(int i = 0; i < ids.size(); i++)
+    {
+        const QDrawingStroke *stroke = strokes.find(ids[i]);
+
+        if(stroke)
+            spatialIndex.insertStroke(*stroke);
+        else
+            spatialIndex.removeStroke(ids[i]);
+    }
+}
+
+void QAbstractDrawingModelPrivate::record(HistoryEntry entry)
+{
+    if(historyLimit <= 0)
+        return;
+
+    entry.cost = entry.ids.size() * (sizeof(quint32) + 2 * sizeof(QDrawingStroke));
+
+    for(int i = 0; i < entry.ids.size(); i++)
+        entry.cost += entry.before[i].memoryUsage() + entry.after[i].memoryUsage();
+
+    foreach(const HistoryEntry &undone, redoStack)
+        historyUsage -= undone.cost;
+
+    redoStack.clear();
+    undoStack << entry;
+    historyUsage += entry.cost;
+    trimHistory();
+}
+
+QRectF QAbstractDrawingModelPrivate::applyHistory(const HistoryEntry &entry, bool after)
+{
+    const QList<QDrawingStroke> &target = after ? entry.after : entry.before;
+    QList<QDrawingStroke> restored;
+    QRectF area;
+
+    for(int i = 0; i < entry.ids.size(); i++)
+    {
+        quint32 id = entry.ids[i];
+        const QDrawingStroke *current = strokes.find(id);
+
+        if(current)
+        {
+            area |= inkBounds(*current);
+            strokes.remove(id);
+            spatialIndex.removeStroke(id);
+
+            if(journal)
+                journal->strokeRemoved(id);
+        }
+
+        if(target[i].pen())
+        {
+            area |= inkBounds(target[i]);
+            restored << target[i];
+        }
+    }
+
+    // Strokes go back into the slots they were removed from, so drawing order is kept
+    strokes.restore(restored);
+
+    for(int i = 0; i < restored.size(); i++)
+    {
+        spatialIndex.insertBounds(restored[i].id(), inkBounds(restored[i]));
+
+        if(journal)
+        {
+            journal->strokeBegun(restored[i]);
+            journal->strokeFinished(restored[i]);
+        }
+    }
+
+    publish();
+
+    return area;
+}
+
+void QAbstractDrawingModelPrivate::trimHistory()
 {
+    // The redo history goes after the oldest undo steps, it is further from the current state
+    while(historyUsage > historyLimit && !undoStack.isEmpty())
+        historyUsage -= undoStack.takeFirst().cost;
 
+    while(historyUsage > historyLimit && !redoStack.isEmpty())
+        historyUsage -= redoStack.takeFirst().cost;
 }
 
-QDrawingPen::QDrawingPen(QDrawingPen &other) :
-    m_button(other.m_button),
-    m_color(other.m_color),
-    m_minWidth(other.m_minWidth),
-    m_maxWidth(other.m_maxWidth)
+void QAbstractDrawingModelPrivate::clearHistory()
+{
+    undoStack.clear();
+    redoStack.clear();
+    historyUsage = 0;
+}
+
+QDrawingSnapshot QAbstractDrawingModelPrivate::snapshot() const
 {
+    QDrawingSnapshot snapshot;
+    QMutexLocker locker(&snapshotLock);
+
+    snapshot.d = published;
 
+    return snapshot;
 }
 
-Qt::MouseButton QDrawingPen::button()
+QAbstractDrawingModelPrivate::~QAbstractDrawingModelPrivate()
 {
-    return m_button;
+
 }
 
-QColor QDrawingPen::color()
+
+QAbstractDrawingModel::QAbstractDrawingModel(QObject *parent) : QObject(parent),
+    d_ptr(new QAbstractDrawingModelPrivate(this))
 {
-    return m_color;
+
 }
 
-qreal QDrawingPen::minWidth()
+QAbstractDrawingModel::~QAbstractDrawingModel()
 {
-    return m_minWidth;
+    stopJournal();
+
 }
 
-qreal QDrawingPen::maxWidth()
+void QAbstractDrawingModel::setDrawingSize(QSizeF &size)
 {
-    return m_maxWidth;
+    Q_D(QAbstractDrawingModel);
+
+    d->documentSize = size;
 }
 
-bool QDrawingPen::isVariableWidth()
+void QAbstractDrawingModel::setCompactStorage(bool compact)
 {
-    // No fuzzy comparison needed
-    return m_minWidth != m_maxWidth;
+    Q_D(QAbstractDrawingModel);
+
+    d->compactStorage = compact;
 }
 
-bool QDrawingPen::isOrientationLocked()
+void QAbstractDrawingModel::setCurveTolerance(qreal tolerance)
 {
-    return !qIsNaN(m_orientationLock);
+    Q_D(QAbstractDrawingModel);
+
+    d->curveTolerance = qMax(tolerance, 0.0);
 }
 
-qreal QDrawingPen::orientationLock()
+qreal QAbstractDrawingModel::curveTolerance() const
 {
-    return m_orientationLock;
+    Q_D(const QAbstractDrawingModel);
+
+    return d->curveTolerance;
 }
 
+QDrawingSnapshot QAbstractDrawingModel::snapshot() const
+{
+    Q_D(const QAbstractDrawingModel);
 
-Rasterizer::Rasterizer(QDrawingAreaPrivate *d) :
-    d(d)
+    return d->snapshot();
+}
+
+bool QAbstractDrawingModel::save(const QString &fileName)
 {
-    connect(&repaintTimer, &QTimer::timeout, this, &Rasterizer::repaintTimeout);
+    Q_D(QAbstractDrawingModel);
+    QDrawingSnapshot current = d->snapshot();
+
+    return DrawingDocument::write(fileName, d->documentSize, *current.d);
 }
 
-void Rasterizer::moveToThread(QThread *targetThread)
+bool QAbstractDrawingModel::load(const QString &fileName)
 {
-    QObject::moveToThread(targetThread);
-    repaintTimer.moveToThread(targetThread);
+    Q_D(QAbstractDrawingModel);
+    QList<QDrawingStroke> strokes;
+    QSizeF size;
+
+    if(!DrawingDocument::read(fileName, &size, &strokes))
+        return false;
+
+    d->documentSize = size;
+    d->pending = strokes;
+    d->commitPending(true);
+
+    if(d->journal)
+        QMetaObject::invokeMethod(d->journal, "compact", Qt::BlockingQueuedConnection);
+
+    return true;
+}
+
+bool QAbstractDrawingModel::startJournal(const QString &fileName)
+{
+    Q_D(QAbstractDrawingModel);
+    bool ok = false;
+
+    stopJournal();
+
+    DrawingJournal *journal = new DrawingJournal(d, fileName);
+
+    d->journalThread = new QThread;
+    journal->moveToThread(d->journalThread);
+    d->journalThread->start();
+
+    // Changes from here on are either in the first save or recorded after it
+    d->writeLock.lock();
+    d->journal = journal;
+    d->writeLock.unlock();
+
+    QMetaObject::invokeMethod(journal, "compact", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, ok));
+
+    if(!ok)
+        stopJournal();
+
+    return ok;
+}
+
+void QAbstractDrawingModel::stopJournal()
+{
+    Q_D(QAbstractDrawingModel);
+    DrawingJournal *journal = d->journal;
+
+    if(!journal)
+        return;
+
+    d->writeLock.lock();
+    d->journal = 0;
+    d->writeLock.unlock();
+
+    QMetaObject::invokeMethod(journal, "close", Qt::BlockingQueuedConnection);
+
+    d->journalThread->quit();
+    d->journalThread->wait();
+
+    delete journal;
+    delete d->journalThread;
+    d->journalThread = 0;
+}
+
+bool QAbstractDrawingModel::recover(const QString &fileName)
+{
+    Q_D(QAbstractDrawingModel);
+    QList<QDrawingStroke> strokes;
+    QSizeF size;
+    quint64 tag = 0;
+
+    if(!DrawingDocument::read(fileName, &size, &strokes, &tag))
+        return false;
+
+    // Without a tag the document was saved without journaling
+    if(tag)
+        DrawingJournal::replay(fileName, tag, &strokes);
+
+    d->documentSize = size;
+    d->pending = strokes;
+    d->commitPending(true);
+
+    if(d->journal)
+        QMetaObject::invokeMethod(d->journal, "compact", Qt::BlockingQueuedConnection);
+
+    return true;
+}
+
+bool QAbstractDrawingModel::hasIndex(quint32 strokeId)
+{
+    Q_D(QAbstractDrawingModel);
+
+    return d->snapshot().contains(strokeId);
+}
+
+QDrawingStroke QAbstractDrawingModel::index(quint32 strokeId)
+{
+    Q_D(QAbstractDrawingModel);
+
+    return d->snapshot().stroke(strokeId);
+}
+
+void QAbstractDrawingModel::beginInsert(int strokes)
+{
+    Q_D(QAbstractDrawingModel);
+
+    d->batchDepth++;
+    d->pending.reserve(d->pending.size() + strokes);
+}
+
+void QAbstractDrawingModel::endInsert()
+{
+    Q_D(QAbstractDrawingModel);
+
+    Q_ASSERT(d->batchDepth > 0);
+
+    if(--d->batchDepth == 0 && !d->pending.isEmpty())
+        d->commitPending();
+}
+
+void QAbstractDrawingModel::append(const QDrawingStroke &stroke)
+{
+    Q_D(QAbstractDrawingModel);
+
+    if(!stroke.pen())
+    {
+        qWarning("QAbstractDrawingModel::append: Stroke without a pen");
+        return;
+    }
+
+    beginInsert(1);
+    d->pending << stroke;
+    endInsert();
+}
+
+void QAbstractDrawingModel::append(const QList<QDrawingStroke> &strokes)
+{
+    beginInsert(strokes.size());
+
+    for(int i = 0; i < strokes.size(); i++)
+        append(strokes[i]);
+
+    endInsert();
+}
+
+void QAbstractDrawingModel::append(QSharedPointer<QDrawingPen> pen, const float *x, const float *y, const float *pressure, int count)
+{
+    Q_D(QAbstractDrawingModel);
+    QDrawingStroke stroke;
+
+    stroke.setPen(pen);
+    stroke.setCompact(d->compactStorage);
+    stroke.reserve(count);
+    stroke.append(x, y, pressure, count);
+
+    append(stroke);
 }
 
-void Rasterizer::repaint(QList<int> modifiedStrokes)
+void QAbstractDrawingModel::remove(quint32 strokeId)
 {
-    QPixmap pix;
-    qDebug() << "Rasterize";
+    Q_D(QAbstractDrawingModel);
+    QDrawingStroke stroke;
+
+    d->writeLock.lock();
 
-    // Copy current pixmap if the size matches
-    if(d->q_ptr->rect() == d->pixmap.rect())
+    const QDrawingStroke *found = d->strokes.find(strokeId);
+
+    if(found)
     {
-        pix = d->pixmap;
+        stroke = *found;
+        d->strokes.remove(strokeId);
+        d->spatialIndex.removeStroke(strokeId);
 
-        QPainter p(&pix);
+        if(d->journal)
+            d->journal->strokeRemoved(strokeId);
 
-        for(int i = 0; i < modifiedStrokes.size(); i++)
-        {
-            renderPartialStroke(p, d->model_d->strokeMap[modifiedStrokes[i]]);
-        }
+        HistoryEntry entry;
+
+        entry.ids << strokeId;
+        entry.before << stroke;
+        entry.after << QDrawingStroke();
+        d->record(entry);
 
-        p.end();
+        d->publish();
     }
-    else
+
+    d->writeLock.unlock();
+
+    if(!found)
+        return;
+
+    emit strokeRemoved(stroke);
+    emit strokesChanged(QList<quint32>() << strokeId, inkBounds(stroke));
+}
+
+void QAbstractDrawingModel::undo()
+{
+    Q_D(QAbstractDrawingModel);
+    HistoryEntry entry;
+    QRectF area;
+
+    d->writeLock.lock();
+
+    if(!d->undoStack.isEmpty())
     {
-        qDebug() << "Full repaint";
-        pix = QPixmap(d->q_ptr->size());
-        pix.fill(d->q_ptr->palette().color(d->q_ptr->backgroundRole()));
+        entry = d->undoStack.takeLast();
+        area = d->applyHistory(entry, false);
+        d->redoStack << entry;
+    }
 
-        QPainter p(&pix);
-        QMap<quint32, QDrawingStroke>::iterator itr = d->model_d->strokeMap.begin();
+    d->writeLock.unlock();
 
-        for(; itr != d->model_d->strokeMap.end(); ++itr)
-        {
-            renderFullStroke(p, itr.value());
-        }
+    if(!entry.ids.isEmpty())
+        emit strokesChanged(entry.ids, area);
+}
+
+void QAbstractDrawingModel::redo()
+{
+    Q_D(QAbstractDrawingModel);
+    HistoryEntry entry;
+    QRectF area;
+
+    d->writeLock.lock();
 
-        p.end();
+    if(!d->redoStack.isEmpty())
+    {
+        entry = d->redoStack.takeLast();
+        area = d->applyHistory(entry, true);
+        d->undoStack << entry;
     }
 
+    d->writeLock.unlock();
+
+    if(!entry.ids.isEmpty())
+        emit strokesChanged(entry.ids, area);
+}
+
+bool QAbstractDrawingModel::canUndo() const
+{
+    Q_D(const QAbstractDrawingModel);
+    QMutexLocker locker(&d->writeLock);
 
-    emit updateRender(pix);
+    return !d->undoStack.isEmpty();
 }
 
-void Rasterizer::repaintLater()
+bool QAbstractDrawingModel::canRedo() const
 {
-    if(!repaintTimer.isActive())
-        repaintTimer.start(0);
+    Q_D(const QAbstractDrawingModel);
+    QMutexLocker locker(&d->writeLock);
+
+    return !d->redoStack.isEmpty();
 }
 
-void Rasterizer::repaintTimeout()
+void QAbstractDrawingModel::clearHistory()
 {
-    repaintTimer.stop();
-    repaint(QList<int>());
+    Q_D(QAbstractDrawingModel);
+    QMutexLocker locker(&d->writeLock);
+
+    d->clearHistory();
 }
 
-void Rasterizer::renderFullStroke(QPainter &p, QDrawingStroke &stroke)
+void QAbstractDrawingModel::setUndoLimit(qint64 bytes)
 {
-    renderStrokeFrom(p, stroke, 0);
+    Q_D(QAbstractDrawingModel);
+    QMutexLocker locker(&d->writeLock);
+
+    d->historyLimit = bytes;
+
+    if(bytes <= 0)
+        d->clearHistory();
+    else
+        d->trimHistory();
 }
 
-void Rasterizer::renderPartialStroke(QPainter &p, QDrawingStroke &stroke)
+qint64 QAbstractDrawingModel::undoMemoryUsage() const
 {
-    if(stroke.dirty())
-        renderStrokeFrom(p, stroke, stroke.dirtyAt());
+    Q_D(const QAbstractDrawingModel);
+    QMutexLocker locker(&d->writeLock);
+
+    return d->historyUsage;
 }
 
-void Rasterizer::renderStrokeFrom(QPainter &p, QDrawingStroke &stroke, int point)
+QList<quint32> QAbstractDrawingModel::strokesAt(const QPointF &point, qreal tolerance)
 {
-    QPen pen(stroke.pen()->color());
-    pen.setCapStyle(Qt::RoundCap);
+    Q_D(QAbstractDrawingModel);
 
-    if(d->flags & QDrawingArea::SmoothCurves)
-        p.setRenderHint(QPainter::HighQualityAntialiasing);
+    {
+        QMutexLocker locker(&d->writeLock);
+        d->refineIndex(QRectF(point, point).adjusted(-tolerance, -tolerance, tolerance, tolerance));
+    }
 
-    // TODO: Cubic curves
+    return d->spatialIndex.strokesAt(point, tolerance);
+}
 
+QList<quint32> QAbstractDrawingModel::strokesIn(const QRectF &rect)
+{
+    Q_D(QAbstractDrawingModel);
 
-    if(stroke.size() == point + 1)
     {
-        // Dot arrived
-        pen.setWidthF(stroke.pen()->calcWidth(stroke[point].pressure()));
-        p.setPen(pen);
-        p.drawPoint(stroke[point]);
+        QMutexLocker locker(&d->writeLock);
+        d->refineIndex(rect);
     }
 
-    // Draw filled area if the thickness is over a threshhold or if a fixed angle pen is used
-    if(stroke.size() - point > 1)
+    return d->spatialIndex.strokesIn(rect);
+}
+
+QList<quint32> QAbstractDrawingModel::strokesAlong(const QPolygonF &polyline, qreal tolerance)
+{
+    Q_D(QAbstractDrawingModel);
+
     {
-        QBrush brush(stroke.pen()->color());
-        pen.setWidthF(1.5);
-        p.setPen(pen);
-        p.setBrush(brush);
-        const QPointF points[] = {
-            {100,100},
-            {130,100},
-            {130,120},
-            {120,110},
-            {100,125}
-        };
+        QMutexLocker locker(&d->writeLock);
+        d->refineIndex(polyline.boundingRect().adjusted(-tolerance, -tolerance, tolerance, tolerance));
+    }
 
-        // # of points is calculatable
-//        QPointF *list = new QPointF[2 * (stroke.size() - point)];
+    return d->spatialIndex.strokesAlong(polyline, tolerance);
+}
 
-        for(int i = point; i < stroke.size() - 1; i++)
-        {
-            qDebug() << stroke[i+1].normal();
-            QLineF line(stroke[i], stroke[i+1]);
 
-            QPointF fixedList[6];
-            QVector2D norm1, norm2;
+void StrokeSpatialIndex::insert(quint32 stroke, quint32 index, const QPointF &p1, const QPointF &p2, qreal radius)
+{
+    QWriteLocker locker(&lock);
+
+    addSegment(stroke, index, p1, p2, radius);
+}
+
+void StrokeSpatialIndex::insertStroke(const QDrawingStroke &stroke)
+{
+    int count = stroke.size();
+    QDrawingPen *pen = stroke.pen();
+
+    if(count == 0)
+        return;
+
+    QWriteLocker locker(&lock);
+    QDrawingPoint previous = stroke[0];
+
+    removeSegments(stroke.id());
+
+    if(count == 1)
+        addSegment(stroke.id(), 0, previous, previous, pen->calcWidth(previous.pressure()));
+
+    // Curves are indexed by their flattened path, each piece under the segment it belongs to
+    if(stroke.hasCurves())
+    {
+        for(int s = 0; s + 3 < count; s += 3)
+        {
+            float x[4], y[4];
+            quint16 pressure[4];
+            QVector<float> flatX, flatY;
+            QVector<quint16> flatPressure;
 
-            if(stroke.pen()->isOrientationLocked())
+            for(int i = 0; i < 4; i++)
             {
-                QTransform trans;
+                QDrawingPoint point = stroke[s + i];
 
-                trans.rotate(stroke.pen()->orientationLock());
-                norm1 = norm2 = QVector2D(trans.map(QPointF(0, -1)));
+                x[i] = point.x();
+                y[i] = point.y();
+                pressure[i] = qRound(point.pressure() * 65535);
             }
-            else
+
+            CurveFitter::flatten(x, y, pressure, 4, IndexFlatness, flatX, flatY, flatPressure);
+
+            for(int i = 1; i < flatX.size(); i++)
             {
-                norm1 = stroke[i].normal();
-                norm2 = stroke[i+1].normal();
-                if(qRadiansToDegrees(qAcos(QVector2D::dotProduct(norm1, stroke[i+1].normal()))) > 90)
-                {
-                    norm1.setX(-norm1.x());
-                    norm1.setY(-norm1.y());
-                }
+                addSegment(stroke.id(), s, QPointF(flatX[i - 1], flatY[i - 1]), QPointF(flatX[i], flatY[i]),
+                           qMax(pen->calcWidth(flatPressure[i - 1] / 65535.0), pen->calcWidth(flatPressure[i] / 65535.0)));
             }
-            fixedList[0] = line.p1() + stroke.pen()->calcWidth(stroke[i].pressure())*norm1.toPointF();
-            fixedList[1] = line.p2() + stroke.pen()->calcWidth(stroke[i+1].pressure())*norm2.toPointF();
-            fixedList[2] = line.p2() - stroke.pen()->calcWidth(stroke[i+1].pressure())*norm2.toPointF();
-            fixedList[3] = line.p1() - stroke.pen()->calcWidth(stroke[i].pressure())*norm1.toPointF();
-
-            QVector2D a(0, 1);
-            QVector2D b(1, -1);
+        }
 
-            b.normalize();
+        return;
+    }
 
-            p.drawPolygon(fixedList, 4);
-        }
+    for(int i = 1; i < count; i++)
+    {
+        QDrawingPoint point = stroke[i];
 
-//        p.drawPolygon(points, 5);
+        addSegment(stroke.id(), i - 1, previous, point,
+                   qMax(pen->calcWidth(previous.pressure()), pen->calcWidth(point.pressure())));
+        previous = point;
     }
-    else for(int i = point; i < stroke.size() - 1; i++)
+}
+
+void StrokeSpatialIndex::addSegment(quint32 stroke, quint32 index, const QPointF &p1, const QPointF &p2, qreal radius)
+{
+    Segment segment = { stroke, index, (float)p1.x(), (float)p1.y(), (float)p2.x(), (float)p2.y(), (float)radius };
+    QRectF bounds = QRectF(p1, p2).normalized().adjusted(-radius, -radius, radius, radius);
+
+    for(int row = qFloor(bounds.top() / CellSize); row <= qFloor(bounds.bottom() / CellSize); row++)
     {
-        // TODO: Variable-width lines
-        /*
-        pen.setWidthF(stroke.pen()->calcWidth(stroke[i+1].pressure()));
-        p.setPen(pen);
-        p.drawLine(stroke[i], stroke[i+1]);
-        */
+        for(int column = qFloor(bounds.left() / CellSize); column <= qFloor(bounds.right() / CellSize); column++)
+        {
+            cells[cellKey(column, row)].append(segment);
+        }
     }
 
-    // Drawn
-    stroke.setDirty(false, -1);
+    strokeBounds[stroke] |= bounds;
 }
 
+void StrokeSpatialIndex::insertBounds(quint32 stroke, const QRectF &bounds)
+{
+    QWriteLocker locker(&lock);
+
+    removeSegments(stroke);
+    addSegment(stroke, Unrefined, bounds.topLeft(), bounds.bottomRight(), 0);
+}
 
-QAbstractDrawingModelPrivate::QAbstractDrawingModelPrivate(QAbstractDrawingModel *q) : q_ptr(q)
+void StrokeSpatialIndex::removeStroke(quint32 stroke)
 {
+    QWriteLocker locker(&lock);
 
+    removeSegments(stroke);
 }
 
-QAbstractDrawingModelPrivate::~QAbstractDrawingModelPrivate()
+void StrokeSpatialIndex::removeSegments(quint32 stroke)
+{
+    QRectF bounds = strokeBounds.take(stroke);
+
+    if(bounds.isNull())
+        return;
+
+    for(int row = qFloor(bounds.top() / CellSize); row <= qFloor(bounds.bottom() / CellSize); row++)
+    {
+        for(int column = qFloor(bounds.left() / CellSize); column <= qFloor(bounds.right() / CellSize); column++)
+        {
+            QHash<quint64, QVector<Segment> >::iterator cell = cells.find(cellKey(column, row));
+
+            if(cell == cells.end())
+                continue;
+
+            QVector<Segment> &segments = cell.value();
+
+            for(int i = segments.size() - 1; i >= 0; i--)
+            {
+                if(segments[i].stroke == stroke)
+                    segments.remove(i);
+            }
+
+            if(segments.isEmpty())
+                cells.erase(cell);
+        }
+    }
+}
+
+void StrokeSpatialIndex::clear()
 {
+    QWriteLocker locker(&lock);
 
+    cells.clear();
+    strokeBounds.clear();
 }
 
+QList<quint32> StrokeSpatialIndex::strokesAt(const QPointF &point, qreal tolerance) const
+{
+    QVector<const Segment*> segments;
+    QSet<quint32> hits;
+    QReadLocker locker(&lock);
+
+    collect(QRectF(point, point).adjusted(-tolerance, -tolerance, tolerance, tolerance), segments);
 
-QAbstractDrawingModel::QAbstractDrawingModel(QObject *parent) : QObject(parent),
-    d_ptr(new QAbstractDrawingModelPrivate(this))
+    for(int i = 0; i < segments.size(); i++)
+    {
+        const Segment *s = segments[i];
+
+        if(!hits.contains(s->stroke) &&
+                distanceToSegment(point, QPointF(s->x1, s->y1), QPointF(s->x2, s->y2)) <= s->radius + tolerance)
+            hits.insert(s->stroke);
+    }
+
+    QList<quint32> result = hits.toList();
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+QList<quint32> StrokeSpatialIndex::strokesIn(const QRectF &rect) const
 {
+    QVector<const Segment*> segments;
+    QSet<quint32> hits;
+    QRectF area = rect.normalized();
+    QReadLocker locker(&lock);
+
+    collect(area, segments);
+
+    for(int i = 0; i < segments.size(); i++)
+    {
+        const Segment *s = segments[i];
 
+        if(!hits.contains(s->stroke) &&
+                segmentIntersectsRect(QPointF(s->x1, s->y1), QPointF(s->x2, s->y2),
+                                      area.adjusted(-s->radius, -s->radius, s->radius, s->radius)))
+            hits.insert(s->stroke);
+    }
+
+    QList<quint32> result = hits.toList();
+    std::sort(result.begin(), result.end());
+    return result;
 }
 
-QAbstractDrawingModel::~QAbstractDrawingModel()
+QList<quint32> StrokeSpatialIndex::strokesAlong(const QPolygonF &polyline, qreal tolerance) const
 {
+    QVector<const Segment*> segments;
+    QSet<quint32> hits;
+    QReadLocker locker(&lock);
+
+    // A single point is treated as a zero-length polyline
+    for(int p = 0; p < qMax(polyline.size() - 1, polyline.isEmpty() ? 0 : 1); p++)
+    {
+        QPointF a = polyline[p];
+        QPointF b = polyline[qMin(p + 1, polyline.size() - 1)];
+
+        segments.clear();
+        collect(QRectF(a, b).normalized().adjusted(-tolerance, -tolerance, tolerance, tolerance), segments);
+
+        for(int i = 0; i < segments.size(); i++)
+        {
+            const Segment *s = segments[i];
 
+            if(!hits.contains(s->stroke) &&
+                    segmentDistance(a, b, QPointF(s->x1, s->y1), QPointF(s->x2, s->y2)) <= s->radius + tolerance)
+                hits.insert(s->stroke);
+        }
+    }
+
+    QList<quint32> result = hits.toList();
+    std::sort(result.begin(), result.end());
+    return result;
 }
 
-bool QAbstractDrawingModel::hasIndex(quint32 strokeId)
+QVector<StrokeSpatialIndex::Segment> StrokeSpatialIndex::segmentsAlong(const QPointF &a, const QPointF &b, qreal tolerance) const
 {
+    QVector<const Segment*> segments;
+    QVector<Segment> hits;
+    QReadLocker locker(&lock);
+
+    collect(QRectF(a, b).normalized().adjusted(-tolerance, -tolerance, tolerance, tolerance), segments);
+
+    for(int i = 0; i < segments.size(); i++)
+    {
+        const Segment *s = segments[i];
+
+        if(segmentDistance(a, b, QPointF(s->x1, s->y1), QPointF(s->x2, s->y2)) <= s->radius + tolerance)
+            hits << *s;
+    }
 
+    return hits;
 }
 
-const QDrawingStroke &QAbstractDrawingModel::index(quint32 strokeId)
+QList<quint32> StrokeSpatialIndex::unrefinedIn(const QRectF &area) const
 {
+    QSet<quint32> hits;
+    QRectF normalized = area.normalized();
+    QReadLocker locker(&lock);
+
+    for(int row = qFloor(normalized.top() / CellSize); row <= qFloor(normalized.bottom() / CellSize); row++)
+    {
+        for(int column = qFloor(normalized.left() / CellSize); column <= qFloor(normalized.right() / CellSize); column++)
+        {
+            QHash<quint64, QVector<Segment> >::const_iterator cell = cells.constFind(cellKey(column, row));
+
+            if(cell == cells.constEnd())
+                continue;
+
+            const QVector<Segment> &list = cell.value();
+
+            for(int i = 0; i < list.size(); i++)
+            {
+                const Segment &s = list[i];
 
+                // Touching counts, a query area can be a single point
+                if(s.index == (quint32)Unrefined &&
+                        s.x1 <= normalized.right() && s.x2 >= normalized.left() &&
+                        s.y1 <= normalized.bottom() && s.y2 >= normalized.top())
+                    hits.insert(s.stroke);
+            }
+        }
+    }
+
+    return hits.toList();
 }
 
-void QAbstractDrawingModel::append(const QDrawingStroke &stroke)
+quint64 StrokeSpatialIndex::cellKey(int column, int row)
+{
+    return ((quint64)(quint32)column << 32) | (quint32)row;
+}
+
+void StrokeSpatialIndex::collect(const QRectF &area, QVector<const Segment*> &segments) const
 {
+    // Segments are stored in every cell their inflated bounds touch, so only the area's own cells are visited
+    for(int row = qFloor(area.top() / CellSize); row <= qFloor(area.bottom() / CellSize); row++)
+    {
+        for(int column = qFloor(area.left() / CellSize); column <= qFloor(area.right() / CellSize); column++)
+        {
+            QHash<quint64, QVector<Segment> >::const_iterator cell = cells.constFind(cellKey(column, row));
+
+            if(cell == cells.constEnd())
+                continue;
+
+            const QVector<Segment> &list = cell.value();
 
+            for(int i = 0; i < list.size(); i++)
+            {
+                if(list[i].index != (quint32)Unrefined)
+                    segments << &list[i];
+            }
+        }
+    }
 }
@@ -4,35 +4,54 @@
 #include <QVector2D>
 #include <QWidget>
 #include <QAbstractListModel>
+#include <QPolygonF>
+#include <QSharedDataPointer>
+#include <QTabletEvent>
+#include <QTransform>
 
 class QDrawingAreaPrivate;
 class QAbstractDrawingModelPrivate;
+struct RasterTileUpdate;
 
 class QDrawingPen
 {
 public:
 //    explicit QDrawingPen(Qt::MouseButton button, QColor color, qreal width, qreal orientationLock = qQNaN());
+    /**
+     * @brief Widths are in document mm, like stroke points.
+     */
     explicit QDrawingPen(Qt::MouseButton button, QColor color, qreal minWidth, qreal maxWidth = 0, qreal orientationLock = qQNaN());
 
-    explicit QDrawingPen(QDrawingPen & other);
+    QDrawingPen(const QDrawingPen &other);
 
+    /**
+     * @brief What the pen does.  Eraser pens never leave ink, their width is the width they erase.
+     */
     enum {
         Mode_FeltTipPen,
         Mode_Selector,
-        Mode_Eraser,
+        Mode_Eraser,        // Removes every stroke it touches
         Mode_ChiselTip,
-        Mode_Highlighter
+        Mode_Highlighter,
+        Mode_PreciseEraser  // Cuts the part it touches out of strokes, splitting them
     };
 
-    Qt::MouseButton button();
-    QColor color();
-    qreal minWidth();
-    qreal maxWidth();
-    bool isVariableWidth();
-    bool isOrientationLocked();
-    qreal orientationLock();
+    enum {
+        InvalidId = 0xffff  // Pen id of no pen
+    };
 
-    inline qreal calcWidth(qreal pressure)
+    Qt::MouseButton button() const;
+    QColor color() const;
+    qreal minWidth() const;
+    qreal maxWidth() const;
+    bool isVariableWidth() const;
+    bool isOrientationLocked() const;
+    qreal orientationLock() const;
+    int mode() const;
+    void setMode(int mode);
+    bool isEraser() const;
+
+    inline qreal calcWidth(qreal pressure) const
     {
         if(m_minWidth == m_maxWidth)
             return m_minWidth;
@@ -46,6 +65,7 @@ private:
     qreal m_minWidth;
     qreal m_maxWidth;
     qreal m_orientationLock;
+    int m_mode;
 };
 
 class QDrawingPoint
@@ -54,11 +74,11 @@ public:
     QDrawingPoint();
     QDrawingPoint(qreal xpos, qreal ypos, qreal pressure = 1.0, QVector2D normal = QVector2D(0, -1));
 
-    qreal x();
-    qreal y();
-    qreal pressure();
-    QVector2D normal();
-    operator QPointF ();
+    qreal x() const;
+    qreal y() const;
+    qreal pressure() const;
+    QVector2D normal() const;
+    operator QPointF () const;
 
     void setX(qreal x);
     void setY(qreal y);
@@ -72,38 +92,164 @@ protected:
     QVector2D m_normal;
 };
 
+class QDrawingStroke;
+
+/**
+ * @brief Proxy to a point stored inside a QDrawingStroke.
+ *
+ * Strokes keep their points in separate coordinate and pressure arrays, so indexing returns this
+ * reference instead of a QDrawingPoint&.
+ */
+class QDrawingPointRef
+{
+public:
+    qreal x() const;
+    qreal y() const;
+    qreal pressure() const;
+    QVector2D normal() const;
+    operator QPointF () const;
+    operator QDrawingPoint () const;
+
+    void setX(qreal x);
+    void setY(qreal y);
+    void setPressure(qreal pressure);
+
+private:
+    friend class QDrawingStroke;
+    QDrawingPointRef(QDrawingStroke *stroke, int index);
+    void updateNormals();
+
+    QDrawingStroke *m_stroke;
+    int m_index;
+};
+
+class QDrawingStrokeData;
+
+/**
+ * @brief Implicitly shared stroke.
+ *
+ * Copies are cheap and share their point storage.  Points live in fixed-size chunks that are only
+ * ever appended to, so a copy keeps seeing the points it was taken with while the original grows.
+ */
 class QDrawingStroke
 {
+    friend class QDrawingPointRef;
+    friend class StrokeTessellator;
+    friend class StrokeLevels;
+    friend class DrawingDocument;
+    friend class DrawingJournal;
+    friend class InputProcessor;
 public:
     QDrawingStroke();
+    QDrawingStroke(const QDrawingStroke &other);
+    ~QDrawingStroke();
+    QDrawingStroke &operator=(const QDrawingStroke &other);
 
-    quint32 id();
-    QDrawingPen* pen();
+    quint32 id() const;
+    QDrawingPen* pen() const;
 
+    /**
+     * @brief Draws the stroke with a copy of `pen`.  Equal pens share one registered copy.
+     */
     void setPen(QSharedPointer<QDrawingPen> pen);
     void setId(quint32 id);
     /**
-     * @brief setDirty
-     * @param dirty
-     * @param at First point in the stroke that is dirty. Default 0 marks the entire stroke as dirty.
+     * @brief Obsolete, does nothing.  Views are told which points changed by
+     * QAbstractDrawingModel::strokeChanged() and render only the tiles they cover.
+     */
+    QT_DEPRECATED void setDirty(bool dirty = true, int at = 0);
+    /**
+     * @brief Obsolete, always false.
+     */
+    QT_DEPRECATED bool dirty() const;
+    /**
+     * @brief Obsolete, always 0.
      */
-    void setDirty(bool dirty = true, int at = 0);
-    bool dirty();
-    int dirtyAt();
+    QT_DEPRECATED int dirtyAt() const;
+
+    /**
+     * @brief Compact strokes do not cache point normals and derive them on access instead.
+     *
+     * Points take 10 bytes in compact mode and 18 bytes otherwise.
+     */
+    void setCompact(bool compact);
+    bool isCompact() const;
 
     QDrawingStroke& operator<<(const QDrawingPoint &p);
+    /**
+     * @brief Appends `count` points at once.  `pressure` may be null for full pressure.
+     */
+    void append(const float *x, const float *y, const float *pressure, int count);
+    /**
+     * @brief True if the ink of `s` touches the ink of this stroke anywhere.
+     */
     bool operator&(const QDrawingStroke &s);
-    QDrawingPoint& operator[](const unsigned long index);
+    QDrawingPointRef operator[](const unsigned long index);
+    QDrawingPoint operator[](const unsigned long index) const;
     unsigned long size() const;
+    void reserve(int size);
+    /**
+     * @brief Bounds of the point positions from `from` on, not including the pen width.
+     */
+    QRectF boundingRect(int from = 0) const;
+    /**
+     * @brief Approximate number of bytes held by the point storage of this stroke.
+     */
+    qint64 memoryUsage() const;
+    /**
+     * @brief Builds the simplified levels of detail used to draw the stroke when zoomed out.
+     *
+     * Meant for finished strokes, any later change to the points or the pen drops them again.
+     */
+    void simplify();
+    /**
+     * @brief Replaces the points with the control points of `count` / 3 cubic Bézier segments.
+     *
+     * The first point starts the first segment, every segment adds two inner control points and its
+     * end point, which starts the next one.  Meant for finished strokes, points appended later are
+     * taken as control points as well.
+     */
+    void setCurves(const float *x, const float *y, const float *pressure, int count);
+    bool hasCurves() const;
 
 protected:
-    QList<int> m_newPoints;
-    QVector<QDrawingPoint> m_points;
-    quint32 m_id;
-    int m_mode;
-    QSharedPointer<QDrawingPen> m_pen;
-    bool m_dirty;
-    int m_dirtyAt;
+    QVector2D calcNormal(int index) const;
+
+    QSharedDataPointer<QDrawingStrokeData> d;
+};
+
+class QDrawingSnapshotData;
+
+/**
+ * @brief Immutable view of a drawing model at one point in time.
+ *
+ * Taking a snapshot never blocks the input thread and its strokes share point storage with the
+ * live model.  Memory only referenced by old snapshots is freed when the last copy is dropped.
+ */
+class QDrawingSnapshot
+{
+    friend class Rasterizer;
+    friend class DrawingJournal;
+    friend class InputProcessor;
+    friend struct QAbstractDrawingModelPrivate;
+public:
+    QDrawingSnapshot();
+
+    bool isNull() const;
+    /**
+     * @brief Increases every time the model publishes its changes.
+     */
+    quint64 version() const;
+    int strokeCount() const;
+    /**
+     * @brief Ids of all strokes from the bottom to the top of the drawing order.
+     */
+    QList<quint32> strokeIds() const;
+    bool contains(quint32 strokeId) const;
+    QDrawingStroke stroke(quint32 strokeId) const;
+
+private:
+    QSharedPointer<const QDrawingSnapshotData> d;
 };
 
 class QAbstractDrawingModel : public QObject
@@ -117,20 +263,134 @@ public:
     /**
      * @brief Sets the size of the drawing document in millimeters.
      *
-     * The drawing document is an internal area that scales to the size of the QDrawingArea widget.
-     * This document uses sizes in mm (millimeters) to provide DPI- and scaling-independent drawing.
-     *
+     * Stroke points, pen widths and spatial queries all use mm (millimeters) to provide DPI- and
+     * scaling-independent drawing.  QDrawingArea::setViewport() decides which part of the
+     * document is shown at which size.  The size is saved with the document.
      *
      * @param size
      */
     void setDrawingSize(QSizeF &size);
+    /**
+     * @brief New strokes use compact point storage.  See QDrawingStroke::setCompact().
+     */
+    void setCompactStorage(bool compact);
+    /**
+     * @brief Finished strokes are stored as cubic curves that stay within `tolerance` mm of their
+     * samples, including pen width.  0 keeps every sample.  The default is 0.05 mm.
+     */
+    void setCurveTolerance(qreal tolerance);
+    qreal curveTolerance() const;
+    /**
+     * @brief Latest published state of the model.  Safe to call from any thread.
+     */
+    QDrawingSnapshot snapshot() const;
+
+    /**
+     * @brief Writes the drawing to `fileName` in the binary document format.
+     */
+    bool save(const QString &fileName);
+    /**
+     * @brief Replaces the drawing with the document in `fileName`.
+     *
+     * The file is mapped instead of read.  Pages of point data are only loaded once a stroke is
+     * drawn or queried, and a stroke only gets its own copy of its points when it is modified.
+     * Emits strokesInserted() for the whole document.
+     */
+    bool load(const QString &fileName);
+    /**
+     * @brief Saves the drawing to `fileName` and keeps recording changes to it in a journal.
+     *
+     * Stroke starts, new points, finished and removed strokes are appended to `fileName`.journal
+     * from a background thread, which syncs at most once a second.  Once the journal grows large
+     * it is folded into a fresh save of the document and started over.
+     */
+    bool startJournal(const QString &fileName);
+    /**
+     * @brief Writes out the rest of the journal and stops recording.
+     */
+    void stopJournal();
+    /**
+     * @brief Loads `fileName` like load() and applies what its journal recorded after the last save.
+     */
+    bool recover(const QString &fileName);
     bool hasIndex(quint32 strokeId);
-    const QDrawingStroke& index(quint32 strokeId);
+    /**
+     * @brief The stroke with id `strokeId` as of the latest published state.
+     */
+    QDrawingStroke index(quint32 strokeId);
+
+    /**
+     * @brief Collects the following appends into one batch.  Batches nest, the outermost
+     * endInsert() commits them.
+     *
+     * The strokes of a batch become visible together.  The spatial index is built once for all of
+     * them, strokesInserted() is emitted once and attached drawing areas render everything once.
+     * Batches must be started and committed from the same thread.
+     *
+     * @param strokes Expected number of strokes, used to pre-size the storage.
+     */
+    void beginInsert(int strokes = 0);
+    void endInsert();
+    /**
+     * @brief Adds a stroke on top of the drawing.  Commits right away outside of a batch.
+     */
     void append(const QDrawingStroke& stroke);
+    void append(const QList<QDrawingStroke> &strokes);
+    /**
+     * @brief Adds a stroke made of `count` points.  `pressure` may be null for full pressure.
+     */
+    void append(QSharedPointer<QDrawingPen> pen, const float *x, const float *y, const float *pressure, int count);
+    /**
+     * @brief Removes the stroke with id `strokeId` and emits strokeRemoved().
+     */
+    void remove(quint32 strokeId);
+
+    /**
+     * @brief Undoes the last finished stroke, batch of appended strokes or removal.
+     *
+     * History steps share their strokes with the drawing, so each only holds on to the strokes it
+     * added, removed or changed.  Undo and redo touch only those strokes and emit strokesChanged().
+     * Loading a document clears the history.
+     */
+    void undo();
+    void redo();
+    bool canUndo() const;
+    bool canRedo() const;
+    void clearHistory();
+    /**
+     * @brief Drops the oldest steps once the history holds more than `bytes` of stroke points,
+     * counting points shared with the drawing.  0 disables the history.  The default is 64 MB.
+     */
+    void setUndoLimit(qint64 bytes);
+    qint64 undoMemoryUsage() const;
+
+    /**
+     * @brief Strokes whose inked area lies within `tolerance` of `point`.
+     */
+    QList<quint32> strokesAt(const QPointF &point, qreal tolerance = 0);
+    /**
+     * @brief Strokes whose inked area intersects `rect`.
+     */
+    QList<quint32> strokesIn(const QRectF &rect);
+    /**
+     * @brief Strokes whose inked area lies within `tolerance` of any segment of `polyline`.
+     */
+    QList<quint32> strokesAlong(const QPolygonF &polyline, qreal tolerance = 0);
 
 signals:
     void strokeInserted(const QDrawingStroke& stroke);
+    /**
+     * @brief A batch of appended strokes was committed.
+     * @param strokeIds New ids in drawing order.
+     */
+    void strokesInserted(const QList<quint32> &strokeIds);
     void strokeRemoved(const QDrawingStroke& stroke);
+    /**
+     * @brief Strokes were removed, or put back or taken out by undo() and redo().
+     * @param strokeIds Ids of the strokes, whether they exist now or not.
+     * @param area Ink of the strokes before and after the change, in mm.
+     */
+    void strokesChanged(const QList<quint32> &strokeIds, const QRectF &area);
     /**
      * @brief Stroke has had modifications that would warrent the entire stroke being redrawn/reprocessed.
      * @param stroke
@@ -156,6 +416,54 @@ private:
     Q_DISABLE_COPY(QAbstractDrawingModel)
 };
 
+/**
+ * @brief Summary of a latency distribution, in microseconds.
+ */
+struct QDrawingLatency
+{
+    qint64 count;
+    qreal mean;
+    qreal p50;
+    qreal p95;
+    qreal p99;
+    qreal max;
+};
+
+/**
+ * @brief Snapshot of the input-to-ink pipeline statistics of a QDrawingArea.
+ */
+struct QDrawingAreaMetrics
+{
+    enum Stage {
+        Stage_Enqueued,     // Queued to the InputProcessor
+        Stage_Appended,     // Appended to its stroke
+        Stage_Rasterized,   // Rendered into the backing store
+        Stage_Delivered,    // Handed to the widget
+        Stage_Painted,      // Painted on screen
+        StageCount
+    };
+
+    /**
+     * @brief Time from receiving an input event until it passed each stage.
+     */
+    QDrawingLatency latency[StageCount];
+    QDrawingLatency repaintDuration;
+    QDrawingLatency fullRepaintDuration;
+    qint64 samples;
+    qint64 frames;
+    /**
+     * @brief Frame intervals that passed while a frame was due, e.g. behind a slow repaint.
+     */
+    qint64 droppedFrames;
+    qint64 queueOverflows;
+    /**
+     * @brief Samples processed per InputProcessor wakeup.
+     */
+    qreal meanBatchSize;
+    qint64 maxBatchSize;
+    qreal meanStrokesPerFrame;
+};
+
 class QDrawingArea : public QWidget
 {
     Q_OBJECT
@@ -177,18 +485,111 @@ public:
         D_EmulatePressure= 0x04000000,
     };
 
+    enum ReplayMode {
+        ReplayOriginalTiming,
+        ReplayAsFastAsPossible
+    };
+
     void setFlag(int flag, bool enable = true);
+    /**
+     * @brief Caps frames at `updatesPerSecond`.  0, the default, follows the refresh rate of the
+     * screen.  Frames are only drawn when there is something new to show.
+     */
     void setUpdateRate(int updatesPerSecond);
-    void addPen(QDrawingPen &p);
+    /**
+     * @brief Draws each active stroke ahead of the pen by `ms`, extrapolated from its recent motion.
+     *
+     * Predicted ink is only shown until the next frame and never enters the model.  0, the default,
+     * disables prediction.
+     */
+    void setPredictionHorizon(int ms);
+    int predictionHorizon() const;
+    /**
+     * @brief Draws with a copy of `pen` while its button is held.
+     *
+     * Pens added for a tablet `pointer` type take precedence for that pointer, e.g. the eraser end
+     * of a stylus.  Otherwise the pen added first for a button wins.  Pens in an eraser mode erase
+     * what they touch instead of drawing, one eraser contact is one undo step.
+     */
+    void addPen(const QDrawingPen &pen, QTabletEvent::PointerType pointer = QTabletEvent::UnknownPointer);
     QAbstractDrawingModel *model();
 
+    /**
+     * @brief Shows the document from `origin`, in mm at the top left corner of the widget, at
+     * `scale` device pixels per mm.
+     *
+     * Never waits for rendering: tiles already rendered at this or earlier scales are painted
+     * scaled into place right away and replaced once the view is rendered in the background.
+     * Input is mapped through the same viewport, strokes are stored in mm.  The default scale is
+     * the logical DPI of the widget, 1:1 with paper.
+     */
+    void setViewport(const QPointF &origin, qreal scale);
+    QPointF viewportOrigin() const;
+    qreal viewportScale() const;
+    /**
+     * @brief Maps document mm to widget pixels.
+     */
+    QTransform viewTransform() const;
+
+    /**
+     * @brief Number of input samples waiting to be processed.
+     */
+    int inputQueueDepth() const;
+    /**
+     * @brief Highest number of input samples that were waiting at once.
+     */
+    int inputQueuePeakDepth() const;
+    /**
+     * @brief Number of input samples dropped because the input queue was full.
+     */
+    int inputQueueOverflows() const;
+    /**
+     * @brief True once every queued input sample has been applied to the model, including the
+     * batch the input thread may be working on.
+     */
+    bool isInputIdle() const;
+
+    /**
+     * @brief Per-stage latencies and counters collected since construction or resetMetrics().
+     *
+     * Debug output of the pipeline is available through the qdrawingarea.* logging categories.
+     */
+    QDrawingAreaMetrics metrics() const;
+    void resetMetrics();
+
+    /**
+     * @brief Appends every accepted input sample to a binary trace file until stopRecording().
+     * @return false if the file could not be opened.
+     */
+    bool startRecording(const QString &fileName);
+    void stopRecording();
+    bool isRecording() const;
+    /**
+     * @brief Feeds a trace written by startRecording() back through the input pipeline.
+     *
+     * Pens are referenced by the order they were added with addPen().  replayFinished() is emitted
+     * once every sample was queued.
+     * @return false if the file is not a readable trace.
+     */
+    bool replayTrace(const QString &fileName, ReplayMode mode = ReplayOriginalTiming);
+    void stopReplay();
+
 signals:
+    /**
+     * @brief New ink reached the widget's backing store and a repaint was requested.
+     */
+    void canvasUpdated();
+    void replayFinished();
+    /**
+     * @brief The input thread applied a batch of samples to the model.  See isInputIdle().
+     */
+    void inputProcessed();
 
 public slots:
     void setModel(QAbstractDrawingModel *model);
 
 private slots:
-    void updatePixmap(QPixmap p);
+    void updateTiles(const RasterTileUpdate &update);
 
 protected:
     /**
@@ -197,14 +598,20 @@ protected:
      * @param y Y value in relative coordinate space of widget.
      * @param pressure Pressure applied at the point in the range of [0..1].
      */
-    void addStrokePoint(quint32 deviceId, QSharedPointer<QDrawingPen> pen, qreal x, qreal y, qreal pressure);
+    void addStrokePoint(quint32 deviceId, quint16 pen, qreal x, qreal y, qreal pressure);
     void finishStroke(quint32 deviceId);
 
-    QSharedPointer<QDrawingPen> findPenFromButtons(Qt::MouseButtons buttons);
+    /**
+     * @brief Id of the pen to draw with while `buttons` are held, QDrawingPen::InvalidId if none.
+     */
+    quint16 findPenFromButtons(Qt::MouseButtons buttons, QTabletEvent::PointerType pointer = QTabletEvent::UnknownPointer);
 
 private:
     QDrawingAreaPrivate *d_ptr;
     Q_DECLARE_PRIVATE(QDrawingArea)
 };
 
+// Model signals are queued from the input thread while erasing
+Q_DECLARE_METATYPE(QDrawingStroke)
+
 #endif // QDRAWINGPAD_H
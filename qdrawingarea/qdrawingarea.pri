@@ -1,11 +1,21 @@
-QT	+= core gui
+QT	+= core gui concurrent
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET	= qdrawingarea
 TEMPLATE = lib
 CONFIG  += debug_and_release_target debug_and_release
 
-SOURCES += qdrawingarea.cpp
+SOURCES += qdrawingarea.cpp \
+	qdrawingdocument.cpp \
+	qdrawinggeometry.cpp \
+	qdrawingjournal.cpp \
+	qdrawingkernel.cpp \
+	qdrawingmetrics.cpp \
+	qdrawingstroke.cpp \
+	qdrawingtrace.cpp
 
 HEADERS += qdrawingarea.h \
-	qdrawingarea_p.h
+	qdrawingarea_p.h \
+	qdrawingdocument_p.h \
+	qdrawinggeometry_p.h \
+	qdrawingstroke_p.h
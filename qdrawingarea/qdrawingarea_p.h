@@ -1,24 +1,251 @@
 #ifndef QDRAWINGAREA_P
 #define QDRAWINGAREA_P
 
+#include <QAtomicInt>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QLoggingCategory>
 #include <QMap>
+#include <QMutex>
 #include <QObject>
+#include <QPainterPath>
+#include <QReadWriteLock>
+#include <QSet>
 #include <QThread>
 #include <QTimer>
 #include <QVector>
-#include <QPixmap>
+#include <QImage>
 #include <QTouchDevice>
 #include <QMouseEvent>
 
+#include "qdrawingarea.h"
+#include "qdrawingstroke_p.h"
+#include "qdrawinggeometry_p.h"
+
 class QDrawingStroke;
 class QDrawingPen;
 class QDrawingArea;
 struct QDrawingAreaPrivate;
 class QAbstractDrawingModel;
 
+Q_DECLARE_LOGGING_CATEGORY(lcDrawingEvents)
+Q_DECLARE_LOGGING_CATEGORY(lcDrawingInput)
+Q_DECLARE_LOGGING_CATEGORY(lcDrawingRaster)
+Q_DECLARE_LOGGING_CATEGORY(lcDrawingPaint)
+
+/**
+ * @brief Lock-free latency histogram with power of two microsecond buckets.
+ */
+class LatencyHistogram
+{
+public:
+    enum {
+        BucketCount = 32
+    };
+
+    LatencyHistogram();
+
+    void add(qint64 ns);
+    void reset();
+    QDrawingLatency summary() const;
+
+private:
+    QAtomicInt buckets[BucketCount];
+    QAtomicInteger<qint64> count;
+    QAtomicInteger<qint64> sum;   // us
+    QAtomicInteger<qint64> max;   // us
+};
+
+/**
+ * @brief Counters and histograms shared by all pipeline stages, read through QDrawingArea::metrics().
+ */
+struct MetricsCollector
+{
+    MetricsCollector();
+
+    void recordBatch(int samples);
+    void reset();
+    QDrawingAreaMetrics summary() const;
+
+    LatencyHistogram stages[QDrawingAreaMetrics::StageCount];
+    LatencyHistogram repaint;
+    LatencyHistogram fullRepaint;
+    QAtomicInteger<qint64> samples;
+    QAtomicInteger<qint64> frames;
+    QAtomicInteger<qint64> droppedFrames;
+    QAtomicInteger<qint64> frameStrokes;
+    QAtomicInteger<qint64> batches;
+    QAtomicInteger<qint64> batchSamples;
+    QAtomicInteger<qint64> maxBatch;
+};
+
+/**
+ * @brief Compact input sample passed from the GUI thread to the InputProcessor.
+ */
+struct InputSample
+{
+    enum {
+        Move    = 0,
+        Release = 1,
+        Press   = 2  // Only used in traces, processed like Move
+    };
+
+    quint32 deviceId;
+    quint16 pen;        // PenRegistry id, traces store the index into QDrawingAreaPrivate::pens
+    quint16 type;
+    float x;
+    float y;
+    float pressure;
+    qint64 timestamp;   // ns, QDrawingAreaPrivate::clock
+};
+
+/**
+ * @brief Bounded single-producer/single-consumer ring buffer.
+ *
+ * push() is only called from the producer thread and pop() only from the consumer thread.
+ * Neither allocates; a full queue rejects the item and counts an overflow.
+ */
+template <typename T, int Capacity>
+class SpscQueue
+{
+    Q_STATIC_ASSERT_X((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    SpscQueue() : m_head(0), m_tail(0), m_peak(0), m_overflows(0) {}
+
+    bool push(const T &item)
+    {
+        quint32 tail = m_tail.load();
+        quint32 depth = tail - m_head.loadAcquire();
+
+        if(depth >= (quint32)Capacity)
+        {
+            m_overflows.ref();
+            return false;
+        }
+
+        m_items[tail & (Capacity - 1)] = item;
+        m_tail.storeRelease(tail + 1);
+
+        if(depth + 1 > (quint32)m_peak.load())
+            m_peak.store(depth + 1);
+
+        return true;
+    }
+
+    /**
+     * @brief Pushes as many of `items` as fit and publishes them together.  Returns how many.
+     */
+    int push(const T *items, int count)
+    {
+        quint32 tail = m_tail.load();
+        quint32 depth = tail - m_head.loadAcquire();
+        int accepted = qMin<quint32>(count, depth < (quint32)Capacity ? Capacity - depth : 0);
+
+        for(int i = 0; i < accepted; i++)
+            m_items[(tail + i) & (Capacity - 1)] = items[i];
+
+        m_tail.storeRelease(tail + accepted);
+
+        if(accepted < count)
+            m_overflows.fetchAndAddRelaxed(count - accepted);
+
+        if(depth + accepted > (quint32)m_peak.load())
+            m_peak.store(depth + accepted);
+
+        return accepted;
+    }
+
+    int pop(T *items, int max)
+    {
+        quint32 head = m_head.load();
+        int count = qMin<quint32>(m_tail.loadAcquire() - head, max);
+
+        for(int i = 0; i < count; i++)
+            items[i] = m_items[(head + i) & (Capacity - 1)];
+
+        m_head.storeRelease(head + count);
+
+        return count;
+    }
+
+    int depth() const { return m_tail.loadAcquire() - m_head.loadAcquire(); }
+    /**
+     * @brief Items accepted since construction, wrapping around at 2^32.
+     */
+    quint32 pushed() const { return m_tail.loadAcquire(); }
+    int peakDepth() const { return m_peak.load(); }
+    int overflows() const { return m_overflows.load(); }
+    int capacity() const { return Capacity; }
+
+private:
+    T m_items[Capacity];
+    QAtomicInteger<quint32> m_head;
+    QAtomicInteger<quint32> m_tail;
+    QAtomicInt m_peak;
+    QAtomicInt m_overflows;
+};
+
+/**
+ * @brief Extrapolates the stroke of one device from the velocity and acceleration of its samples.
+ */
+struct StrokePredictor
+{
+    enum {
+        Steps = 4   // Points per prediction
+    };
+
+    StrokePredictor();
+
+    void add(quint16 pen, qreal x, qreal y, qreal pressure, qint64 timestamp);
+    /**
+     * @brief Positions `horizon` ms past the last sample, empty until the motion is known.
+     */
+    QVector<QDrawingPoint> predict(qreal horizon) const;
+
+    quint16 pen;
+    QPointF position;       // mm
+    QPointF velocity;       // mm/ms
+    QPointF acceleration;   // mm/ms²
+    qreal pressure;
+    qint64 timestamp;       // QDrawingAreaPrivate::clock
+    int samples;            // Samples with distinct timestamps
+};
+
+/**
+ * @brief One undoable step: the strokes it changed as they were before and after it.
+ *
+ * The copies share their points with the drawing and with each other.  A stroke without a pen
+ * stands for an id that did not exist on that side.
+ */
+struct HistoryEntry
+{
+    QList<quint32> ids;
+    QList<QDrawingStroke> before;
+    QList<QDrawingStroke> after;
+    qint64 cost;    // Bytes of point storage held, shared storage included
+
+    HistoryEntry() : cost(0) {}
+};
+
+/**
+ * @brief Ink the widget draws over the tiles, for wet strokes and predictions.
+ */
+struct OverlayStroke
+{
+    QColor color;
+    QPainterPath outline;   // mm
+};
+
 class InputProcessor : public QObject
 {
     friend class QDrawingArea;
+    friend struct QDrawingAreaPrivate;
+    friend class TraceReplayer;
+    friend class FrameScheduler;
 
     Q_OBJECT
 public:
@@ -26,57 +253,500 @@ public:
     ~InputProcessor();
 
     enum {
-        RepaintInterval = 100 // ms
+        QueueCapacity = 4096,  // samples
+        DrainBatchSize = 256   // samples
     };
 
+    typedef SpscQueue<InputSample, QueueCapacity> SampleQueue;
+
     void moveToThread(QThread *targetThread);
 
-signals:
-    void repaint(QList<int> modifiedStrokes);
 public slots:
-    void processPoint(quint32 deviceId, QSharedPointer<QDrawingPen> pen, qreal x, qreal y, qreal pressure);
+    void processPoint(quint32 deviceId, quint16 penId, qreal x, qreal y, qreal pressure);
     void finishPoint(quint32 deviceId);
     void finishAllPoints();
-    void repaintTimeout();
-    void setRepaintInterval(int timeout);
+    /**
+     * @brief Processes all samples queued by QDrawingArea.  Invoked once per batch.
+     */
+    void drainSamples();
 
 private:
-    void processErasing();
+    /**
+     * @brief Erases along the eraser segment from the last sample of `deviceId` to `point`.
+     */
+    void processErasing(quint32 deviceId, const QDrawingPen *eraser, const QDrawingPoint &point);
+    /**
+     * @brief Cuts the segments `cuts` out of `stroke`.
+     * @param unchanged Leading points the first piece shares with `stroke`.
+     * @return False if nothing was cut.
+     */
+    static bool cutStroke(const QDrawingStroke &stroke, const QVector<quint32> &cuts, const QPointF &from,
+                          const QPointF &to, qreal radius, QList<QDrawingStroke> *pieces, int *unchanged);
+    static bool cutPoints(const QDrawingStroke &stroke, const QVector<float> &x, const QVector<float> &y,
+                          const QVector<quint16> &pressure, const QVector<quint32> &cuts,
+                          QList<QDrawingStroke> *pieces, bool *fromStart);
+    /**
+     * @brief Splits the curves in `cuts` where the eraser segment crosses them, the index only
+     * knows which curve was hit.  The other curves keep their control points.
+     */
+    static bool cutCurves(const QDrawingStroke &stroke, const QVector<float> &x, const QVector<float> &y,
+                          const QVector<quint16> &pressure, const QVector<quint32> &cuts, const QPointF &from,
+                          const QPointF &to, qreal radius, QList<QDrawingStroke> *pieces, bool *fromStart);
+    static void addPiece(const QDrawingStroke &stroke, const float *x, const float *y, const float *pressure,
+                         int count, QList<QDrawingStroke> *pieces);
+    QVector<OverlayStroke> predict(qreal horizon) const;
 
-    QTimer repaintTimer;
+    SampleQueue samples;
+    QAtomicInt wakeupPending;
+    QAtomicInteger<quint32> processed;  // Samples applied to the model, compared with samples.pushed()
     QDrawingArea *drawingArea;
     struct QDrawingAreaPrivate *d;
-    QMap<quint32, quint32> deviceIdMap;
+    QHash<quint32, quint32> deviceIdMap;
+    QHash<quint32, CurveFitter> fitters;  // By device, while curve fitting is enabled
     QList<int> modifiedStrokes;
+    qint64 pendingEventTime;
+    QAtomicInt predictionHorizon;   // ms, 0 if disabled
+    QHash<quint32, StrokePredictor> predictors;
+    QHash<quint32, QPointF> erasers;         // Last sample by device, while erasing
+    QHash<quint32, HistoryEntry> erasures;   // By device, one undo step per eraser contact
+    bool predicting;                // Last batch posted a prediction
+};
+
+/**
+ * @brief Paces frames to the refresh rate of the screen.
+ *
+ * Work posted between frames is coalesced into the next one.  A frame starts right away when the
+ * last one is at least an interval old, and no timer runs while there is nothing to draw.
+ */
+class FrameScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FrameScheduler(struct QDrawingAreaPrivate *d);
+
+    /**
+     * @brief Queues strokes with new points for the next frame.  Thread safe.
+     * @param eventTime Receive time of the oldest input event in this batch, QDrawingAreaPrivate::clock.
+     */
+    void post(const QList<int> &modifiedStrokes, qint64 eventTime);
+    /**
+     * @brief Queues a stroke that was finished, to move it to the tiles with the next frame.  Thread safe.
+     */
+    void finish(int stroke);
+    /**
+     * @brief Replaces the prediction overlay with the next frame.  Thread safe.
+     */
+    void setPrediction(const QVector<OverlayStroke> &prediction);
+    /**
+     * @brief Requests a frame without new ink, e.g. after a viewport change.  Thread safe.
+     */
+    void requestFrame();
+    /**
+     * @brief Frames per second, 0 follows the refresh rate of the screen.
+     */
+    void setRate(int framesPerSecond);
+    qint64 interval() const; // ns
+
+private slots:
+    void schedule();
+    void frame();
+    void expirePrediction();
+
+private:
+    struct QDrawingAreaPrivate *d;
+    QTimer timer;
+    QTimer predictionTimer;     // Clears a prediction no sample followed up on
+    QMutex lock;
+    QList<int> pendingStrokes;
+    QList<int> pendingFinished;
+    qint64 pendingEventTime;
+    QVector<OverlayStroke> pendingPrediction;
+    bool predictionPending;
+    QAtomicInt requested;
+    QAtomicInteger<qint64> requestTime;  // First request since the last frame, QDrawingAreaPrivate::clock
+    int rate;
+    qint64 lastFrame;
+    qint64 target;      // Start the scheduled frame is due, -1 if none
 };
 
+/**
+ * @brief Rendered tiles of one viewport scale.
+ *
+ * Tiles are anchored to the document rather than the widget: tile (column, row) covers TileSize
+ * device pixels starting at (column, row) * TileSize, in document coordinates times `scale`.
+ * Panning keeps every tile that stays in view.
+ */
+struct TileLevel
+{
+    enum {
+        TileSize = 128 // px
+    };
+
+    TileLevel() : scale(0) {}
+
+    static quint64 key(int column, int row) { return (quint64)(quint32)column << 32 | (quint32)row; }
+    /**
+     * @brief Area of the tile `key` in device pixels of its level.
+     */
+    static QRect rect(quint64 key);
+    /**
+     * @brief Keys of the tiles covering `area`, in device pixels of the level.
+     */
+    static QVector<quint64> keysIn(const QRect &area);
+    /**
+     * @brief Drops the tiles outside of `area`.
+     */
+    void evict(const QRect &area);
+
+    qreal scale;    // Device pixels per mm
+    QHash<quint64, QImage> tiles;
+};
+
+/**
+ * @brief Set of tiles handed from the Rasterizer to QDrawingArea.
+ *
+ * A full update replaces every tile of the level at `scale`, otherwise the listed tiles replace
+ * the ones with the same keys.
+ */
+struct RasterTileUpdate
+{
+    RasterTileUpdate() : scale(0), full(false), eventTime(-1), wetChanged(false) {}
+
+    qreal scale;
+    bool full;
+    qint64 eventTime;   // Oldest input event drawn into these tiles, -1 if none
+    QVector<quint64> keys;
+    QVector<QImage> tiles;
+    bool wetChanged;    // `wet` replaces the wet layer
+    QVector<OverlayStroke> wet;
+    QRectF wetDirty;    // mm
+};
+
+Q_DECLARE_METATYPE(RasterTileUpdate)
+
 class Rasterizer : public QObject
 {
     Q_OBJECT
 public:
     explicit Rasterizer(struct QDrawingAreaPrivate *d);
 
+    enum {
+        KeptTiles = 1 // Ring of tiles kept around the view, so short pans need no rendering
+    };
+
     void moveToThread(QThread *targetThread);
 
 signals:
-    void updateRender(QPixmap img);
+    void updateRender(const RasterTileUpdate &update);
 public slots:
-    void repaint(QList<int> modifiedStrokes);
     /**
-     * @brief Full render at a later time.  Collapses multiple calls.
+     * @brief Brings the tiles up to date with the viewport, extends the wet outlines of
+     * `modifiedStrokes` and bakes `finishedStrokes` into the tiles.
+     */
+    void repaint(QList<int> modifiedStrokes, QList<int> finishedStrokes, qint64 eventTime = -1);
+    /**
+     * @brief Renders all tiles again with the next frame.
      */
-    void repaintLater();
+    void invalidate();
+    /**
+     * @brief Renders the tiles under `area`, in mm, again with the next frame, with `strokes` as
+     * they are now.
+     */
+    void invalidateStrokes(const QList<quint32> &strokes, const QRectF &area);
 
 private slots:
-    void repaintTimeout();
+    void refineFinished();
 
 private:
-    inline void renderFullStroke(QPainter &p, QDrawingStroke &stroke);
-    inline void renderPartialStroke(QPainter &p, QDrawingStroke &stroke);
-    inline void renderStrokeFrom(QPainter &p, QDrawingStroke &stroke, int point);
+    /**
+     * @brief Stroke ranges to draw in one pass and the tiles they go to.
+     */
+    struct Frame
+    {
+        qreal scale;
+        bool smooth;
+        QVector<const QDrawingStroke*> strokes;
+        QVector<int> from;
+        QVector<int> to;
+        QVector<QRect> bounds;          // Device pixels of the level
+        QVector<QRect> rects;           // Tiles to draw to, device pixels of the level
+        QVector<QImage*> images;
+        QVector<QVector<int> > bands;   // Tiles of each tile row, filled by render()
+    };
+    struct Band;
+
+    /**
+     * @brief Whole tiles to render in the background from a snapshot.
+     */
+    struct RefineJob
+    {
+        QDrawingSnapshot snapshot;
+        qreal scale;
+        bool full;      // Replaces the level instead of adding tiles to it
+        bool smooth;
+        QColor background;
+        QVector<quint64> keys;
+        QHash<quint32, int> drawn;  // Points the tiles get of these strokes, all for others if full
+    };
+
+    /**
+     * @brief Outline of the points of an active stroke past those in the tiles.
+     */
+    struct WetStroke
+    {
+        int drawn;
+        QColor color;
+        QPainterPath outline;   // mm
+    };
+
+    struct RefineResult
+    {
+        RefineResult() : scale(0), full(false) {}
+
+        qreal scale;
+        bool full;
+        QHash<quint64, QImage> tiles;
+        QHash<quint32, int> drawnPoints;    // Full renders only
+    };
+
+    static RefineResult refine(const RefineJob &job);
+    void startRefine(bool full, const QVector<quint64> &keys);
+    /**
+     * @brief Holds strokes back until the running refine is in.
+     */
+    void defer(const QList<int> &strokes, const QList<int> &finished, qint64 eventTime);
+
+    static QRect strokeBounds(const QDrawingStroke &stroke, int from, qreal scale);
+    /**
+     * @brief Draws `frame` into its tiles, spreading tile rows over the global thread pool.
+     */
+    static void render(Frame &frame);
+    /**
+     * @brief Renders the tiles of `band`.  Bands share no tiles, so any number of them can be
+     * rendered concurrently.
+     */
+    static void renderBand(const Frame &frame, int band);
+
+    static inline QPainterPath strokeOutline(const QDrawingStroke &stroke, int point, int last, qreal scale);
+
+    struct QDrawingAreaPrivate *d;
+    bool invalidated;
+    QRectF invalidArea;     // mm, tiles to render again
+    QList<quint32> changedStrokes;
+    TileLevel level;
+    QHash<quint32, int> drawnPoints; // Points of each stroke already in the tiles
+    QMap<quint32, WetStroke> wet;   // Active strokes are always inserted on top, so ids are drawing order
+    QFutureWatcher<RefineResult> refineWatcher;
+    QElapsedTimer refineDuration;
+    QList<int> deferredStrokes;
+    QList<int> deferredFinished;
+    qint64 deferredEventTime;
+};
+
+static const qreal IndexFlatness = 0.1; // mm, curves are indexed by their path flattened to this
+
+/**
+ * @brief Uniform grid over stroke segments, maintained incrementally as points are appended.
+ *
+ * Each segment keeps a copy of its geometry so queries never touch the stroke storage.
+ * Safe to query from any thread while the InputProcessor inserts.
+ *
+ * Strokes added in bulk are only registered with their bounds.  Queries skip them, callers refine
+ * the strokes returned by unrefinedIn() with insertStroke() before querying an area.
+ */
+class StrokeSpatialIndex
+{
+public:
+    enum {
+        CellSize = 16, // mm
+        Unrefined = 0xffffffff // Segment index of a bounds-only entry
+    };
+
+    struct Segment
+    {
+        quint32 stroke;
+        quint32 index;  // First point of the segment
+        float x1;
+        float y1;
+        float x2;
+        float y2;
+        float radius;   // Half of the stroke thickness
+    };
+
+    /**
+     * @brief Registers the segment from point `index` to `index + 1` of `stroke`.  A dot uses p1 == p2.
+     */
+    void insert(quint32 stroke, quint32 index, const QPointF &p1, const QPointF &p2, qreal radius);
+    /**
+     * @brief Registers every segment of `stroke` under a single lock, replacing earlier entries.
+     */
+    void insertStroke(const QDrawingStroke &stroke);
+    /**
+     * @brief Registers `stroke` by its inked bounds only.
+     */
+    void insertBounds(quint32 stroke, const QRectF &bounds);
+    void removeStroke(quint32 stroke);
+    void clear();
+
+    QList<quint32> unrefinedIn(const QRectF &area) const;
+
+    QList<quint32> strokesAt(const QPointF &point, qreal tolerance) const;
+    QList<quint32> strokesIn(const QRectF &rect) const;
+    QList<quint32> strokesAlong(const QPolygonF &polyline, qreal tolerance) const;
+    /**
+     * @brief Segments within `tolerance` of the line from `a` to `b`, a stroke may show up more than once.
+     */
+    QVector<Segment> segmentsAlong(const QPointF &a, const QPointF &b, qreal tolerance) const;
+
+private:
+    static quint64 cellKey(int column, int row);
+    void addSegment(quint32 stroke, quint32 index, const QPointF &p1, const QPointF &p2, qreal radius);
+    void removeSegments(quint32 stroke);
+    void collect(const QRectF &area, QVector<const Segment*> &segments) const;
+
+    mutable QReadWriteLock lock;
+    QHash<quint64, QVector<Segment> > cells;
+    QHash<quint32, QRectF> strokeBounds;
+};
+
+/**
+ * @brief Appends accepted input samples to a binary trace file.
+ *
+ * The file starts with a magic number and version followed by fixed-size little endian records:
+ * qint64 ns since recording started, quint32 device id, qint16 pen index, quint8 type and float
+ * x, y and pressure.  Positions are in document mm; version 1 traces held widget pixels and are
+ * not replayed.
+ */
+class TraceRecorder
+{
+public:
+    enum {
+        Magic = 0x54414451, // "QDAT"
+        Version = 2
+    };
+
+    bool open(const QString &fileName, qint64 startTime);
+    void record(const InputSample &sample);
+    void close();
+
+    static void setupStream(QDataStream &stream);
+
+private:
+    QFile file;
+    QDataStream stream;
+    qint64 startTime;
+    QSet<quint32> activeDevices;
+};
+
+/**
+ * @brief Pushes a recorded trace back into the input queue.
+ */
+class TraceReplayer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TraceReplayer(struct QDrawingAreaPrivate *d, QObject *parent = 0);
 
+    bool load(const QString &fileName);
+    void start(bool originalTiming);
+    void stop();
+    bool isActive() const;
+
+signals:
+    void finished();
+
+private slots:
+    void step();
+
+private:
     struct QDrawingAreaPrivate *d;
-    QTimer repaintTimer;
+    QVector<InputSample> records;
+    int position;
+    bool originalTiming;
+    QElapsedTimer clock;
+    QTimer timer;
+};
+
+/**
+ * @brief Append-only log of model changes, written from its own thread.
+ *
+ * Producers encode records while holding the model's writeLock, so the journal follows the same
+ * order as the model.  Records are written in batches with one fsync per batch.  Once the journal
+ * grows past CompactSize the model is saved as a document and the journal starts over.
+ *
+ * The journal starts with its magic, version, the tag of the document it continues and the ids of
+ * that document's strokes.  Each record is a quint32 length followed by a quint8 type and its
+ * fields, little endian.  Point records carry the index of their first point so replaying points
+ * the document already has is harmless.
+ */
+class DrawingJournal : public QObject
+{
+    Q_OBJECT
+public:
+    enum {
+        Magic = 0x4a414451, // "QDAJ"
+        Version = 1,
+        FlushInterval = 1000, // ms
+        FlushSize = 256 * 1024,
+        CompactSize = 32 * 1024 * 1024
+    };
+
+    enum RecordType {
+        Record_Pen = 1,
+        Record_StrokeBegin,
+        Record_Points,
+        Record_StrokeFinish,
+        Record_StrokeRemove,
+        Record_StrokeCurves
+    };
+
+    DrawingJournal(QAbstractDrawingModelPrivate *model, const QString &fileName);
+
+    void moveToThread(QThread *targetThread);
+
+    static QString journalFileName(const QString &fileName);
+    /**
+     * @brief Applies the journal of the document `fileName` to `strokes`, the contents of that document.
+     */
+    static bool replay(const QString &fileName, quint64 tag, QList<QDrawingStroke> *strokes);
+
+    // Called with the model's writeLock held
+    void strokeBegun(const QDrawingStroke &stroke);
+    /**
+     * @brief Records the points of `stroke` added since the last call.
+     */
+    void appendPoints(const QDrawingStroke &stroke);
+    void strokeFinished(const QDrawingStroke &stroke);
+    void strokeRemoved(quint32 id);
+
+public slots:
+    /**
+     * @brief Saves the document and restarts the journal after it.  Takes the writeLock.
+     */
+    bool compact();
+    void flush();
+    /**
+     * @brief Writes out everything recorded so far and stops journaling.
+     */
+    void close();
+
+private:
+    void append(const QByteArray &record);
+    void appendPointRecord(const QDrawingStroke &stroke);
+    static QByteArray penRecord(QDrawingPen *pen, quint32 index);
+
+    QAbstractDrawingModelPrivate *model;
+    QString fileName;
+    QFile file;
+    QTimer timer;
+    qint64 size;
+
+    QMutex lock;                    // Guards the members below
+    QByteArray pending;
+    bool flushRequested;
+    QHash<quint32, int> writtenPoints;  // Open strokes
+    QHash<QDrawingPen*, quint32> pens;  // Never cleared, a new journal starts with all of them
+    QList<QDrawingPen*> penRefs;        // Registered pens, never freed
 };
 
 struct QAbstractDrawingModelPrivate
@@ -84,15 +754,53 @@ struct QAbstractDrawingModelPrivate
     QAbstractDrawingModelPrivate(QAbstractDrawingModel *q);
     ~QAbstractDrawingModelPrivate();
 
-    void generateRandomId();
+    /**
+     * @brief Makes the current state of `strokes` visible to readers.  Callers hold writeLock.
+     */
+    void publish();
+    QDrawingSnapshot snapshot() const;
 
     QAbstractDrawingModel *q_ptr;
 
-//    QMap<quint32, QDrawingStroke> strokeMap;
+    /**
+     * @brief Commits the pending batch of appended strokes, replacing all strokes if `reset` is set.
+     */
+    void commitPending(bool reset = false);
+    /**
+     * @brief Gives bulk loaded strokes in `area` their full spatial index entries.  Called with
+     * writeLock held.
+     */
+    void refineIndex(const QRectF &area);
+    /**
+     * @brief Adds a step to the undo history and drops the redo history.  Called with writeLock held.
+     */
+    void record(HistoryEntry entry);
+    /**
+     * @brief Brings the strokes of `entry` to their state before or after it and publishes the
+     * result.  Called with writeLock held.
+     * @return Ink that changed, in mm.
+     */
+    QRectF applyHistory(const HistoryEntry &entry, bool after);
+    void trimHistory();
+    void clearHistory();
+
     QSizeF documentSize;
 
-    quint32 currentId;
-    QMap<quint32, QDrawingStroke> strokeMap;
+    bool compactStorage;
+    qreal curveTolerance;                    // mm, 0 keeps every sample
+    int batchDepth;
+    QList<QDrawingStroke> pending;           // Appended since beginInsert()
+    mutable QMutex writeLock;                // Held by whoever modifies `strokes`
+    StrokeStore strokes;
+    DrawingJournal *journal;                 // Set while journaling, under writeLock
+    QThread *journalThread;
+    mutable QMutex snapshotLock;             // Only held to exchange the pointer below
+    QSharedPointer<const QDrawingSnapshotData> published;
+    StrokeSpatialIndex spatialIndex;
+    QList<HistoryEntry> undoStack;           // Oldest first, under writeLock
+    QList<HistoryEntry> redoStack;           // Furthest from the current state first
+    qint64 historyUsage;
+    qint64 historyLimit;
 };
 
 struct QDrawingAreaPrivate
@@ -100,21 +808,75 @@ struct QDrawingAreaPrivate
     QDrawingAreaPrivate(QDrawingArea *q);
     ~QDrawingAreaPrivate();
 
-    typedef QPair<QTouchDevice,QTouchEvent::TouchPoint> TouchInfoPair;
+    enum {
+        CachedLevels = 4,   // Scales kept to stand in while a new one renders
+        TouchIdBase = 0x01000000,
+        TouchIdMask = 0x00ffffff,
+        PointerTypes = QTabletEvent::Eraser + 1,
+        ButtonBits = 32
+    };
+
+    void wakeProcessor();
+    bool enqueueSample(const InputSample &sample);
+    /**
+     * @brief Queues `count` samples with a single wakeup, e.g. every contact of a touch event.
+     */
+    bool enqueueSamples(const InputSample *samples, int count);
+    InputSample pointSample(quint32 deviceId, quint16 pen, qreal x, qreal y, qreal pressure) const;
+    InputSample releaseSample(quint32 deviceId) const;
+    void recordSample(const InputSample &sample);
+    /**
+     * @brief Queues the contacts of `event` as one batch, each contact drawing its own stroke.
+     */
+    void touchEvent(QTouchEvent *event);
+
+    /**
+     * @brief Widget position of the document origin, negated.  Whole pixels keep tiles sharp.
+     */
+    QPoint viewOffset() const;
+    /**
+     * @brief Visible area in device pixels of the current scale, grown by `margin` tiles.
+     */
+    QRect viewArea(int margin = 0) const;
+    QPointF mapToDocument(const QPointF &position) const;
+    /**
+     * @brief Widget area covered by `rect` in mm, with room for antialiasing.
+     */
+    QRect mapFromDocument(const QRectF &rect) const;
+    /**
+     * @brief Shows `strokes` over the tiles in place of the last prediction.
+     */
+    void setPrediction(const QVector<OverlayStroke> &strokes);
+
+    typedef QPair<const QTouchDevice*, int> TouchKey;   // Device and touch point id
     QDrawingArea *q_ptr;
 
     int flags;
     int drawingMode;
+    qint64 eventTime;       // Receive time of the event being handled, -1 outside of event()
+    qint64 paintEventTime;  // Oldest input event delivered but not yet painted
+    MetricsCollector metrics;
+    QElapsedTimer clock;
+    TraceRecorder *recorder;
+    TraceReplayer *replayer;
     bool ignoreFakeMouse;
     InputProcessor *processor;
     QThread *processorThread;
     Rasterizer *rasterizer;
     QThread *rasterizerThread;
+    FrameScheduler *scheduler;
     QMap<qint64, quint32> tabletIdMap;
-    QList<QSharedPointer<QDrawingPen> > pens;
+    QVector<quint16> pens;  // PenRegistry ids in the order of QDrawingArea::addPen()
+    int buttonPens[PointerTypes][ButtonBits];   // Index into pens by pointer type and button, -1 if none
     Qt::MouseButtons heldMouseButtons;
-    QPixmap pixmap;
-    QMap<TouchInfoPair, quint32> touchPointMap;
+    QPointF viewOrigin;     // Document position at the top left corner, mm
+    qreal viewScale;        // Device pixels per mm
+    QList<TileLevel> levels;    // Current scale first
+    QVector<OverlayStroke> wet;  // Active strokes, over the tiles
+    QVector<OverlayStroke> prediction;
+    QRect predictionRect;       // Widget area of the prediction
+    QHash<TouchKey, quint32> touchPointMap;    // Active contacts to their device ids
+    quint32 nextTouchId;
     QAbstractDrawingModel *model;
     QAbstractDrawingModelPrivate *model_d;
 };
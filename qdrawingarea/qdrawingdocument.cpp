@@ -0,0 +1,260 @@
+#include "qdrawingdocument_p.h"
+
+#include <QColor>
+#include <QHash>
+#include <QSaveFile>
+
+Q_STATIC_ASSERT(sizeof(DrawingDocument::Header) == 80);
+Q_STATIC_ASSERT(sizeof(DrawingDocument::PenRecord) == 24);
+Q_STATIC_ASSERT(sizeof(DrawingDocument::StrokeRecord) == 32);
+
+quint64 DrawingDocument::align(quint64 offset)
+{
+    return (offset + Alignment - 1) & ~(quint64)(Alignment - 1);
+}
+
+static bool writePadded(QSaveFile &file, const void *data, qint64 size)
+{
+    static const char padding[DrawingDocument::Alignment] = { 0 };
+    qint64 pad = (DrawingDocument::Alignment - size % DrawingDocument::Alignment) % DrawingDocument::Alignment;
+
+    return file.write((const char*)data, size) == size && file.write(padding, pad) == pad;
+}
+
+bool DrawingDocument::write(const QString &fileName, const QSizeF &size, const QDrawingSnapshotData &snapshot, quint64 tag)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    qWarning("DrawingDocument::write: Big endian hosts are not supported");
+    return false;
+#endif
+    const StrokeStore &store = snapshot.strokes;
+    QVector<PenRecord> pens;
+    QVector<StrokeRecord> directory;
+    QHash<QDrawingPen*, quint32> penIndex;
+    QVector<const QDrawingStroke*> strokes;
+    quint64 pointCount = 0;
+
+    directory.reserve(store.count());
+    strokes.reserve(store.count());
+
+    for(int slot = 0; slot < store.slotCount(); slot++)
+    {
+        if(!store.isLive(slot))
+            continue;
+
+        const QDrawingStroke &stroke = store.at(slot);
+        QDrawingPen *pen = stroke.pen();
+
+        if(!penIndex.contains(pen))
+        {
+            PenRecord record = { (quint32)pen->button(), pen->color().rgba(), (float)pen->minWidth(), (float)pen->maxWidth(),
+                                 (float)pen->orientationLock(), (quint32)pen->mode() };
+
+            penIndex.insert(pen, pens.size());
+            pens << record;
+        }
+
+        if(pens.size() > 0x10000)
+        {
+            qWarning("DrawingDocument::write: Too many pens");
+            return false;
+        }
+
+        QRectF bounds = stroke.boundingRect();
+        StrokeRecord record = { (quint16)penIndex.value(pen), (quint16)(stroke.hasCurves() ? Flag_Curves : 0),
+                                (quint32)stroke.size(), pointCount,
+                                (float)bounds.left(), (float)bounds.top(), (float)bounds.right(), (float)bounds.bottom() };
+
+        directory << record;
+        strokes << &stroke;
+        pointCount += stroke.size();
+    }
+
+    Header header;
+
+    header.magic = Magic;
+    header.version = Version;
+    header.headerSize = sizeof(Header);
+    header.width = size.width();
+    header.height = size.height();
+    header.penCount = pens.size();
+    header.strokeCount = directory.size();
+    header.pointCount = pointCount;
+    header.penOffset = align(sizeof(Header));
+    header.directoryOffset = align(header.penOffset + pens.size() * sizeof(PenRecord));
+    header.xOffset = align(header.directoryOffset + directory.size() * sizeof(StrokeRecord));
+    header.yOffset = align(header.xOffset + pointCount * sizeof(float));
+    header.pressureOffset = align(header.yOffset + pointCount * sizeof(float));
+    header.tag = tag;
+
+    QSaveFile file(fileName);
+
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+
+    bool ok = writePadded(file, &header, sizeof(Header)) &&
+            writePadded(file, pens.constData(), pens.size() * sizeof(PenRecord)) &&
+            writePadded(file, directory.constData(), directory.size() * sizeof(StrokeRecord));
+
+    // One pass per point array, each stroke is copied out of its chunks once per pass
+    for(int section = 0; section < 3 && ok; section++)
+    {
+        QByteArray buffer;
+        qint64 written = 0;
+
+        for(int i = 0; i < strokes.size() && ok; i++)
+        {
+            const QDrawingStrokeData *d = strokes[i]->d.constData();
+            int itemSize = section < 2 ? sizeof(float) : sizeof(quint16);
+
+            buffer.resize(d->size * itemSize);
+
+            if(d->size > 0)
+            {
+                d->copyPoints(0, d->size,
+                              section == 0 ? (float*)buffer.data() : 0,
+                              section == 1 ? (float*)buffer.data() : 0,
+                              section == 2 ? (quint16*)buffer.data() : 0);
+            }
+
+            ok = file.write(buffer) == buffer.size();
+            written += buffer.size();
+        }
+
+        int pad = (Alignment - written % Alignment) % Alignment;
+
+        if(ok)
+            ok = file.write(QByteArray(pad, 0)) == pad;
+    }
+
+    if(!ok)
+    {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool DrawingDocument::read(const QString &fileName, QSizeF *size, QList<QDrawingStroke> *strokes, quint64 *tag)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    qWarning("DrawingDocument::read: Big endian hosts are not supported");
+    return false;
+#endif
+    QSharedPointer<DocumentMapping> mapping(new DocumentMapping);
+
+    mapping->file.setFileName(fileName);
+
+    if(!mapping->file.open(QIODevice::ReadOnly))
+        return false;
+
+    quint64 fileSize = mapping->file.size();
+    const uchar *base = mapping->file.map(0, fileSize);
+
+    if(!base)
+    {
+        mapping->contents = mapping->file.readAll();
+        mapping->file.close();
+        base = (const uchar*)mapping->contents.constData();
+    }
+
+    const Header *header = (const Header*)base;
+
+    if(fileSize < sizeof(Header) || header->magic != Magic || header->headerSize < sizeof(Header))
+    {
+        qWarning("DrawingDocument::read: %s is not a drawing document", qPrintable(fileName));
+        return false;
+    }
+
+    if(header->version > Version)
+    {
+        qWarning("DrawingDocument::read: %s was written by a newer version", qPrintable(fileName));
+        return false;
+    }
+
+    quint64 points = header->pointCount;
+
+    if(header->penOffset + (quint64)header->penCount * sizeof(PenRecord) > fileSize ||
+            header->directoryOffset + (quint64)header->strokeCount * sizeof(StrokeRecord) > fileSize ||
+            header->xOffset + points * sizeof(float) > fileSize ||
+            header->yOffset + points * sizeof(float) > fileSize ||
+            header->pressureOffset + points * sizeof(quint16) > fileSize ||
+            (header->penOffset | header->directoryOffset | header->xOffset | header->yOffset | header->pressureOffset) % sizeof(float))
+    {
+        qWarning("DrawingDocument::read: %s is truncated or damaged", qPrintable(fileName));
+        return false;
+    }
+
+    const PenRecord *penRecords = (const PenRecord*)(base + header->penOffset);
+    const StrokeRecord *directory = (const StrokeRecord*)(base + header->directoryOffset);
+    const float *x = (const float*)(base + header->xOffset);
+    const float *y = (const float*)(base + header->yOffset);
+    const quint16 *pressure = (const quint16*)(base + header->pressureOffset);
+    QVector<quint16> pens;
+
+    pens.reserve(header->penCount);
+
+    for(quint32 i = 0; i < header->penCount; i++)
+    {
+        const PenRecord &record = penRecords[i];
+
+        QDrawingPen pen((Qt::MouseButton)record.button, QColor::fromRgba(record.color),
+                        record.minWidth, record.maxWidth, record.orientationLock);
+
+        pen.setMode(record.mode);
+
+        quint16 id = PenRegistry::add(pen);
+
+        if(id == QDrawingPen::InvalidId)
+            return false;
+
+        pens << id;
+    }
+
+    QSharedPointer<QDrawingPointStorage> storage = mapping;
+
+    strokes->reserve(strokes->size() + header->strokeCount);
+
+    for(quint32 i = 0; i < header->strokeCount; i++)
+    {
+        const StrokeRecord &record = directory[i];
+        quint32 pen = record.pen;
+
+        if(pen >= header->penCount || record.firstPoint + record.pointCount > points)
+        {
+            qWarning("DrawingDocument::read: Stroke %u of %s is damaged", i, qPrintable(fileName));
+            return false;
+        }
+
+        QDrawingStroke stroke;
+        QDrawingStrokeData *d = stroke.d.data();
+
+        // Normals are derived on access, the file does not store them
+        d->compact = true;
+        d->pen = pens[pen];
+        d->curves = record.flags & Flag_Curves;
+        d->size = record.pointCount;
+        d->left = record.left;
+        d->top = record.top;
+        d->right = record.right;
+        d->bottom = record.bottom;
+
+        if(record.pointCount > 0)
+        {
+            d->chunks << QExplicitlySharedDataPointer<QDrawingPointChunk>(
+                             new QDrawingPointChunk(x + record.firstPoint, y + record.firstPoint, pressure + record.firstPoint,
+                                                    record.pointCount, storage));
+            d->chunkStart << 0;
+        }
+
+        *strokes << stroke;
+    }
+
+    *size = QSizeF(header->width, header->height);
+
+    if(tag)
+        *tag = header->tag;
+
+    return true;
+}
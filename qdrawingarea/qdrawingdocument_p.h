@@ -0,0 +1,102 @@
+#ifndef QDRAWINGDOCUMENT_P
+#define QDRAWINGDOCUMENT_P
+
+#include <QFile>
+#include <QList>
+#include <QSizeF>
+
+#include "qdrawingstroke_p.h"
+
+/**
+ * @brief Binary drawing document.
+ *
+ * All values are little endian and every section starts on a 16 byte boundary:
+ *
+ *  Header      magic, version, document size in mm, counts, section offsets and journal tag
+ *  Pens        one PenRecord per pen
+ *  Directory   one StrokeRecord per stroke in drawing order, with its bounds and point range
+ *  Points      x of every point, then y, then 16 bit fixed point pressure
+ *
+ * Strokes flagged with Flag_Curves store the control points of cubic Bézier segments instead of
+ * samples.
+ *
+ * Reading maps the file and strokes point straight into the mapping, so opening a document does
+ * not touch any point data.
+ */
+class DrawingDocument
+{
+public:
+    enum {
+        Magic = 0x44414451, // "QDAD"
+        Version = 1,
+        Alignment = 16
+    };
+
+    enum StrokeFlag {
+        Flag_Curves = 0x1
+    };
+
+    struct Header
+    {
+        quint32 magic;
+        quint16 version;
+        quint16 headerSize;
+        float width;            // mm
+        float height;
+        quint32 penCount;
+        quint32 strokeCount;
+        quint64 pointCount;
+        quint64 penOffset;
+        quint64 directoryOffset;
+        quint64 xOffset;
+        quint64 yOffset;
+        quint64 pressureOffset;
+        quint64 tag;            // Identifies the journal that continues this document, 0 if none
+    };
+
+    struct PenRecord
+    {
+        quint32 button;
+        quint32 color;          // QRgb
+        float minWidth;
+        float maxWidth;
+        float orientationLock;  // NaN if unlocked
+        quint32 mode;
+    };
+
+    struct StrokeRecord
+    {
+        quint16 pen;
+        quint16 flags;          // StrokeFlag
+        quint32 pointCount;
+        quint64 firstPoint;
+        float left;             // Bounds of the points, without pen width
+        float top;
+        float right;
+        float bottom;
+    };
+
+    /**
+     * @brief Writes the strokes of `snapshot` to `fileName`, replacing it atomically.
+     */
+    static bool write(const QString &fileName, const QSizeF &size, const QDrawingSnapshotData &snapshot, quint64 tag = 0);
+    /**
+     * @brief Reads the document in `fileName`.  Strokes keep the file mapped until they are all gone.
+     */
+    static bool read(const QString &fileName, QSizeF *size, QList<QDrawingStroke> *strokes, quint64 *tag = 0);
+
+private:
+    static quint64 align(quint64 offset);
+};
+
+/**
+ * @brief Keeps a document mapped, or its contents in memory where mapping is not available.
+ */
+class DocumentMapping : public QDrawingPointStorage
+{
+public:
+    QFile file;
+    QByteArray contents;
+};
+
+#endif // QDRAWINGDOCUMENT_P
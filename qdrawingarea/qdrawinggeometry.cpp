@@ -0,0 +1,485 @@
+#include "qdrawinggeometry_p.h"
+#include "qdrawingarea.h"
+#include "qdrawingstroke_p.h"
+
+#include <QLineF>
+#include <QTransform>
+#include <QtMath>
+
+#include <limits>
+
+static const qreal DefaultFlatness = 0.01; // mm
+
+static inline qreal vectorAngle(const QPointF &v)
+{
+    // QPainterPath angles run counter-clockwise on screen
+    return qRadiansToDegrees(qAtan2(-v.y(), v.x()));
+}
+
+QSharedPointer<const StrokeLevels> StrokeLevels::build(const QDrawingStroke &stroke)
+{
+    QDrawingPen *pen = stroke.pen();
+    int count = stroke.size();
+
+    if(!pen || count < MinPoints)
+        return QSharedPointer<const StrokeLevels>();
+
+    QVector<float> x(count), y(count), w(count), importance(count);
+    QVector<quint16> pressure(count);
+
+    stroke.d->copyPoints(0, count, x.data(), y.data(), pressure.data());
+
+    for(int i = 0; i < count; i++)
+        w[i] = pen->calcWidth(pressure[i] / 65535.0);
+
+    // Every point gets the largest error at which it is still kept.  The simplification always
+    // splits at the farthest point whatever the error, so a single pass serves every level.
+    struct Range
+    {
+        int first;
+        int last;
+        float limit;    // Error of the enclosing split
+    };
+
+    QVector<Range> stack;
+    Range all = { 0, count - 1, std::numeric_limits<float>::max() };
+
+    importance[0] = importance[count - 1] = all.limit;
+    stack << all;
+
+    while(!stack.isEmpty())
+    {
+        Range range = stack.takeLast();
+
+        if(range.last - range.first < 2)
+            continue;
+
+        int f = range.first, l = range.last;
+        float dx = x[l] - x[f], dy = y[l] - y[f], dw = w[l] - w[f];
+        float length = dx * dx + dy * dy + dw * dw;
+        float distance = -1;
+        int farthest = f + 1;
+
+        for(int i = f + 1; i < l; i++)
+        {
+            float px = x[i] - x[f], py = y[i] - y[f], pw = w[i] - w[f];
+            float t = length > 0 ? qBound(0.0f, (px * dx + py * dy + pw * dw) / length, 1.0f) : 0.0f;
+            float ex = px - t * dx, ey = py - t * dy, ew = pw - t * dw;
+            float e = ex * ex + ey * ey + ew * ew;
+
+            if(e > distance)
+            {
+                distance = e;
+                farthest = i;
+            }
+        }
+
+        // A point never outlives the split that produced it
+        float error = qMin<float>(qSqrt(distance), range.limit);
+        Range before = { f, farthest, error };
+        Range after = { farthest, l, error };
+
+        importance[farthest] = error;
+        stack << before << after;
+    }
+
+    QSharedPointer<StrokeLevels> result(new StrokeLevels);
+    int previous = count;
+
+    // Errors from an eighth of a mm up, in mm like the points
+    for(float error = 0.125f; error <= 64; error *= 2)
+    {
+        int kept = 0;
+
+        for(int i = 0; i < count; i++)
+            kept += importance[i] > error;
+
+        // A level has to drop a quarter of the points to be worth its memory
+        if(kept * 4 > previous * 3)
+            continue;
+
+        Level level;
+
+        level.error = error;
+        level.x.reserve(kept);
+        level.y.reserve(kept);
+        level.pressure.reserve(kept);
+
+        for(int i = 0; i < count; i++)
+        {
+            if(importance[i] > error)
+            {
+                level.x << x[i];
+                level.y << y[i];
+                level.pressure << pressure[i];
+            }
+        }
+
+        result->levels << level;
+        previous = kept;
+
+        if(kept <= 2)
+            break;
+    }
+
+    if(result->levels.isEmpty())
+        return QSharedPointer<const StrokeLevels>();
+
+    return result;
+}
+
+const StrokeLevels::Level *StrokeLevels::level(qreal tolerance) const
+{
+    for(int i = levels.size() - 1; i >= 0; i--)
+    {
+        if(levels[i].error <= tolerance)
+            return &levels[i];
+    }
+
+    return 0;
+}
+
+qint64 StrokeLevels::memoryUsage() const
+{
+    qint64 usage = sizeof(StrokeLevels);
+
+    for(int i = 0; i < levels.size(); i++)
+        usage += sizeof(Level) + levels[i].x.size() * (2 * sizeof(float) + sizeof(quint16));
+
+    return usage;
+}
+
+CurveFitter::CurveFitter() :
+    tolerance(0),
+    widthRange(0)
+{
+}
+
+CurveFitter::CurveFitter(qreal tolerance, qreal widthRange) :
+    tolerance(tolerance),
+    widthRange(qAbs(widthRange))
+{
+}
+
+void CurveFitter::add(float sx, float sy, float sp)
+{
+    Sample sample = { sx, sy, sp };
+
+    if(window.isEmpty())
+    {
+        x << sx;
+        y << sy;
+        pressure << sp;
+        window << sample;
+        return;
+    }
+
+    // Repeated samples carry no direction
+    if(window.last().x == sx && window.last().y == sy)
+        return;
+
+    window << sample;
+
+    Segment segment = fit();
+
+    if(window.size() > 2 && segment.error > tolerance)
+    {
+        // Everything up to the previous sample was the longest span that held
+        commit(candidate, window.size() - 2);
+        window.remove(0, window.size() - 2);
+        segment = fit();
+    }
+
+    candidate = segment;
+
+    if(window.size() >= MaxSpan)
+    {
+        commit(candidate, window.size() - 1);
+        window.remove(0, window.size() - 1);
+    }
+}
+
+void CurveFitter::finish()
+{
+    if(window.size() > 1)
+        commit(candidate, window.size() - 1);
+
+    window.clear();
+}
+
+CurveFitter::Segment CurveFitter::fit() const
+{
+    int n = window.size();
+    const Sample &first = window[0], &last = window[n - 1];
+    QPointF p0(first.x, first.y), p3(last.x, last.y);
+    QVector<qreal> u(n);
+
+    // Chord length parameters
+    u[0] = 0;
+
+    for(int i = 1; i < n; i++)
+        u[i] = u[i - 1] + QLineF(window[i - 1].x, window[i - 1].y, window[i].x, window[i].y).length();
+
+    qreal length = u[n - 1];
+
+    for(int i = 1; i < n; i++)
+        u[i] /= length;
+
+    QPointF chord = QPointF(window[1].x, window[1].y) - p0;
+    QPointF t1 = chord / qSqrt(QPointF::dotProduct(chord, chord));
+    QPointF back = QPointF(window[n - 2].x, window[n - 2].y) - p3;
+    QPointF t2 = back / qSqrt(QPointF::dotProduct(back, back));
+
+    // Keep the tangent of the previous segment unless this is a corner
+    if(!startTangent.isNull() && QPointF::dotProduct(startTangent, t1) > 0.5)
+        t1 = startTangent;
+
+    // Least squares for the distances of the inner control points along the tangents
+    qreal c11 = 0, c12 = 0, c22 = 0, x1 = 0, x2 = 0;
+    qreal q11 = 0, q12 = 0, q22 = 0, r1 = 0, r2 = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        qreal t = u[i], mt = 1 - t;
+        qreal b0 = mt * mt * mt, b1 = 3 * mt * mt * t, b2 = 3 * mt * t * t, b3 = t * t * t;
+        QPointF a1 = t1 * b1, a2 = t2 * b2;
+        QPointF rest = QPointF(window[i].x, window[i].y) - (p0 * (b0 + b1) + p3 * (b2 + b3));
+        qreal pressureRest = window[i].pressure - (first.pressure * b0 + last.pressure * b3);
+
+        c11 += QPointF::dotProduct(a1, a1);
+        c12 += QPointF::dotProduct(a1, a2);
+        c22 += QPointF::dotProduct(a2, a2);
+        x1 += QPointF::dotProduct(a1, rest);
+        x2 += QPointF::dotProduct(a2, rest);
+
+        q11 += b1 * b1;
+        q12 += b1 * b2;
+        q22 += b2 * b2;
+        r1 += b1 * pressureRest;
+        r2 += b2 * pressureRest;
+    }
+
+    qreal det = c11 * c22 - c12 * c12;
+    qreal alpha1 = det != 0 ? (x1 * c22 - x2 * c12) / det : 0;
+    qreal alpha2 = det != 0 ? (c11 * x2 - c12 * x1) / det : 0;
+    qreal distance = QLineF(p0, p3).length();
+
+    // Too few samples to tell, or a fit that would loop back on itself
+    if(alpha1 < 1e-3 * distance || alpha2 < 1e-3 * distance || alpha1 > length || alpha2 > length)
+        alpha1 = alpha2 = distance / 3;
+
+    Segment segment;
+
+    segment.c1 = p0 + t1 * alpha1;
+    segment.c2 = p3 + t2 * alpha2;
+
+    det = q11 * q22 - q12 * q12;
+
+    if(qAbs(det) > 1e-9)
+    {
+        segment.p1 = qBound<qreal>(0, (r1 * q22 - r2 * q12) / det, 1);
+        segment.p2 = qBound<qreal>(0, (q11 * r2 - q12 * r1) / det, 1);
+    }
+    else
+    {
+        segment.p1 = first.pressure + (last.pressure - first.pressure) / 3;
+        segment.p2 = first.pressure + (last.pressure - first.pressure) * 2 / 3;
+    }
+
+    segment.error = 0;
+
+    for(int i = 1; i < n - 1; i++)
+    {
+        qreal t = u[i], mt = 1 - t;
+        qreal b0 = mt * mt * mt, b1 = 3 * mt * mt * t, b2 = 3 * mt * t * t, b3 = t * t * t;
+        QPointF point = p0 * b0 + segment.c1 * b1 + segment.c2 * b2 + p3 * b3;
+        qreal p = first.pressure * b0 + segment.p1 * b1 + segment.p2 * b2 + last.pressure * b3;
+
+        segment.error = qMax(segment.error, QLineF(point, QPointF(window[i].x, window[i].y)).length());
+        segment.error = qMax(segment.error, qAbs(p - window[i].pressure) * widthRange);
+    }
+
+    return segment;
+}
+
+void CurveFitter::commit(const Segment &segment, int end)
+{
+    QPointF p3(window[end].x, window[end].y);
+    QPointF tangent = p3 - segment.c2;
+    qreal length = qSqrt(QPointF::dotProduct(tangent, tangent));
+
+    x << segment.c1.x() << segment.c2.x() << p3.x();
+    y << segment.c1.y() << segment.c2.y() << p3.y();
+    pressure << segment.p1 << segment.p2 << window[end].pressure;
+
+    startTangent = length > 0 ? tangent / length : QPointF();
+}
+
+void CurveFitter::flatten(const float *x, const float *y, const quint16 *pressure, int count, qreal tolerance,
+                          QVector<float> &flatX, QVector<float> &flatY, QVector<quint16> &flatPressure)
+{
+    if(count <= 0)
+        return;
+
+    flatX << x[0];
+    flatY << y[0];
+    flatPressure << pressure[0];
+
+    for(int s = 0; s + 3 < count; s += 3)
+    {
+        // Uniform steps stay within tolerance of a cubic with this bound on its second derivative
+        qreal dx1 = x[s] - 2 * x[s + 1] + x[s + 2], dy1 = y[s] - 2 * y[s + 1] + y[s + 2];
+        qreal dx2 = x[s + 1] - 2 * x[s + 2] + x[s + 3], dy2 = y[s + 1] - 2 * y[s + 2] + y[s + 3];
+        qreal bend = 6 * qSqrt(qMax(dx1 * dx1 + dy1 * dy1, dx2 * dx2 + dy2 * dy2));
+        int steps = qBound(1, qCeil(qSqrt(bend / (8 * tolerance))), (int)MaxFlattenSteps);
+
+        for(int i = 1; i <= steps; i++)
+        {
+            qreal t = (qreal)i / steps, mt = 1 - t;
+            qreal b0 = mt * mt * mt, b1 = 3 * mt * mt * t, b2 = 3 * mt * t * t, b3 = t * t * t;
+
+            flatX << b0 * x[s] + b1 * x[s + 1] + b2 * x[s + 2] + b3 * x[s + 3];
+            flatY << b0 * y[s] + b1 * y[s + 1] + b2 * y[s + 2] + b3 * y[s + 3];
+            flatPressure << qRound(b0 * pressure[s] + b1 * pressure[s + 1] + b2 * pressure[s + 2] + b3 * pressure[s + 3]);
+        }
+    }
+}
+
+QPainterPath StrokeTessellator::outline(const QDrawingStroke &stroke, QDrawingPen *pen, int from, int to, qreal tolerance)
+{
+    int total = to - from + 1;
+
+    if(total <= 0)
+    {
+        QPainterPath path;
+
+        path.setFillRule(Qt::WindingFill);
+        return path;
+    }
+
+    // Whole segments, the curves between control points are only known together
+    if(stroke.d->curves)
+    {
+        int first = from - from % 3;
+        int last = qMin(to + (3 - to % 3) % 3, (int)stroke.size() - 1);
+        int count = last - first + 1;
+        QVector<float> cx(count), cy(count), x, y;
+        QVector<quint16> cp(count), pressure;
+
+        stroke.d->copyPoints(first, count, cx.data(), cy.data(), cp.data());
+        CurveFitter::flatten(cx.constData(), cy.constData(), cp.constData(), count,
+                             tolerance > 0 ? tolerance : DefaultFlatness, x, y, pressure);
+
+        return outline(x.data(), y.data(), pressure.data(), x.size(), pen);
+    }
+
+    const StrokeLevels::Level *level = 0;
+
+    if(tolerance > 0 && from == 0 && to == (int)stroke.size() - 1 && stroke.d->levels)
+        level = stroke.d->levels->level(tolerance);
+
+    if(level)
+    {
+        QVector<float> x = level->x, y = level->y;
+        QVector<quint16> pressure = level->pressure;
+
+        return outline(x.data(), y.data(), pressure.data(), x.size(), pen);
+    }
+
+    QVector<float> x(total), y(total);
+    QVector<quint16> pressure(total);
+
+    stroke.d->copyPoints(from, total, x.data(), y.data(), pressure.data());
+
+    return outline(x.data(), y.data(), pressure.data(), total, pen);
+}
+
+QPainterPath StrokeTessellator::outline(float *x, float *y, quint16 *pressure, int total, QDrawingPen *pen)
+{
+    QPainterPath path;
+    int count = 0;
+
+    path.setFillRule(Qt::WindingFill);
+
+    // Repeated samples carry no direction
+    for(int i = 0; i < total; i++)
+    {
+        if(count == 0 || x[count - 1] != x[i] || y[count - 1] != y[i])
+        {
+            x[count] = x[i];
+            y[count] = y[i];
+            pressure[count] = pressure[i];
+            count++;
+        }
+        else
+        {
+            pressure[count - 1] = qMax(pressure[count - 1], pressure[i]);
+        }
+    }
+
+    if(count == 1)
+    {
+        qreal w = pen->calcWidth(pressure[0] / 65535.0);
+
+        path.addEllipse(QPointF(x[0], y[0]), w, w);
+        return path;
+    }
+
+    QVector<float> leftX(count), leftY(count), rightX(count), rightY(count);
+    bool locked = pen->isOrientationLocked();
+
+    if(locked)
+    {
+        QTransform trans;
+
+        trans.rotate(pen->orientationLock());
+        QPointF normal = trans.map(QPointF(0, -1));
+
+        for(int i = 0; i < count; i++)
+        {
+            QPointF offset = pen->calcWidth(pressure[i] / 65535.0) * normal;
+
+            leftX[i] = x[i] + offset.x();
+            leftY[i] = y[i] + offset.y();
+            rightX[i] = x[i] - offset.x();
+            rightY[i] = y[i] - offset.y();
+        }
+    }
+    else
+    {
+        StrokeKernel::offsets(x.constData(), y.constData(), pressure.constData(), count,
+                              pen->minWidth(), pen->maxWidth(),
+                              leftX.data(), leftY.data(), rightX.data(), rightY.data());
+    }
+
+    path.moveTo(leftX[0], leftY[0]);
+
+    for(int i = 1; i < count; i++)
+        path.lineTo(leftX[i], leftY[i]);
+
+    if(!locked)
+    {
+        QPointF center(x[count - 1], y[count - 1]);
+        QPointF offset = QPointF(leftX[count - 1], leftY[count - 1]) - center;
+        qreal w = qSqrt(QPointF::dotProduct(offset, offset));
+
+        path.arcTo(QRectF(center - QPointF(w, w), QSizeF(2 * w, 2 * w)), vectorAngle(offset), 180);
+    }
+
+    // Chisel tips have flat ends
+    for(int i = count - 1; i >= 0; i--)
+        path.lineTo(rightX[i], rightY[i]);
+
+    if(!locked)
+    {
+        QPointF center(x[0], y[0]);
+        QPointF offset = QPointF(rightX[0], rightY[0]) - center;
+        qreal w = qSqrt(QPointF::dotProduct(offset, offset));
+
+        path.arcTo(QRectF(center - QPointF(w, w), QSizeF(2 * w, 2 * w)), vectorAngle(offset), 180);
+    }
+
+    path.closeSubpath();
+
+    return path;
+}
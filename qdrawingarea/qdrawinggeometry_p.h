@@ -0,0 +1,185 @@
+#ifndef QDRAWINGGEOMETRY_P
+#define QDRAWINGGEOMETRY_P
+
+#include <QByteArray>
+#include <QList>
+#include <QPainterPath>
+#include <QSharedPointer>
+#include <QVector>
+
+class QDrawingPen;
+class QDrawingStroke;
+
+/**
+ * @brief Vectorized geometry for runs of stroke samples.
+ *
+ * Uses AVX2 or SSE2 when the CPU supports it and falls back to scalar code otherwise.  The choice
+ * is made once at runtime; setting QDRAWINGAREA_NO_SIMD=1 forces the scalar implementation and tests
+ * can switch between them with setImplementation().
+ */
+class StrokeKernel
+{
+public:
+    /**
+     * @brief Left and right offset points for `count` samples in one pass.
+     *
+     * Each point is pushed out along the normal averaged from its adjacent segments by the width
+     * for its pressure, lerped between `minWidth` and `maxWidth`.  Pressure is 16 bit fixed point.
+     */
+    static void offsets(const float *x, const float *y, const quint16 *pressure, int count,
+                        float minWidth, float maxWidth,
+                        float *leftX, float *leftY, float *rightX, float *rightY);
+    /**
+     * @brief Point normals as stored by QDrawingStroke: the first point faces up, every other
+     * point is perpendicular to the segment arriving at it.
+     */
+    static void normals(const float *x, const float *y, int count, float *nx, float *ny);
+    static const char *implementation();
+    /**
+     * @brief Implementations the CPU can run, starting with the scalar reference.
+     */
+    static QList<QByteArray> implementations();
+    /**
+     * @brief Switches to `name` from implementations(), to check them against each other.  Only
+     * safe while nothing is drawing.
+     */
+    static bool setImplementation(const QByteArray &name);
+};
+
+/**
+ * @brief Simplified copies of a finished stroke for drawing it zoomed out.
+ *
+ * Each level is the Ramer-Douglas-Peucker simplification of the stroke for twice the error of the
+ * one before.  Distances are measured over position and pen width together, so an outline drawn
+ * from a level stays within the level's error of the full outline.
+ */
+class StrokeLevels
+{
+public:
+    enum {
+        MinPoints = 16  // Shorter strokes are always drawn in full
+    };
+
+    struct Level
+    {
+        float error;
+        QVector<float> x;
+        QVector<float> y;
+        QVector<quint16> pressure;
+    };
+
+    /**
+     * @brief Levels of `stroke`, or null if none would save enough points to be worth keeping.
+     */
+    static QSharedPointer<const StrokeLevels> build(const QDrawingStroke &stroke);
+
+    /**
+     * @brief Coarsest level whose error is within `tolerance`, or null if the full stroke is needed.
+     */
+    const Level *level(qreal tolerance) const;
+    qint64 memoryUsage() const;
+
+    QVector<Level> levels;  // Finest first
+};
+
+/**
+ * @brief Fits piecewise cubic Béziers to a stream of samples, one sample at a time.
+ *
+ * A segment is fitted by least squares over at most MaxSpan samples, with its end points on
+ * samples, so the cost per sample stays bounded however long the stroke gets.  Segments join with
+ * continuous tangents except at corners.  Pressure is fitted along with the position and its error
+ * counted as the change in pen width.
+ *
+ * Control points are laid out like the points of a fitted QDrawingStroke: the first sample, then
+ * three points per segment, the last of which starts the next segment.
+ */
+class CurveFitter
+{
+public:
+    enum {
+        MaxSpan = 32,           // Samples per segment
+        MaxFlattenSteps = 64    // Points per segment when flattening
+    };
+
+    CurveFitter();
+    /**
+     * @param tolerance Largest distance of a sample from the curve, in mm.
+     * @param widthRange Width the pen gains from no to full pressure, in mm.
+     */
+    CurveFitter(qreal tolerance, qreal widthRange);
+
+    void add(float x, float y, float pressure);
+    /**
+     * @brief Ends the curve at the last sample.
+     */
+    void finish();
+
+    int size() const { return x.size(); }
+
+    QVector<float> x;   // Control points
+    QVector<float> y;
+    QVector<float> pressure;
+
+    /**
+     * @brief Points along the curves of `count` control points, within `tolerance` of them.
+     */
+    static void flatten(const float *x, const float *y, const quint16 *pressure, int count, qreal tolerance,
+                        QVector<float> &flatX, QVector<float> &flatY, QVector<quint16> &flatPressure);
+
+private:
+    struct Sample
+    {
+        float x;
+        float y;
+        float pressure;
+    };
+
+    struct Segment
+    {
+        QPointF c1;
+        QPointF c2;
+        float p1;
+        float p2;
+        qreal error;
+    };
+
+    /**
+     * @brief Best segment over all of `window`.
+     */
+    Segment fit() const;
+    void commit(const Segment &segment, int end);
+
+    qreal tolerance;
+    qreal widthRange;
+    QVector<Sample> window;     // Samples of the segment being fitted, from its start point on
+    Segment candidate;          // Fit over `window`
+    QPointF startTangent;       // Direction the next segment leaves in, null before the first
+};
+
+/**
+ * @brief Turns stroke points into a single fillable outline.
+ *
+ * The outline follows the left offset curve, wraps around the end cap, returns along the right
+ * offset curve and closes with the start cap.  It is filled with Qt::WindingFill so overlapping
+ * parts of a stroke are only covered once, which keeps translucent pens free of seams.
+ */
+class StrokeTessellator
+{
+public:
+    /**
+     * @brief Outline of the points from `from` to `to` inclusive.
+     *
+     * Whole strokes are drawn from their coarsest level of detail within `tolerance`, in mm.  Zero
+     * always uses every point.  Fitted strokes are flattened to within `tolerance`, or finely at
+     * zero, and drawn by whole segments.
+     */
+    static QPainterPath outline(const QDrawingStroke &stroke, QDrawingPen *pen, int from, int to, qreal tolerance = 0);
+
+private:
+    /**
+     * @brief Outline of `total` points.  Drops repeated points from the arrays in place.
+     */
+    static QPainterPath outline(float *x, float *y, quint16 *pressure, int total, QDrawingPen *pen);
+};
+
+#endif // QDRAWINGGEOMETRY_P
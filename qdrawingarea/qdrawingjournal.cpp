@@ -0,0 +1,507 @@
+#include "qdrawingarea.h"
+#include "qdrawingarea_p.h"
+#include "qdrawingdocument_p.h"
+
+#include <QColor>
+#include <QDateTime>
+#include <QtEndian>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+ * Journal layout, little endian:
+ *
+ *  Header      magic, version, tag of the document it continues, count and ids of its strokes
+ *  Records     quint32 length, then a record of that length, starting with its RecordType
+ *
+ * Pen indices and stroke ids refer to the journal and the document it continues.  Records are
+ * idempotent against that document, so points it already holds are skipped on replay.  Strokes
+ * fitted with curves replace their points with a Record_StrokeCurves when they are finished.
+ * Record_StrokeBegin ends with the id of the stroke drawn right below, -1 for the bottom.
+ */
+
+static void syncFile(QFile &file)
+{
+    file.flush();
+#ifdef Q_OS_WIN
+    _commit(file.handle());
+#else
+    fsync(file.handle());
+#endif
+}
+
+DrawingJournal::DrawingJournal(QAbstractDrawingModelPrivate *model, const QString &fileName) :
+    model(model),
+    fileName(fileName),
+    size(0),
+    flushRequested(false)
+{
+    timer.setInterval(FlushInterval);
+    connect(&timer, &QTimer::timeout, this, &DrawingJournal::flush);
+}
+
+void DrawingJournal::moveToThread(QThread *targetThread)
+{
+    QObject::moveToThread(targetThread);
+    timer.moveToThread(targetThread);
+}
+
+QString DrawingJournal::journalFileName(const QString &fileName)
+{
+    return fileName + ".journal";
+}
+
+QByteArray DrawingJournal::penRecord(QDrawingPen *pen, quint32 index)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    TraceRecorder::setupStream(stream);
+    stream << (quint8)Record_Pen << index << (quint32)pen->button() << (quint32)pen->color().rgba()
+           << (float)pen->minWidth() << (float)pen->maxWidth() << (float)pen->orientationLock() << (qint32)pen->mode();
+
+    return record;
+}
+
+void DrawingJournal::append(const QByteArray &record)
+{
+    quint32 length = qToLittleEndian<quint32>(record.size());
+
+    pending.append((const char*)&length, sizeof(length));
+    pending.append(record);
+
+    // Large batches are written early, everything else waits for the timer to coalesce syncs
+    if(pending.size() >= FlushSize && !flushRequested)
+    {
+        flushRequested = true;
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+    }
+}
+
+void DrawingJournal::strokeBegun(const QDrawingStroke &stroke)
+{
+    QMutexLocker locker(&lock);
+    QDrawingPen *pen = stroke.pen();
+    QHash<QDrawingPen*, quint32>::const_iterator known = pens.constFind(pen);
+    quint32 penIndex;
+
+    if(known == pens.constEnd())
+    {
+        penIndex = pens.size();
+        pens.insert(pen, penIndex);
+        penRefs << pen;
+        append(penRecord(pen, penIndex));
+    }
+    else
+    {
+        penIndex = known.value();
+    }
+
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    TraceRecorder::setupStream(stream);
+    stream << (quint8)Record_StrokeBegin << stroke.id() << penIndex << model->strokes.below(stroke.id());
+
+    append(record);
+    writtenPoints.insert(stroke.id(), 0);
+}
+
+void DrawingJournal::appendPointRecord(const QDrawingStroke &stroke)
+{
+    // Strokes begun before journaling started are written from their first point, replay skips
+    // what the document already has
+    int from = writtenPoints.value(stroke.id(), 0);
+    int count = stroke.d->size - from;
+
+    if(count <= 0)
+        return;
+
+    QVector<float> x(count);
+    QVector<float> y(count);
+    QVector<quint16> pressure(count);
+
+    stroke.d->copyPoints(from, count, x.data(), y.data(), pressure.data());
+
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    record.reserve(16 + count * 10);
+    TraceRecorder::setupStream(stream);
+    stream << (quint8)Record_Points << stroke.id() << (quint32)from << (quint32)count;
+
+    for(int i = 0; i < count; i++)
+        stream << x[i];
+    for(int i = 0; i < count; i++)
+        stream << y[i];
+    for(int i = 0; i < count; i++)
+        stream << pressure[i];
+
+    append(record);
+    writtenPoints.insert(stroke.id(), stroke.d->size);
+}
+
+void DrawingJournal::appendPoints(const QDrawingStroke &stroke)
+{
+    QMutexLocker locker(&lock);
+
+    appendPointRecord(stroke);
+}
+
+void DrawingJournal::strokeFinished(const QDrawingStroke &stroke)
+{
+    QMutexLocker locker(&lock);
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    TraceRecorder::setupStream(stream);
+
+    if(stroke.hasCurves())
+    {
+        int count = stroke.d->size;
+        QVector<float> x(count);
+        QVector<float> y(count);
+        QVector<quint16> pressure(count);
+
+        stroke.d->copyPoints(0, count, x.data(), y.data(), pressure.data());
+
+        QByteArray curves;
+        QDataStream curveStream(&curves, QIODevice::WriteOnly);
+
+        curves.reserve(16 + count * 10);
+        TraceRecorder::setupStream(curveStream);
+        curveStream << (quint8)Record_StrokeCurves << stroke.id() << (quint32)count;
+
+        for(int i = 0; i < count; i++)
+            curveStream << x[i];
+        for(int i = 0; i < count; i++)
+            curveStream << y[i];
+        for(int i = 0; i < count; i++)
+            curveStream << pressure[i];
+
+        append(curves);
+    }
+    else
+    {
+        appendPointRecord(stroke);
+    }
+
+    stream << (quint8)Record_StrokeFinish << stroke.id();
+
+    append(record);
+    writtenPoints.remove(stroke.id());
+}
+
+void DrawingJournal::strokeRemoved(quint32 id)
+{
+    QMutexLocker locker(&lock);
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+
+    TraceRecorder::setupStream(stream);
+    stream << (quint8)Record_StrokeRemove << id;
+
+    append(record);
+    writtenPoints.remove(id);
+}
+
+void DrawingJournal::flush()
+{
+    QByteArray batch;
+
+    if(!file.isOpen())
+        return;
+
+    lock.lock();
+    batch.swap(pending);
+    flushRequested = false;
+    lock.unlock();
+
+    if(batch.isEmpty())
+        return;
+
+    // One sync per batch, however many records it holds
+    if(file.write(batch) != batch.size())
+        qWarning("DrawingJournal::flush: Could not write to %s", qPrintable(file.fileName()));
+
+    syncFile(file);
+    size += batch.size();
+
+    if(size > CompactSize)
+        compact();
+}
+
+bool DrawingJournal::compact()
+{
+    QDrawingSnapshot snapshot;
+    QList<QDrawingPen*> penTable;
+    int covered;
+
+    model->writeLock.lock();
+    model->publish();
+    snapshot = model->snapshot();
+    lock.lock();
+    covered = pending.size();   // Everything recorded so far is part of the snapshot
+    penTable = penRefs;
+    lock.unlock();
+    model->writeLock.unlock();
+
+    quint64 tag = ((quint64)qrand() << 32 | (quint32)qrand()) ^ (quint64)QDateTime::currentMSecsSinceEpoch();
+
+    if(!tag)
+        tag = 1;
+
+    // Until the document is replaced the old journal still continues the old one
+    if(!DrawingDocument::write(fileName, model->documentSize, *snapshot.d, tag))
+    {
+        qWarning("DrawingJournal::compact: Could not save %s", qPrintable(fileName));
+        return false;
+    }
+
+    lock.lock();
+    pending.remove(0, covered);
+    lock.unlock();
+
+    file.close();
+    file.setFileName(journalFileName(fileName));
+
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qWarning("DrawingJournal::compact: Could not open %s", qPrintable(file.fileName()));
+        return false;
+    }
+
+    QList<quint32> ids = snapshot.strokeIds();
+    QByteArray header;
+    QDataStream stream(&header, QIODevice::WriteOnly);
+
+    TraceRecorder::setupStream(stream);
+    stream << (quint32)Magic << (quint16)Version << tag << (quint32)ids.size();
+
+    foreach(quint32 id, ids)
+        stream << id;
+
+    // Records still pending may use any pen recorded so far
+    for(int i = 0; i < penTable.size(); i++)
+    {
+        QByteArray record = penRecord(penTable[i], i);
+
+        stream << (quint32)record.size();
+        stream.writeRawData(record.constData(), record.size());
+    }
+
+    if(file.write(header) != header.size())
+    {
+        qWarning("DrawingJournal::compact: Could not write to %s", qPrintable(file.fileName()));
+        file.close();
+        return false;
+    }
+
+    syncFile(file);
+    size = header.size();
+
+    if(!timer.isActive())
+        timer.start();
+
+    return true;
+}
+
+void DrawingJournal::close()
+{
+    timer.stop();
+    flush();
+    file.close();
+}
+
+bool DrawingJournal::replay(const QString &fileName, quint64 tag, QList<QDrawingStroke> *strokes)
+{
+    QFile file(journalFileName(fileName));
+
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    quint32 magic;
+    quint16 version;
+    quint64 journalTag;
+    quint32 idCount;
+
+    TraceRecorder::setupStream(stream);
+    stream >> magic >> version >> journalTag >> idCount;
+
+    // A journal left over from an older save of the document no longer applies
+    if(stream.status() != QDataStream::Ok || magic != Magic || version > Version || journalTag != tag ||
+            idCount != (quint32)strokes->size())
+    {
+        qWarning("DrawingJournal::replay: %s does not continue %s", qPrintable(file.fileName()), qPrintable(fileName));
+        return false;
+    }
+
+    QHash<quint32, int> index;
+    QList<quint32> order;   // Drawing order of the strokes that exist
+    QVector<quint16> pens;
+
+    for(quint32 i = 0; i < idCount; i++)
+    {
+        quint32 id;
+
+        stream >> id;
+        index.insert(id, i);
+        order << id;
+    }
+
+    forever
+    {
+        quint32 length;
+
+        stream >> length;
+
+        if(stream.status() != QDataStream::Ok || length > (quint64)(file.size() - file.pos()))
+            break;
+
+        QByteArray data(length, Qt::Uninitialized);
+
+        // The last record may be torn by a crash
+        if(stream.readRawData(data.data(), length) != (int)length)
+            break;
+
+        QDataStream record(data);
+        quint8 type;
+
+        TraceRecorder::setupStream(record);
+        record >> type;
+
+        if(type == Record_Pen)
+        {
+            quint32 penIndex, button, color;
+            float minWidth, maxWidth, orientationLock;
+            qint32 mode;
+
+            record >> penIndex >> button >> color >> minWidth >> maxWidth >> orientationLock >> mode;
+
+            if(record.status() != QDataStream::Ok || penIndex > QDrawingPen::InvalidId)
+                continue;
+
+            while((quint32)pens.size() <= penIndex)
+                pens << QDrawingPen::InvalidId;
+
+            QDrawingPen pen((Qt::MouseButton)button, QColor::fromRgba(color), minWidth, maxWidth, orientationLock);
+
+            pen.setMode(mode);
+            pens[penIndex] = PenRegistry::add(pen);
+        }
+        else if(type == Record_StrokeBegin)
+        {
+            quint32 id, penIndex, below;
+            int position = order.size();
+
+            record >> id >> penIndex >> below;
+
+            // Usually the stroke on top, so searched from the top
+            int at = order.lastIndexOf(below);
+
+            if(below == (quint32)-1)
+                position = 0;
+            else if(at >= 0)
+                position = at + 1;
+
+            if(record.status() == QDataStream::Ok && !index.contains(id) && penIndex < (quint32)pens.size() &&
+                    pens[penIndex] != QDrawingPen::InvalidId)
+            {
+                QDrawingStroke stroke;
+
+                stroke.d->pen = pens[penIndex];
+                index.insert(id, strokes->size());
+                order.insert(position, id);
+                *strokes << stroke;
+            }
+        }
+        else if(type == Record_Points)
+        {
+            quint32 id, from, count;
+
+            record >> id >> from >> count;
+
+            if(record.status() != QDataStream::Ok || count > length / 10 || !index.contains(id))
+                continue;
+
+            QVector<float> x(count), y(count), pressure(count);
+
+            for(quint32 i = 0; i < count; i++)
+                record >> x[i];
+            for(quint32 i = 0; i < count; i++)
+                record >> y[i];
+            for(quint32 i = 0; i < count; i++)
+            {
+                quint16 value;
+
+                record >> value;
+                pressure[i] = value / 65535.0f;
+            }
+
+            QDrawingStroke &stroke = (*strokes)[index.value(id)];
+            qint64 skip = (qint64)stroke.size() - from;
+
+            // Points before the gap were never written, points before skip are already there
+            if(record.status() == QDataStream::Ok && skip >= 0 && skip < count)
+                stroke.append(x.constData() + skip, y.constData() + skip, pressure.constData() + skip, count - skip);
+        }
+        else if(type == Record_StrokeCurves)
+        {
+            quint32 id, count;
+
+            record >> id >> count;
+
+            if(record.status() != QDataStream::Ok || count > length / 10 || !index.contains(id))
+                continue;
+
+            QVector<float> x(count), y(count), pressure(count);
+
+            for(quint32 i = 0; i < count; i++)
+                record >> x[i];
+            for(quint32 i = 0; i < count; i++)
+                record >> y[i];
+            for(quint32 i = 0; i < count; i++)
+            {
+                quint16 value;
+
+                record >> value;
+                pressure[i] = value / 65535.0f;
+            }
+
+            if(record.status() != QDataStream::Ok)
+                continue;
+
+            // Replaces the samples, and the curves if the document already has them
+            (*strokes)[index.value(id)].setCurves(x.constData(), y.constData(), pressure.constData(), count);
+        }
+        else if(type == Record_StrokeRemove)
+        {
+            quint32 id;
+
+            record >> id;
+
+            if(index.contains(id))
+            {
+                (*strokes)[index.take(id)] = QDrawingStroke();
+                order.removeAt(order.lastIndexOf(id));
+            }
+        }
+    }
+
+    // Removed strokes are left out
+    QList<QDrawingStroke> kept;
+
+    kept.reserve(order.size());
+
+    for(int i = 0; i < order.size(); i++)
+        kept << strokes->at(index.value(order[i]));
+
+    strokes->swap(kept);
+
+    return true;
+}
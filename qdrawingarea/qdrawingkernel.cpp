@@ -0,0 +1,405 @@
+#include "qdrawinggeometry_p.h"
+
+#include <QtGlobal>
+#include <QByteArray>
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define QDRAWINGAREA_HAVE_SSE2
+#endif
+
+#if defined(Q_CC_GNU) && defined(Q_PROCESSOR_X86) && defined(QDRAWINGAREA_HAVE_SSE2)
+#  include <immintrin.h>
+#  define QDRAWINGAREA_HAVE_AVX2
+#  define QDRAWINGAREA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef void (*OffsetsFunction)(const float *x, const float *y, const quint16 *pressure, int count,
+                                float minWidth, float maxWidth,
+                                float *leftX, float *leftY, float *rightX, float *rightY);
+typedef void (*NormalsFunction)(const float *x, const float *y, int count, float *nx, float *ny);
+
+static const float PressureScale = 1.0f / 65535.0f;
+
+static inline float safeInverseLength(float dx, float dy)
+{
+    float length = dx * dx + dy * dy;
+
+    return length > 0 ? 1.0f / std::sqrt(length) : 0.0f;
+}
+
+static inline void offsetPoint(const float *x, const float *y, const quint16 *pressure, int count, int i,
+                               float minWidth, float widthScale,
+                               float *leftX, float *leftY, float *rightX, float *rightY)
+{
+    float nx, ny;
+
+    if(i == 0 || i == count - 1)
+    {
+        // End points take the normal of their only segment
+        int a = i == 0 ? 0 : i - 1;
+        float dx = x[a + 1] - x[a], dy = y[a + 1] - y[a];
+        float inv = safeInverseLength(dx, dy);
+
+        nx = -dy * inv;
+        ny = dx * inv;
+    }
+    else
+    {
+        float dxp = x[i] - x[i - 1], dyp = y[i] - y[i - 1];
+        float dxn = x[i + 1] - x[i], dyn = y[i + 1] - y[i];
+        float ip = safeInverseLength(dxp, dyp), in = safeInverseLength(dxn, dyn);
+        float mx = -(dyp * ip + dyn * in), my = dxp * ip + dxn * in;
+        float ml = mx * mx + my * my;
+
+        if(ml > 1e-6f)
+        {
+            float im = 1.0f / std::sqrt(ml);
+
+            nx = mx * im;
+            ny = my * im;
+        }
+        else
+        {
+            // A full reversal has no meaningful average
+            nx = -dyn * in;
+            ny = dxn * in;
+        }
+    }
+
+    float w = minWidth + widthScale * pressure[i];
+
+    leftX[i] = x[i] + w * nx;
+    leftY[i] = y[i] + w * ny;
+    rightX[i] = x[i] - w * nx;
+    rightY[i] = y[i] - w * ny;
+}
+
+static void offsetsScalar(const float *x, const float *y, const quint16 *pressure, int count,
+                          float minWidth, float maxWidth,
+                          float *leftX, float *leftY, float *rightX, float *rightY)
+{
+    float widthScale = (maxWidth - minWidth) * PressureScale;
+
+    for(int i = 0; i < count; i++)
+        offsetPoint(x, y, pressure, count, i, minWidth, widthScale, leftX, leftY, rightX, rightY);
+}
+
+static inline void normalPoint(const float *x, const float *y, int i, float *nx, float *ny)
+{
+    if(i == 0)
+    {
+        nx[0] = 0;
+        ny[0] = -1;
+        return;
+    }
+
+    float dx = x[i] - x[i - 1], dy = y[i] - y[i - 1];
+    float inv = safeInverseLength(dx, dy);
+
+    nx[i] = -dy * inv;
+    ny[i] = dx * inv;
+}
+
+static void normalsScalar(const float *x, const float *y, int count, float *nx, float *ny)
+{
+    for(int i = 0; i < count; i++)
+        normalPoint(x, y, i, nx, ny);
+}
+
+#ifdef QDRAWINGAREA_HAVE_SSE2
+static inline __m128 sseInverseLength(__m128 dx, __m128 dy)
+{
+    __m128 length = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    __m128 nonZero = _mm_cmpgt_ps(length, _mm_setzero_ps());
+
+    return _mm_and_ps(nonZero, _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length)));
+}
+
+static inline __m128 sseSelect(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void offsetsSse2(const float *x, const float *y, const quint16 *pressure, int count,
+                        float minWidth, float maxWidth,
+                        float *leftX, float *leftY, float *rightX, float *rightY)
+{
+    float widthScale = (maxWidth - minWidth) * PressureScale;
+    const __m128 vMinWidth = _mm_set1_ps(minWidth);
+    const __m128 vWidthScale = _mm_set1_ps(widthScale);
+    const __m128 vEpsilon = _mm_set1_ps(1e-6f);
+    const __m128 vOne = _mm_set1_ps(1.0f);
+    const __m128 vSign = _mm_set1_ps(-0.0f);
+    int i = 0;
+
+    if(count > 0)
+        offsetPoint(x, y, pressure, count, i++, minWidth, widthScale, leftX, leftY, rightX, rightY);
+
+    // Interior points need both neighbours
+    for(; i + 4 <= count - 1; i += 4)
+    {
+        __m128 x0 = _mm_loadu_ps(x + i - 1), x1 = _mm_loadu_ps(x + i), x2 = _mm_loadu_ps(x + i + 1);
+        __m128 y0 = _mm_loadu_ps(y + i - 1), y1 = _mm_loadu_ps(y + i), y2 = _mm_loadu_ps(y + i + 1);
+        __m128 dxp = _mm_sub_ps(x1, x0), dyp = _mm_sub_ps(y1, y0);
+        __m128 dxn = _mm_sub_ps(x2, x1), dyn = _mm_sub_ps(y2, y1);
+        __m128 ip = sseInverseLength(dxp, dyp), in = sseInverseLength(dxn, dyn);
+
+        __m128 mx = _mm_xor_ps(vSign, _mm_add_ps(_mm_mul_ps(dyp, ip), _mm_mul_ps(dyn, in)));
+        __m128 my = _mm_add_ps(_mm_mul_ps(dxp, ip), _mm_mul_ps(dxn, in));
+        __m128 ml = _mm_add_ps(_mm_mul_ps(mx, mx), _mm_mul_ps(my, my));
+        __m128 valid = _mm_cmpgt_ps(ml, vEpsilon);
+        __m128 im = _mm_div_ps(vOne, _mm_sqrt_ps(_mm_max_ps(ml, vEpsilon)));
+
+        __m128 nx = sseSelect(valid, _mm_mul_ps(mx, im), _mm_xor_ps(vSign, _mm_mul_ps(dyn, in)));
+        __m128 ny = sseSelect(valid, _mm_mul_ps(my, im), _mm_mul_ps(dxn, in));
+
+        __m128i p16 = _mm_loadl_epi64((const __m128i *)(pressure + i));
+        __m128 p = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p16, _mm_setzero_si128()));
+        __m128 w = _mm_add_ps(vMinWidth, _mm_mul_ps(vWidthScale, p));
+        __m128 ox = _mm_mul_ps(w, nx), oy = _mm_mul_ps(w, ny);
+
+        _mm_storeu_ps(leftX + i, _mm_add_ps(x1, ox));
+        _mm_storeu_ps(leftY + i, _mm_add_ps(y1, oy));
+        _mm_storeu_ps(rightX + i, _mm_sub_ps(x1, ox));
+        _mm_storeu_ps(rightY + i, _mm_sub_ps(y1, oy));
+    }
+
+    for(; i < count; i++)
+        offsetPoint(x, y, pressure, count, i, minWidth, widthScale, leftX, leftY, rightX, rightY);
+}
+
+static void normalsSse2(const float *x, const float *y, int count, float *nx, float *ny)
+{
+    const __m128 vSign = _mm_set1_ps(-0.0f);
+    int i = 0;
+
+    if(count > 0)
+        normalPoint(x, y, i++, nx, ny);
+
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(x + i - 1));
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), _mm_loadu_ps(y + i - 1));
+        __m128 inv = sseInverseLength(dx, dy);
+
+        _mm_storeu_ps(nx + i, _mm_xor_ps(vSign, _mm_mul_ps(dy, inv)));
+        _mm_storeu_ps(ny + i, _mm_mul_ps(dx, inv));
+    }
+
+    for(; i < count; i++)
+        normalPoint(x, y, i, nx, ny);
+}
+#endif // QDRAWINGAREA_HAVE_SSE2
+
+#ifdef QDRAWINGAREA_HAVE_AVX2
+QDRAWINGAREA_TARGET_AVX2
+static inline __m256 avxInverseLength(__m256 dx, __m256 dy)
+{
+    __m256 length = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+    __m256 nonZero = _mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+    return _mm256_and_ps(nonZero, _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(length)));
+}
+
+QDRAWINGAREA_TARGET_AVX2
+static void offsetsAvx2(const float *x, const float *y, const quint16 *pressure, int count,
+                        float minWidth, float maxWidth,
+                        float *leftX, float *leftY, float *rightX, float *rightY)
+{
+    float widthScale = (maxWidth - minWidth) * PressureScale;
+    const __m256 vMinWidth = _mm256_set1_ps(minWidth);
+    const __m256 vWidthScale = _mm256_set1_ps(widthScale);
+    const __m256 vEpsilon = _mm256_set1_ps(1e-6f);
+    const __m256 vOne = _mm256_set1_ps(1.0f);
+    const __m256 vSign = _mm256_set1_ps(-0.0f);
+    int i = 0;
+
+    if(count > 0)
+        offsetPoint(x, y, pressure, count, i++, minWidth, widthScale, leftX, leftY, rightX, rightY);
+
+    for(; i + 8 <= count - 1; i += 8)
+    {
+        __m256 x0 = _mm256_loadu_ps(x + i - 1), x1 = _mm256_loadu_ps(x + i), x2 = _mm256_loadu_ps(x + i + 1);
+        __m256 y0 = _mm256_loadu_ps(y + i - 1), y1 = _mm256_loadu_ps(y + i), y2 = _mm256_loadu_ps(y + i + 1);
+        __m256 dxp = _mm256_sub_ps(x1, x0), dyp = _mm256_sub_ps(y1, y0);
+        __m256 dxn = _mm256_sub_ps(x2, x1), dyn = _mm256_sub_ps(y2, y1);
+        __m256 ip = avxInverseLength(dxp, dyp), in = avxInverseLength(dxn, dyn);
+
+        __m256 mx = _mm256_xor_ps(vSign, _mm256_add_ps(_mm256_mul_ps(dyp, ip), _mm256_mul_ps(dyn, in)));
+        __m256 my = _mm256_add_ps(_mm256_mul_ps(dxp, ip), _mm256_mul_ps(dxn, in));
+        __m256 ml = _mm256_add_ps(_mm256_mul_ps(mx, mx), _mm256_mul_ps(my, my));
+        __m256 valid = _mm256_cmp_ps(ml, vEpsilon, _CMP_GT_OQ);
+        __m256 im = _mm256_div_ps(vOne, _mm256_sqrt_ps(_mm256_max_ps(ml, vEpsilon)));
+
+        __m256 nx = _mm256_blendv_ps(_mm256_xor_ps(vSign, _mm256_mul_ps(dyn, in)), _mm256_mul_ps(mx, im), valid);
+        __m256 ny = _mm256_blendv_ps(_mm256_mul_ps(dxn, in), _mm256_mul_ps(my, im), valid);
+
+        __m128i p16 = _mm_loadu_si128((const __m128i *)(pressure + i));
+        __m256 p = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(p16));
+        __m256 w = _mm256_add_ps(vMinWidth, _mm256_mul_ps(vWidthScale, p));
+        __m256 ox = _mm256_mul_ps(w, nx), oy = _mm256_mul_ps(w, ny);
+
+        _mm256_storeu_ps(leftX + i, _mm256_add_ps(x1, ox));
+        _mm256_storeu_ps(leftY + i, _mm256_add_ps(y1, oy));
+        _mm256_storeu_ps(rightX + i, _mm256_sub_ps(x1, ox));
+        _mm256_storeu_ps(rightY + i, _mm256_sub_ps(y1, oy));
+    }
+
+    for(; i < count; i++)
+        offsetPoint(x, y, pressure, count, i, minWidth, widthScale, leftX, leftY, rightX, rightY);
+}
+
+QDRAWINGAREA_TARGET_AVX2
+static void normalsAvx2(const float *x, const float *y, int count, float *nx, float *ny)
+{
+    const __m256 vSign = _mm256_set1_ps(-0.0f);
+    int i = 0;
+
+    if(count > 0)
+        normalPoint(x, y, i++, nx, ny);
+
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(x + i - 1));
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), _mm256_loadu_ps(y + i - 1));
+        __m256 inv = avxInverseLength(dx, dy);
+
+        _mm256_storeu_ps(nx + i, _mm256_xor_ps(vSign, _mm256_mul_ps(dy, inv)));
+        _mm256_storeu_ps(ny + i, _mm256_mul_ps(dx, inv));
+    }
+
+    for(; i < count; i++)
+        normalPoint(x, y, i, nx, ny);
+}
+#endif // QDRAWINGAREA_HAVE_AVX2
+
+enum KernelLevel {
+    Kernel_Scalar,
+    Kernel_SSE2,
+    Kernel_AVX2
+};
+
+static const char *const kernelNames[] = { "scalar", "sse2", "avx2" };
+
+static bool kernelSupported(KernelLevel level)
+{
+    switch(level)
+    {
+#ifdef QDRAWINGAREA_HAVE_AVX2
+    case Kernel_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef QDRAWINGAREA_HAVE_SSE2
+    case Kernel_SSE2:
+        return true;
+#endif
+    case Kernel_Scalar:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static KernelLevel detectKernel()
+{
+    // Allows comparing against the reference implementation
+    if(qgetenv("QDRAWINGAREA_NO_SIMD").toInt())
+        return Kernel_Scalar;
+
+    if(kernelSupported(Kernel_AVX2))
+        return Kernel_AVX2;
+
+    return kernelSupported(Kernel_SSE2) ? Kernel_SSE2 : Kernel_Scalar;
+}
+
+static KernelLevel &kernelLevel()
+{
+    static KernelLevel level = detectKernel();
+
+    return level;
+}
+
+void StrokeKernel::offsets(const float *x, const float *y, const quint16 *pressure, int count,
+                           float minWidth, float maxWidth,
+                           float *leftX, float *leftY, float *rightX, float *rightY)
+{
+    OffsetsFunction function = offsetsScalar;
+
+    switch(kernelLevel())
+    {
+#ifdef QDRAWINGAREA_HAVE_AVX2
+    case Kernel_AVX2:
+        function = offsetsAvx2;
+        break;
+#endif
+#ifdef QDRAWINGAREA_HAVE_SSE2
+    case Kernel_SSE2:
+        function = offsetsSse2;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    if(count > 1)
+        function(x, y, pressure, count, minWidth, maxWidth, leftX, leftY, rightX, rightY);
+}
+
+void StrokeKernel::normals(const float *x, const float *y, int count, float *nx, float *ny)
+{
+    NormalsFunction function = normalsScalar;
+
+    switch(kernelLevel())
+    {
+#ifdef QDRAWINGAREA_HAVE_AVX2
+    case Kernel_AVX2:
+        function = normalsAvx2;
+        break;
+#endif
+#ifdef QDRAWINGAREA_HAVE_SSE2
+    case Kernel_SSE2:
+        function = normalsSse2;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    function(x, y, count, nx, ny);
+}
+
+const char *StrokeKernel::implementation()
+{
+    return kernelNames[kernelLevel()];
+}
+
+QList<QByteArray> StrokeKernel::implementations()
+{
+    QList<QByteArray> names;
+
+    for(int level = Kernel_Scalar; level <= Kernel_AVX2; level++)
+    {
+        if(kernelSupported((KernelLevel)level))
+            names << kernelNames[level];
+    }
+
+    return names;
+}
+
+bool StrokeKernel::setImplementation(const QByteArray &name)
+{
+    for(int level = Kernel_Scalar; level <= Kernel_AVX2; level++)
+    {
+        if(name == kernelNames[level] && kernelSupported((KernelLevel)level))
+        {
+            kernelLevel() = (KernelLevel)level;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,139 @@
+#include "qdrawingarea.h"
+#include "qdrawingarea_p.h"
+
+#include <QtAlgorithms>
+#include <QtMath>
+
+LatencyHistogram::LatencyHistogram() :
+    count(0),
+    sum(0),
+    max(0)
+{
+}
+
+void LatencyHistogram::add(qint64 ns)
+{
+    quint64 us = qMax<qint64>(ns, 0) / 1000;
+    int bucket = us < 2 ? 0 : qMin<int>(63 - qCountLeadingZeroBits(us), BucketCount - 1);
+
+    buckets[bucket].ref();
+    count.ref();
+    sum.fetchAndAddRelaxed(us);
+
+    qint64 current = max.load();
+
+    while((qint64)us > current && !max.testAndSetRelaxed(current, us))
+        current = max.load();
+}
+
+void LatencyHistogram::reset()
+{
+    for(int i = 0; i < BucketCount; i++)
+        buckets[i].store(0);
+
+    count.store(0);
+    sum.store(0);
+    max.store(0);
+}
+
+QDrawingLatency LatencyHistogram::summary() const
+{
+    QDrawingLatency result;
+    qint64 counts[BucketCount];
+    qint64 total = 0;
+    const qreal fractions[] = { 0.50, 0.95, 0.99 };
+    qreal *percentiles[] = { &result.p50, &result.p95, &result.p99 };
+
+    for(int i = 0; i < BucketCount; i++)
+        total += counts[i] = buckets[i].load();
+
+    result.count = total;
+    result.mean = total ? sum.load() / (qreal)total : 0;
+    result.max = max.load();
+
+    for(int p = 0; p < 3; p++)
+    {
+        qint64 rank = qMax<qint64>(1, qCeil(total * fractions[p]));
+        qint64 cumulative = 0;
+
+        *percentiles[p] = 0;
+
+        for(int i = 0; i < BucketCount && total; i++)
+        {
+            if(cumulative + counts[i] >= rank)
+            {
+                // Interpolate linearly inside the bucket
+                qreal lower = i == 0 ? 0 : (qreal)(Q_INT64_C(1) << i);
+                qreal upper = (qreal)(Q_INT64_C(1) << (i + 1));
+
+                *percentiles[p] = qMin(lower + (upper - lower) * (rank - cumulative) / counts[i], result.max);
+                break;
+            }
+
+            cumulative += counts[i];
+        }
+    }
+
+    return result;
+}
+
+
+MetricsCollector::MetricsCollector() :
+    samples(0),
+    frames(0),
+    droppedFrames(0),
+    frameStrokes(0),
+    batches(0),
+    batchSamples(0),
+    maxBatch(0)
+{
+}
+
+void MetricsCollector::recordBatch(int samples)
+{
+    batches.ref();
+    batchSamples.fetchAndAddRelaxed(samples);
+
+    qint64 current = maxBatch.load();
+
+    while(samples > current && !maxBatch.testAndSetRelaxed(current, samples))
+        current = maxBatch.load();
+}
+
+void MetricsCollector::reset()
+{
+    for(int i = 0; i < QDrawingAreaMetrics::StageCount; i++)
+        stages[i].reset();
+
+    repaint.reset();
+    fullRepaint.reset();
+    samples.store(0);
+    frames.store(0);
+    droppedFrames.store(0);
+    frameStrokes.store(0);
+    batches.store(0);
+    batchSamples.store(0);
+    maxBatch.store(0);
+}
+
+QDrawingAreaMetrics MetricsCollector::summary() const
+{
+    QDrawingAreaMetrics result;
+    qint64 batchCount = batches.load();
+    qint64 frameCount = frames.load();
+
+    for(int i = 0; i < QDrawingAreaMetrics::StageCount; i++)
+        result.latency[i] = stages[i].summary();
+
+    result.repaintDuration = repaint.summary();
+    result.fullRepaintDuration = fullRepaint.summary();
+    result.samples = samples.load();
+    result.frames = frameCount;
+    result.droppedFrames = droppedFrames.load();
+    result.queueOverflows = 0;
+    result.meanBatchSize = batchCount ? batchSamples.load() / (qreal)batchCount : 0;
+    result.maxBatchSize = maxBatch.load();
+    result.meanStrokesPerFrame = frameCount ? frameStrokes.load() / (qreal)frameCount : 0;
+
+    return result;
+}
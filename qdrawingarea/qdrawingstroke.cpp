@@ -0,0 +1,930 @@
+#include "qdrawingarea_p.h"
+#include "qdrawingstroke_p.h"
+#include "qdrawinggeometry_p.h"
+
+#include <QHash>
+#include <QMutex>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+QDrawingPointChunk::QDrawingPointChunk(int capacity, bool normals) :
+    capacity(capacity),
+    used(0)
+{
+    allocate(normals);
+}
+
+QDrawingPointChunk::QDrawingPointChunk(const QDrawingPointChunk &other, int count) :
+    QSharedData(),
+    capacity(other.capacity),
+    used(count)
+{
+    allocate(other.nx != 0);
+
+    memcpy(x, other.x, count * sizeof(float));
+    memcpy(y, other.y, count * sizeof(float));
+    memcpy(pressure, other.pressure, count * sizeof(quint16));
+
+    if(nx)
+    {
+        memcpy(nx, other.nx, count * sizeof(float));
+        memcpy(ny, other.ny, count * sizeof(float));
+    }
+}
+
+QDrawingPointChunk::QDrawingPointChunk(const float *x, const float *y, const quint16 *pressure, int count,
+                                       QSharedPointer<QDrawingPointStorage> storage) :
+    capacity(count),
+    used(count),
+    x(const_cast<float*>(x)),
+    y(const_cast<float*>(y)),
+    pressure(const_cast<quint16*>(pressure)),
+    nx(0),
+    ny(0),
+    storage(storage)
+{
+}
+
+QDrawingPointChunk::~QDrawingPointChunk()
+{
+    if(!storage)
+        free(x);
+}
+
+void QDrawingPointChunk::allocate(bool normals)
+{
+    // One block per chunk: x, y, the optional normals and the pressure last for alignment
+    int floats = normals ? 4 : 2;
+    char *block = (char*)malloc(capacity * (floats * sizeof(float) + sizeof(quint16)));
+
+    Q_CHECK_PTR(block);
+
+    x = (float*)block;
+    y = x + capacity;
+    nx = normals ? y + capacity : 0;
+    ny = normals ? nx + capacity : 0;
+    pressure = (quint16*)(x + floats * capacity);
+}
+
+qint64 QDrawingPointChunk::memoryUsage() const
+{
+    if(storage)
+        return sizeof(QDrawingPointChunk);
+
+    return sizeof(QDrawingPointChunk) +
+            (qint64)capacity * ((nx ? 4 : 2) * sizeof(float) + sizeof(quint16));
+}
+
+
+QDrawingPen **PenRegistry::blocks[PenRegistry::BlockCount];
+QAtomicInt PenRegistry::count;
+
+quint16 PenRegistry::add(const QDrawingPen &pen)
+{
+    struct Key
+    {
+        quint64 color;
+        quint32 button;
+        qint32 mode;
+        qreal minWidth;
+        qreal maxWidth;
+        qreal orientationLock;
+    };
+
+    static QMutex lock;
+    static QHash<QByteArray, quint16> known;
+
+    Key key;
+
+    memset(&key, 0, sizeof(key));
+    key.color = pen.color().rgba64();
+    key.button = pen.button();
+    key.mode = pen.mode();
+    key.minWidth = pen.minWidth();
+    key.maxWidth = pen.maxWidth();
+    key.orientationLock = pen.orientationLock();
+
+    QByteArray bytes((const char*)&key, sizeof(key));
+    QMutexLocker locker(&lock);
+    QHash<QByteArray, quint16>::const_iterator existing = known.constFind(bytes);
+
+    if(existing != known.constEnd())
+        return existing.value();
+
+    int id = count.load();
+
+    if(id >= QDrawingPen::InvalidId)
+    {
+        qWarning("PenRegistry::add: Too many pens");
+        return QDrawingPen::InvalidId;
+    }
+
+    if(!blocks[id / BlockSize])
+        blocks[id / BlockSize] = new QDrawingPen*[BlockSize];
+
+    blocks[id / BlockSize][id % BlockSize] = new QDrawingPen(pen);
+    known.insert(bytes, id);
+    count.storeRelease(id + 1);
+
+    return id;
+}
+
+QDrawingStrokeData::QDrawingStrokeData() :
+    size(0),
+    reserved(0),
+    left(0),
+    top(0),
+    right(0),
+    bottom(0),
+    compact(false),
+    curves(false),
+    id(-1),
+    pen(QDrawingPen::InvalidId)
+{
+}
+
+int QDrawingStrokeData::chunkIndex(int index, int *offset) const
+{
+    int chunk = chunks.size() - 1;
+
+    // Nearly every access is to the newest points
+    if(index < chunkStart[chunk])
+        chunk = std::upper_bound(chunkStart.constBegin(), chunkStart.constEnd(), index) - chunkStart.constBegin() - 1;
+
+    *offset = index - chunkStart[chunk];
+    return chunk;
+}
+
+QDrawingPointChunk *QDrawingStrokeData::writableChunk(int index, int *offset)
+{
+    int chunk = chunkIndex(index, offset);
+    QExplicitlySharedDataPointer<QDrawingPointChunk> &pointer = chunks[chunk];
+
+    levels.clear();
+
+    // Shared and external points are never written to
+    if(pointer->ref.load() != 1 || pointer->storage)
+    {
+        int count = qMin(pointer->capacity, size - chunkStart[chunk]);
+
+        pointer = QExplicitlySharedDataPointer<QDrawingPointChunk>(new QDrawingPointChunk(*pointer, count));
+    }
+
+    return pointer.data();
+}
+
+void QDrawingStrokeData::copyPoints(int from, int count, float *x, float *y, quint16 *pressure) const
+{
+    int offset;
+    int chunk = chunkIndex(from, &offset);
+
+    while(count > 0)
+    {
+        const QDrawingPointChunk *c = chunks[chunk].constData();
+        int n = qMin(count, c->capacity - offset);
+
+        if(x)
+        {
+            memcpy(x, c->x + offset, n * sizeof(float));
+            x += n;
+        }
+        if(y)
+        {
+            memcpy(y, c->y + offset, n * sizeof(float));
+            y += n;
+        }
+        if(pressure)
+        {
+            memcpy(pressure, c->pressure + offset, n * sizeof(quint16));
+            pressure += n;
+        }
+
+        count -= n;
+        offset = 0;
+        chunk++;
+    }
+}
+
+
+QDrawingPointRef::QDrawingPointRef(QDrawingStroke *stroke, int index) :
+    m_stroke(stroke),
+    m_index(index)
+{
+}
+
+qreal QDrawingPointRef::x() const
+{
+    int offset;
+    const QDrawingStrokeData *d = m_stroke->d.constData();
+
+    return d->chunks[d->chunkIndex(m_index, &offset)]->x[offset];
+}
+
+qreal QDrawingPointRef::y() const
+{
+    int offset;
+    const QDrawingStrokeData *d = m_stroke->d.constData();
+
+    return d->chunks[d->chunkIndex(m_index, &offset)]->y[offset];
+}
+
+qreal QDrawingPointRef::pressure() const
+{
+    int offset;
+    const QDrawingStrokeData *d = m_stroke->d.constData();
+
+    return d->chunks[d->chunkIndex(m_index, &offset)]->pressure[offset] / 65535.0;
+}
+
+QVector2D QDrawingPointRef::normal() const
+{
+    return static_cast<const QDrawingStroke*>(m_stroke)->operator[](m_index).normal();
+}
+
+QDrawingPointRef::operator QPointF() const
+{
+    return QPointF(x(), y());
+}
+
+QDrawingPointRef::operator QDrawingPoint() const
+{
+    return static_cast<const QDrawingStroke*>(m_stroke)->operator[](m_index);
+}
+
+void QDrawingPointRef::setX(qreal x)
+{
+    int offset;
+    QDrawingStrokeData *d = m_stroke->d.data();
+    QDrawingPointChunk *chunk = d->writableChunk(m_index, &offset);
+
+    chunk->x[offset] = x;
+    d->left = qMin<float>(d->left, x);
+    d->right = qMax<float>(d->right, x);
+    updateNormals();
+}
+
+void QDrawingPointRef::setY(qreal y)
+{
+    int offset;
+    QDrawingStrokeData *d = m_stroke->d.data();
+    QDrawingPointChunk *chunk = d->writableChunk(m_index, &offset);
+
+    chunk->y[offset] = y;
+    d->top = qMin<float>(d->top, y);
+    d->bottom = qMax<float>(d->bottom, y);
+    updateNormals();
+}
+
+void QDrawingPointRef::setPressure(qreal pressure)
+{
+    int offset;
+    QDrawingPointChunk *chunk = m_stroke->d->writableChunk(m_index, &offset);
+
+    chunk->pressure[offset] = qRound(qBound<qreal>(0, pressure, 1) * 65535);
+}
+
+void QDrawingPointRef::updateNormals()
+{
+    QDrawingStrokeData *d = m_stroke->d.data();
+
+    if(d->compact)
+        return;
+
+    // Moving a point changes its own normal and the one of the next point
+    for(int i = m_index; i <= m_index + 1 && i < d->size; i++)
+    {
+        int offset;
+        QVector2D normal = m_stroke->calcNormal(i);
+        QDrawingPointChunk *chunk = d->writableChunk(i, &offset);
+
+        chunk->nx[offset] = normal.x();
+        chunk->ny[offset] = normal.y();
+    }
+}
+
+
+QDrawingStroke::QDrawingStroke() :
+    d(new QDrawingStrokeData)
+{
+}
+
+QDrawingStroke::QDrawingStroke(const QDrawingStroke &other) :
+    d(other.d)
+{
+}
+
+QDrawingStroke::~QDrawingStroke()
+{
+}
+
+QDrawingStroke &QDrawingStroke::operator=(const QDrawingStroke &other)
+{
+    d = other.d;
+    return *this;
+}
+
+quint32 QDrawingStroke::id() const
+{
+    return d->id;
+}
+
+QDrawingPen *QDrawingStroke::pen() const
+{
+    return PenRegistry::pen(d->pen);
+}
+
+void QDrawingStroke::setPen(QSharedPointer<QDrawingPen> pen)
+{
+    d->pen = pen ? PenRegistry::add(*pen) : (quint16)QDrawingPen::InvalidId;
+    d->levels.clear();
+}
+
+void QDrawingStroke::setCompact(bool compact)
+{
+    if(d->size == 0)
+    {
+        d->compact = compact;
+        d->chunks.clear();
+        d->chunkStart.clear();
+        return;
+    }
+
+    if(d->compact == compact)
+        return;
+
+    int count = d->size;
+    QExplicitlySharedDataPointer<QDrawingPointChunk> chunk(
+                new QDrawingPointChunk(qMax<int>(count, QDrawingStrokeData::MinChunkSize), !compact));
+
+    // Repacked into a single chunk, any copies keep the old ones
+    d->copyPoints(0, count, chunk->x, chunk->y, chunk->pressure);
+
+    if(!compact)
+        StrokeKernel::normals(chunk->x, chunk->y, count, chunk->nx, chunk->ny);
+
+    chunk->used.store(count);
+
+    d->compact = compact;
+    d->chunks.clear();
+    d->chunkStart.clear();
+    d->chunks << chunk;
+    d->chunkStart << 0;
+}
+
+bool QDrawingStroke::isCompact() const
+{
+    return d->compact;
+}
+
+QDrawingStroke &QDrawingStroke::operator<<(const QDrawingPoint &p)
+{
+    QDrawingStrokeData *data = d.data();
+    int offset = data->chunks.isEmpty() ? 0 : data->size - data->chunkStart.last();
+
+    data->levels.clear();
+
+    if(data->chunks.isEmpty() || offset == data->chunks.last()->capacity)
+    {
+        // Doubling keeps short strokes small and the number of chunks low
+        int capacity = qBound<int>(QDrawingStrokeData::MinChunkSize, data->size, QDrawingStrokeData::MaxChunkSize);
+
+        capacity = qMax(capacity, data->reserved - data->size);
+        data->chunks << QExplicitlySharedDataPointer<QDrawingPointChunk>(new QDrawingPointChunk(capacity, !data->compact));
+        data->chunkStart << data->size;
+        offset = 0;
+    }
+
+    QDrawingPointChunk *chunk = data->chunks.last().data();
+
+    // Another copy of this stroke appended here first, continue in a private copy
+    if(!chunk->used.testAndSetRelaxed(offset, offset + 1))
+    {
+        data->chunks.last() = QExplicitlySharedDataPointer<QDrawingPointChunk>(new QDrawingPointChunk(*chunk, offset));
+        chunk = data->chunks.last().data();
+        chunk->used.store(offset + 1);
+    }
+
+    float x = p.x(), y = p.y();
+
+    chunk->x[offset] = x;
+    chunk->y[offset] = y;
+    chunk->pressure[offset] = qRound(qBound<qreal>(0, p.pressure(), 1) * 65535);
+
+    if(data->size == 0)
+    {
+        data->left = data->right = x;
+        data->top = data->bottom = y;
+    }
+    else
+    {
+        data->left = qMin(data->left, x);
+        data->right = qMax(data->right, x);
+        data->top = qMin(data->top, y);
+        data->bottom = qMax(data->bottom, y);
+    }
+
+    data->size++;
+
+    // Normals are always derived from the previous point
+    if(!data->compact)
+    {
+        QVector2D normal = calcNormal(data->size - 1);
+
+        chunk->nx[offset] = normal.x();
+        chunk->ny[offset] = normal.y();
+    }
+
+    return *this;
+}
+
+void QDrawingStroke::append(const float *x, const float *y, const float *pressure, int count)
+{
+    if(count <= 0)
+        return;
+
+    // The remaining points go into a single chunk
+    d->reserved = qMax<int>(d->reserved, d->size + count);
+
+    for(int i = 0; i < count; i++)
+        *this << QDrawingPoint(x[i], y[i], pressure ? pressure[i] : 1.0);
+}
+
+bool QDrawingStroke::operator&(const QDrawingStroke &s)
+{
+    QDrawingPen *pen = this->pen(), *otherPen = s.pen();
+    int count = s.size();
+
+    if(size() == 0 || count == 0 || !pen || !otherPen)
+        return false;
+
+    qreal margin = pen->maxWidth(), otherMargin = otherPen->maxWidth();
+
+    if(!boundingRect().adjusted(-margin, -margin, margin, margin).intersects(
+                s.boundingRect().adjusted(-otherMargin, -otherMargin, otherMargin, otherMargin)))
+        return false;
+
+    // The segments of `s` are tested against this stroke the way the eraser tests strokes
+    StrokeSpatialIndex index;
+    QVector<float> x(count), y(count);
+    QVector<quint16> pressure(count);
+
+    index.insertStroke(*this);
+    s.d->copyPoints(0, count, x.data(), y.data(), pressure.data());
+
+    if(s.hasCurves())
+    {
+        QVector<float> flatX, flatY;
+        QVector<quint16> flatPressure;
+
+        CurveFitter::flatten(x.constData(), y.constData(), pressure.constData(), count, IndexFlatness, flatX, flatY, flatPressure);
+        x = flatX;
+        y = flatY;
+        pressure = flatPressure;
+        count = x.size();
+    }
+
+    // A single point is tested as a dot
+    for(int i = 0; i < qMax(count - 1, 1); i++)
+    {
+        int next = qMin(i + 1, count - 1);
+        qreal radius = qMax(otherPen->calcWidth(pressure[i] / 65535.0), otherPen->calcWidth(pressure[next] / 65535.0));
+
+        if(!index.segmentsAlong(QPointF(x[i], y[i]), QPointF(x[next], y[next]), radius).isEmpty())
+            return true;
+    }
+
+    return false;
+}
+
+QDrawingPointRef QDrawingStroke::operator[](const unsigned long index)
+{
+    return QDrawingPointRef(this, index);
+}
+
+QDrawingPoint QDrawingStroke::operator[](const unsigned long index) const
+{
+    int offset;
+    const QDrawingPointChunk *chunk = d->chunks[d->chunkIndex(index, &offset)].constData();
+
+    return QDrawingPoint(chunk->x[offset], chunk->y[offset], chunk->pressure[offset] / 65535.0,
+                         d->compact ? calcNormal(index) : QVector2D(chunk->nx[offset], chunk->ny[offset]));
+}
+
+unsigned long QDrawingStroke::size() const
+{
+    return d->size;
+}
+
+void QDrawingStroke::reserve(int size)
+{
+    // Applied to the next chunk
+    d->reserved = size;
+}
+
+QRectF QDrawingStroke::boundingRect(int from) const
+{
+    if(from >= d->size)
+        return QRectF();
+
+    if(from <= 0)
+        return QRectF(QPointF(d->left, d->top), QPointF(d->right, d->bottom));
+
+    int count = d->size - from;
+    QVector<float> x(count), y(count);
+
+    d->copyPoints(from, count, x.data(), y.data(), 0);
+
+    std::pair<QVector<float>::iterator, QVector<float>::iterator> h = std::minmax_element(x.begin(), x.end());
+    std::pair<QVector<float>::iterator, QVector<float>::iterator> v = std::minmax_element(y.begin(), y.end());
+
+    return QRectF(QPointF(*h.first, *v.first), QPointF(*h.second, *v.second));
+}
+
+qint64 QDrawingStroke::memoryUsage() const
+{
+    qint64 usage = d->chunks.capacity() * (sizeof(void*) + sizeof(int));
+
+    for(int i = 0; i < d->chunks.size(); i++)
+        usage += d->chunks[i]->memoryUsage();
+
+    if(d->levels)
+        usage += d->levels->memoryUsage();
+
+    return usage;
+}
+
+void QDrawingStroke::simplify()
+{
+    // Curves are flattened for the scale they are drawn at instead
+    if(!d->curves)
+        d->levels = StrokeLevels::build(*this);
+}
+
+void QDrawingStroke::setCurves(const float *x, const float *y, const float *pressure, int count)
+{
+    QDrawingStrokeData *data = d.data();
+
+    // Copies keep the samples
+    data->chunks.clear();
+    data->chunkStart.clear();
+    data->size = 0;
+    data->reserved = 0;
+    data->levels.clear();
+    data->curves = false;
+
+    append(x, y, pressure, count);
+    data->curves = true;
+}
+
+bool QDrawingStroke::hasCurves() const
+{
+    return d->curves;
+}
+
+QVector2D QDrawingStroke::calcNormal(int index) const
+{
+    if(index == 0)
+        return QVector2D(0, -1);
+
+    float x[2], y[2];
+
+    d->copyPoints(index - 1, 2, x, y, 0);
+
+    QVector2D t(x[1] - x[0], y[1] - y[0]);
+
+    t.normalize();
+
+    // Rotated by 90 degrees
+    return QVector2D(-t.y(), t.x());
+}
+
+void QDrawingStroke::setId(quint32 id)
+{
+    d->id = id;
+}
+
+void QDrawingStroke::setDirty(bool dirty, int at)
+{
+    Q_UNUSED(dirty);
+    Q_UNUSED(at);
+}
+
+bool QDrawingStroke::dirty() const
+{
+    return false;
+}
+
+int QDrawingStroke::dirtyAt() const
+{
+    return 0;
+}
+
+
+QDrawingSnapshot::QDrawingSnapshot()
+{
+}
+
+bool QDrawingSnapshot::isNull() const
+{
+    return d.isNull();
+}
+
+quint64 QDrawingSnapshot::version() const
+{
+    return d ? d->version : 0;
+}
+
+int QDrawingSnapshot::strokeCount() const
+{
+    return d ? d->strokes.count() : 0;
+}
+
+QList<quint32> QDrawingSnapshot::strokeIds() const
+{
+    return d ? d->strokes.ids() : QList<quint32>();
+}
+
+bool QDrawingSnapshot::contains(quint32 strokeId) const
+{
+    return d && d->strokes.contains(strokeId);
+}
+
+QDrawingStroke QDrawingSnapshot::stroke(quint32 strokeId) const
+{
+    const QDrawingStroke *stroke = d ? d->strokes.find(strokeId) : 0;
+
+    return stroke ? *stroke : QDrawingStroke();
+}
+
+
+StrokeStore::StrokeStore() :
+    firstId(0),
+    live(0),
+    nextRank(0)
+{
+}
+
+quint32 StrokeStore::insert(QDrawingStroke stroke)
+{
+    quint32 id = firstId + slots.size();
+
+    stroke.setId(id);
+    slots.append(strokes.size());
+    ranks.append(nextRank++);
+    strokes.append(stroke);
+    live++;
+
+    return id;
+}
+
+quint32 StrokeStore::insertAfter(quint32 below, QDrawingStroke stroke)
+{
+    int slot = slotOf(below);
+
+    if(slot < 0 || slot + 1 == strokes.size())
+        return insert(stroke);
+
+    // Between the stroke below and whatever is in the next slot, removed or not
+    quint32 above = strokes.at(slot + 1).id();
+    double rank = (ranks.at(below - firstId) + ranks.at(above - firstId)) / 2;
+
+    if(rank <= ranks.at(below - firstId) || rank >= ranks.at(above - firstId))
+    {
+        renumberRanks();
+        rank = (ranks.at(below - firstId) + ranks.at(above - firstId)) / 2;
+    }
+
+    quint32 id = firstId + slots.size();
+
+    stroke.setId(id);
+    slots.append(slot + 1);
+    ranks.append(rank);
+    strokes.insert(slot + 1, stroke);
+    live++;
+
+    for(int i = slot + 2; i < strokes.size(); i++)
+    {
+        quint32 moved = strokes.at(i).id() - firstId;
+
+        slots[moved] = slots.at(moved) >= 0 ? i : -2 - i;
+    }
+
+    return id;
+}
+
+void StrokeStore::remove(quint32 id)
+{
+    int slot = slotOf(id);
+
+    if(slot < 0)
+        return;
+
+    slots[id - firstId] = -2 - slot;
+    live--;
+
+    // Keep iteration dense once most of the slots are empty
+    if(strokes.size() - live > qMax<int>(live, BlockVector<QDrawingStroke>::BlockSize))
+        compact();
+}
+
+void StrokeStore::reserve(int strokes)
+{
+    this->strokes.reserve(strokes);
+    slots.reserve(strokes);
+    ranks.reserve(strokes);
+}
+
+void StrokeStore::clear()
+{
+    firstId += slots.size();
+    strokes.clear();
+    slots.clear();
+    ranks.clear();
+    live = 0;
+    nextRank = 0;
+}
+
+void StrokeStore::compact()
+{
+    BlockVector<QDrawingStroke> packed;
+
+    packed.reserve(live);
+
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        quint32 id = strokes.at(i).id();
+
+        if(isLive(i))
+        {
+            slots[id - firstId] = packed.size();
+            packed.append(strokes.at(i));
+        }
+        else
+        {
+            slots[id - firstId] = -1;
+        }
+    }
+
+    strokes = packed;
+}
+
+void StrokeStore::restore(const QList<QDrawingStroke> &restored)
+{
+    QVector<QPair<double, int> > late;
+
+    for(int i = 0; i < restored.size(); i++)
+    {
+        const QDrawingStroke &stroke = restored[i];
+        quint32 id = stroke.id();
+
+        // Ids from before a clear() are gone for good
+        if(id < firstId || id - firstId >= (quint32)slots.size())
+            continue;
+
+        int slot = slots.at(id - firstId);
+
+        if(slot >= 0)
+        {
+            strokes[slot] = stroke;
+        }
+        else if(slot < -1)
+        {
+            slot = -2 - slot;
+            strokes[slot] = stroke;
+            slots[id - firstId] = slot;
+            live++;
+        }
+        else
+        {
+            late << qMakePair(ranks.at(id - firstId), i);
+        }
+    }
+
+    if(late.isEmpty())
+        return;
+
+    // Slots were compacted away, ranks still tell where the strokes go
+    BlockVector<QDrawingStroke> merged;
+    int next = 0;
+
+    std::sort(late.begin(), late.end());
+    merged.reserve(live + late.size());
+
+    for(int i = 0; i <= strokes.size(); i++)
+    {
+        quint32 id = i < strokes.size() ? strokes.at(i).id() : 0;
+
+        if(i < strokes.size() && !isLive(i))
+        {
+            slots[id - firstId] = -1;
+            continue;
+        }
+
+        double rank = i < strokes.size() ? ranks.at(id - firstId) : nextRank;
+
+        while(next < late.size() && late[next].first < rank)
+        {
+            const QDrawingStroke &stroke = restored[late[next++].second];
+
+            slots[stroke.id() - firstId] = merged.size();
+            merged.append(stroke);
+            live++;
+        }
+
+        if(i < strokes.size())
+        {
+            slots[id - firstId] = merged.size();
+            merged.append(strokes.at(i));
+        }
+    }
+
+    strokes = merged;
+}
+
+void StrokeStore::renumberRanks()
+{
+    QVector<QPair<double, int> > order(ranks.size());
+
+    for(int i = 0; i < ranks.size(); i++)
+        order[i] = qMakePair(ranks.at(i), i);
+
+    // Ran out of precision between two neighbours, whole numbers leave room again
+    std::sort(order.begin(), order.end());
+
+    for(int i = 0; i < order.size(); i++)
+        ranks[order[i].second] = i;
+
+    nextRank = order.size();
+}
+
+bool StrokeStore::contains(quint32 id) const
+{
+    return slotOf(id) >= 0;
+}
+
+const QDrawingStroke *StrokeStore::find(quint32 id) const
+{
+    int slot = slotOf(id);
+
+    return slot < 0 ? 0 : &strokes.at(slot);
+}
+
+QDrawingStroke *StrokeStore::modify(quint32 id)
+{
+    int slot = slotOf(id);
+
+    return slot < 0 ? 0 : &strokes[slot];
+}
+
+QList<quint32> StrokeStore::ids() const
+{
+    QList<quint32> result;
+
+    result.reserve(live);
+
+    for(int i = 0; i < strokes.size(); i++)
+    {
+        if(isLive(i))
+            result << strokes.at(i).id();
+    }
+
+    return result;
+}
+
+quint32 StrokeStore::below(quint32 id) const
+{
+    for(int slot = slotOf(id) - 1; slot >= 0; slot--)
+    {
+        if(isLive(slot))
+            return strokes.at(slot).id();
+    }
+
+    return (quint32)-1;
+}
+
+int StrokeStore::count() const
+{
+    return live;
+}
+
+int StrokeStore::slotCount() const
+{
+    return strokes.size();
+}
+
+bool StrokeStore::isLive(int slot) const
+{
+    return slots.at(strokes.at(slot).id() - firstId) == slot;
+}
+
+const QDrawingStroke &StrokeStore::at(int slot) const
+{
+    return strokes.at(slot);
+}
+
+int StrokeStore::slotOf(quint32 id) const
+{
+    return id >= firstId && id - firstId < (quint32)slots.size() ? qMax(slots.at(id - firstId), -1) : -1;
+}
@@ -0,0 +1,275 @@
+#ifndef QDRAWINGSTROKE_P
+#define QDRAWINGSTROKE_P
+
+#include <QAtomicInt>
+#include <QExplicitlySharedDataPointer>
+#include <QList>
+#include <QSharedData>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "qdrawingarea.h"
+
+class StrokeLevels;
+
+/**
+ * @brief Process-wide table of pens, referenced by small ids.
+ *
+ * Registered pens are never changed or freed, so strokes, queued samples and render threads hold
+ * just the id and look the pen up without locking or reference counting.  Registering an equal pen
+ * again returns the id it already has.
+ */
+class PenRegistry
+{
+public:
+    enum {
+        BlockSize = 256,
+        BlockCount = 256    // Ids up to QDrawingPen::InvalidId
+    };
+
+    /**
+     * @brief Id of a copy of `pen`, QDrawingPen::InvalidId once the table is full.
+     */
+    static quint16 add(const QDrawingPen &pen);
+
+    static inline QDrawingPen *pen(quint16 id)
+    {
+        // Blocks and pens are written before the count that publishes them
+        if(id >= (uint)count.loadAcquire())
+            return 0;
+
+        return blocks[id / BlockSize][id % BlockSize];
+    }
+
+private:
+    static QDrawingPen **blocks[BlockCount];
+    static QAtomicInt count;
+};
+
+/**
+ * @brief Owner of point data that chunks refer to without copying it, such as a mapped file.
+ */
+class QDrawingPointStorage
+{
+public:
+    virtual ~QDrawingPointStorage() {}
+};
+
+/**
+ * @brief Fixed-capacity run of stroke points.
+ *
+ * A chunk never grows or moves once allocated and points are only written past the end of what
+ * any stroke copy already sees.  The copy whose size matches `used` may append in place, every
+ * other write goes to a private copy of the chunk.
+ */
+class QDrawingPointChunk : public QSharedData
+{
+public:
+    QDrawingPointChunk(int capacity, bool normals);
+    /**
+     * @brief Private copy of the first `count` points of `other`.
+     */
+    QDrawingPointChunk(const QDrawingPointChunk &other, int count);
+    /**
+     * @brief Full, read-only chunk over `count` points held by `storage`.
+     */
+    QDrawingPointChunk(const float *x, const float *y, const quint16 *pressure, int count,
+                       QSharedPointer<QDrawingPointStorage> storage);
+    ~QDrawingPointChunk();
+
+    qint64 memoryUsage() const;
+
+    int capacity;
+    QAtomicInt used;    // Slots claimed by an appending stroke
+    float *x;
+    float *y;
+    quint16 *pressure;  // Fixed point, 0xffff == 1.0
+    float *nx;          // Null for compact strokes
+    float *ny;
+    QSharedPointer<QDrawingPointStorage> storage; // Set if the points are not owned
+
+private:
+    void allocate(bool normals);
+    Q_DISABLE_COPY(QDrawingPointChunk)
+};
+
+class QDrawingStrokeData : public QSharedData
+{
+public:
+    enum {
+        MinChunkSize = 16,
+        MaxChunkSize = 1024
+    };
+
+    QDrawingStrokeData();
+
+    /**
+     * @brief Chunk holding point `index`, and the position of the point inside of it.
+     */
+    int chunkIndex(int index, int *offset) const;
+    /**
+     * @brief Chunk holding point `index` that only this stroke refers to.
+     */
+    QDrawingPointChunk *writableChunk(int index, int *offset);
+    /**
+     * @brief Copies `count` points starting at `from` into flat arrays.  Any output may be null.
+     */
+    void copyPoints(int from, int count, float *x, float *y, quint16 *pressure) const;
+
+    QVector<QExplicitlySharedDataPointer<QDrawingPointChunk> > chunks;
+    QVector<int> chunkStart;    // First point in each chunk
+    int size;
+    int reserved;
+    float left;
+    float top;
+    float right;
+    float bottom;
+    bool compact;
+    bool curves;                // Points are cubic Bézier control points, see QDrawingStroke::setCurves()
+    quint32 id;
+    quint16 pen;                // PenRegistry id
+    QSharedPointer<const StrokeLevels> levels;  // Null until simplified, dropped on any change
+};
+
+/**
+ * @brief Vector split into fixed-size blocks that copies share until they are written to.
+ *
+ * Writing to a copy duplicates the block handles and the one block being written, so copies of
+ * large vectors stay cheap to take while the original keeps changing.
+ */
+template<typename T>
+class BlockVector
+{
+public:
+    enum {
+        BlockSize = 256
+    };
+
+    BlockVector() : count(0) {}
+
+    int size() const { return count; }
+    const T &at(int index) const { return blocks.at(index / BlockSize).at(index % BlockSize); }
+    T &operator[](int index) { return blocks[index / BlockSize][index % BlockSize]; }
+
+    void append(const T &value)
+    {
+        if(count % BlockSize == 0)
+        {
+            blocks.append(QVector<T>());
+            blocks.last().reserve(BlockSize);
+        }
+
+        blocks.last().append(value);
+        count++;
+    }
+
+    /**
+     * @brief Inserts `value` before `index`, moving everything after it up by one.
+     */
+    void insert(int index, const T &value)
+    {
+        append(value);
+
+        for(int i = count - 1; i > index; i--)
+        {
+            T moved = at(i - 1);
+
+            (*this)[i] = moved;
+        }
+
+        (*this)[index] = value;
+    }
+
+    void reserve(int size) { blocks.reserve((size + BlockSize - 1) / BlockSize); }
+    void clear() { blocks.clear(); count = 0; }
+
+private:
+    QVector<QVector<T> > blocks;
+    int count;
+};
+
+/**
+ * @brief Strokes in drawing order with constant time lookup by id.
+ *
+ * Ids are handed out in increasing order and index a table of slots, slots keep the strokes in
+ * drawing order.  Every id also keeps a rank that increases with drawing order, so removed strokes
+ * know their place after the slots moved.  A removed stroke stays in its slot until the store is
+ * compacted, so slots stay stable in between and restore() can put the stroke back in place.
+ * Copies share all storage the original did not modify since.
+ */
+class StrokeStore
+{
+public:
+    StrokeStore();
+
+    /**
+     * @brief Adds `stroke` on top of the drawing order under a new id, which is returned.
+     */
+    quint32 insert(QDrawingStroke stroke);
+    /**
+     * @brief Adds `stroke` right above the stroke `below` under a new id, which is returned.
+     *
+     * Moves every slot above it, which takes a pass over them.  Inserts on top if `below` does not
+     * exist.
+     */
+    quint32 insertAfter(quint32 below, QDrawingStroke stroke);
+    void remove(quint32 id);
+    /**
+     * @brief Puts `strokes` back under their ids, replacing strokes that still exist.
+     *
+     * Removed strokes go back into their old slots.  If the store was compacted since, they are
+     * merged back by rank, which takes a pass over all slots.
+     */
+    void restore(const QList<QDrawingStroke> &strokes);
+    void reserve(int strokes);
+    /**
+     * @brief Removes all strokes.  Ids are not handed out again.
+     */
+    void clear();
+    /**
+     * @brief Drops the slots of removed strokes.  Changes slot numbers, ids stay the same.
+     */
+    void compact();
+
+    bool contains(quint32 id) const;
+    const QDrawingStroke *find(quint32 id) const;
+    /**
+     * @brief Writable stroke, or null.  Only copies the block holding it if it is shared.
+     */
+    QDrawingStroke *modify(quint32 id);
+    QList<quint32> ids() const;
+    /**
+     * @brief Id of the stroke drawn right below `id`, or -1 if there is none.
+     */
+    quint32 below(quint32 id) const;
+    /**
+     * @brief Number of strokes, not counting removed ones.
+     */
+    int count() const;
+
+    int slotCount() const;
+    bool isLive(int slot) const;
+    const QDrawingStroke &at(int slot) const;
+
+private:
+    int slotOf(quint32 id) const;
+    void renumberRanks();
+
+    BlockVector<QDrawingStroke> strokes;    // Removed strokes stay until compact()
+    BlockVector<int> slots;     // Indexed by id - firstId, -2 - slot while removed, -1 once compacted
+    BlockVector<double> ranks;  // Indexed by id - firstId
+    quint32 firstId;
+    int live;
+    double nextRank;
+};
+
+class QDrawingSnapshotData
+{
+public:
+    QDrawingSnapshotData() : version(0) {}
+
+    quint64 version;
+    StrokeStore strokes;
+};
+
+#endif // QDRAWINGSTROKE_P
@@ -0,0 +1,170 @@
+#include "qdrawingarea.h"
+#include "qdrawingarea_p.h"
+
+void TraceRecorder::setupStream(QDataStream &stream)
+{
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+}
+
+bool TraceRecorder::open(const QString &fileName, qint64 startTime)
+{
+    file.setFileName(fileName);
+
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    this->startTime = startTime;
+    activeDevices.clear();
+
+    stream.setDevice(&file);
+    setupStream(stream);
+    stream << (quint32)Magic << (quint16)Version;
+
+    return stream.status() == QDataStream::Ok;
+}
+
+void TraceRecorder::record(const InputSample &sample)
+{
+    quint8 type = sample.type;
+
+    if(type == InputSample::Release)
+    {
+        activeDevices.remove(sample.deviceId);
+    }
+    else if(!activeDevices.contains(sample.deviceId))
+    {
+        activeDevices.insert(sample.deviceId);
+        type = InputSample::Press;
+    }
+
+    stream << (qint64)(sample.timestamp - startTime) << sample.deviceId << sample.pen << type
+           << sample.x << sample.y << sample.pressure;
+}
+
+void TraceRecorder::close()
+{
+    stream.setDevice(0);
+    file.close();
+}
+
+
+TraceReplayer::TraceReplayer(QDrawingAreaPrivate *d, QObject *parent) : QObject(parent),
+    d(d),
+    position(0),
+    originalTiming(true)
+{
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+
+    connect(&timer, &QTimer::timeout, this, &TraceReplayer::step);
+}
+
+bool TraceReplayer::load(const QString &fileName)
+{
+    QFile file(fileName);
+    QDataStream stream(&file);
+    quint32 magic;
+    quint16 version;
+
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+
+    TraceRecorder::setupStream(stream);
+    stream >> magic >> version;
+
+    if(magic != TraceRecorder::Magic)
+        return false;
+
+    // Version 1 positions were widget pixels, which can not be mapped without the view they were recorded in
+    if(version != TraceRecorder::Version)
+    {
+        qWarning("TraceReplayer::load: %s has unsupported version %u", qPrintable(fileName), version);
+        return false;
+    }
+
+    records.clear();
+    position = 0;
+
+    while(!stream.atEnd())
+    {
+        InputSample sample;
+        quint8 type;
+
+        stream >> sample.timestamp >> sample.deviceId >> sample.pen >> type
+               >> sample.x >> sample.y >> sample.pressure;
+
+        // A truncated last record is expected after a crash
+        if(stream.status() != QDataStream::Ok)
+            break;
+
+        // Pens are stored by the order they were added
+        sample.pen = sample.pen < d->pens.size() ? d->pens.at(sample.pen) : (quint16)QDrawingPen::InvalidId;
+        sample.type = type;
+        records << sample;
+    }
+
+    return true;
+}
+
+void TraceReplayer::start(bool originalTiming)
+{
+    this->originalTiming = originalTiming;
+    position = 0;
+    clock.start();
+
+    step();
+}
+
+void TraceReplayer::stop()
+{
+    timer.stop();
+    records.clear();
+    position = 0;
+}
+
+bool TraceReplayer::isActive() const
+{
+    return position < records.size();
+}
+
+void TraceReplayer::step()
+{
+    int budget = InputProcessor::QueueCapacity / 2;
+    qint64 now = clock.nsecsElapsed();
+
+    while(position < records.size())
+    {
+        InputSample sample = records[position];
+
+        if(originalTiming)
+        {
+            if(sample.timestamp > now)
+                break;
+        }
+        else if(budget-- == 0 || d->processor->samples.depth() >= InputProcessor::QueueCapacity / 2)
+        {
+            // Give the processor a chance to catch up instead of overflowing the queue
+            break;
+        }
+
+        if(sample.type == InputSample::Press)
+            sample.type = InputSample::Move;
+
+        sample.timestamp = d->clock.nsecsElapsed();
+        d->enqueueSample(sample);
+        position++;
+    }
+
+    if(position < records.size())
+    {
+        timer.start(originalTiming ? qMax<qint64>(0, (records[position].timestamp - now) / 1000000) : 0);
+    }
+    else
+    {
+        records.clear();
+        position = 0;
+        emit finished();
+    }
+}
@@ -0,0 +1,569 @@
+#include <QApplication>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtMath>
+#include <QtTest>
+
+#include <qdrawingarea.h>
+#include <qdrawingarea_p.h>
+
+/**
+ * @brief Exposes the protected input entry points to the tests.
+ */
+class TestArea : public QDrawingArea
+{
+public:
+    using QDrawingArea::addStrokePoint;
+    using QDrawingArea::finishStroke;
+    using QDrawingArea::findPenFromButtons;
+};
+
+class TestQDrawingArea : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum {
+        WaitTimeout = 10000 // ms
+    };
+
+private slots:
+    void preciseEraserKeepsDrawingOrder();
+    void kernelsAgree_data();
+    void kernelsAgree();
+    void spscQueueWrapsAround();
+    void spscQueueOverflows();
+    void strokeStoreKeepsOrderAcrossCompaction();
+    void strokeStoreRenumbersRanks();
+    void documentRoundTrip();
+    void journalRecoversTornTail();
+    void historyTrimsToBudget();
+    void curveFitStaysWithinTolerance();
+
+private:
+    static bool fuzzyEqual(const QVector<float> &a, const QVector<float> &b, int *at);
+    static bool sameStroke(const QDrawingStroke &a, const QDrawingStroke &b);
+    static void appendStroke(QAbstractDrawingModel &model, const QSharedPointer<QDrawingPen> &pen, int points, qreal offset);
+    static void drawLine(TestArea &area, quint32 deviceId, quint16 pen, const QPointF &from, const QPointF &to);
+    static bool waitForIdle(TestArea &area);
+};
+
+void TestQDrawingArea::preciseEraserKeepsDrawingOrder()
+{
+    TestArea area;
+    QDrawingPen pen(Qt::LeftButton, QColor(Qt::blue), 1);
+    QDrawingPen eraser(Qt::LeftButton, QColor(Qt::white), 3);
+
+    // One pixel per mm
+    eraser.setMode(QDrawingPen::Mode_PreciseEraser);
+    area.addPen(pen);
+    area.addPen(eraser, QTabletEvent::Eraser);
+    area.setViewport(QPointF(0, 0), 1);
+    area.resize(240, 120);
+
+    quint16 drawingPen = area.findPenFromButtons(Qt::LeftButton);
+    quint16 eraserPen = area.findPenFromButtons(Qt::LeftButton, QTabletEvent::Eraser);
+
+    // A horizontal stroke below a vertical one, the eraser cuts only the lower one
+    drawLine(area, 1, drawingPen, QPointF(10, 50), QPointF(200, 50));
+    QVERIFY(waitForIdle(area));
+    drawLine(area, 2, drawingPen, QPointF(150, 10), QPointF(150, 90));
+    QVERIFY(waitForIdle(area));
+
+    QList<quint32> drawn = area.model()->snapshot().strokeIds();
+
+    QCOMPARE(drawn.size(), 2);
+
+    drawLine(area, 3, eraserPen, QPointF(80, 40), QPointF(80, 60));
+    QVERIFY(waitForIdle(area));
+
+    QDrawingSnapshot erased = area.model()->snapshot();
+    QList<quint32> ids = erased.strokeIds();
+
+    // The right piece stays below the stroke that was drawn over the original
+    QCOMPARE(ids.size(), 3);
+    QCOMPARE(ids[0], drawn[0]);
+    QCOMPARE(ids[2], drawn[1]);
+    QVERIFY(erased.stroke(ids[0]).boundingRect().right() < 80);
+    QVERIFY(erased.stroke(ids[1]).boundingRect().left() > 80);
+
+    area.model()->undo();
+    QCOMPARE(area.model()->snapshot().strokeIds(), drawn);
+    QVERIFY(area.model()->snapshot().stroke(drawn[0]).boundingRect().right() > 190);
+
+    area.model()->redo();
+    QCOMPARE(area.model()->snapshot().strokeIds(), ids);
+}
+
+void TestQDrawingArea::kernelsAgree_data()
+{
+    QTest::addColumn<int>("count");
+
+    // Odd sizes leave tails after the vector loops
+    const int counts[] = { 2, 3, 7, 8, 9, 17, 1000 };
+
+    for(int i = 0; i < 7; i++)
+        QTest::newRow(qPrintable(QString("%1 points").arg(counts[i]))) << counts[i];
+}
+
+void TestQDrawingArea::kernelsAgree()
+{
+    QFETCH(int, count);
+    QVector<float> x(count), y(count);
+    QVector<quint16> pressure(count);
+    qreal angle = 0;
+    qsrand(1);
+
+    x[0] = 500;
+    y[0] = 500;
+
+    // A random walk with repeated points and full reversals mixed in
+    for(int i = 0; i < count; i++)
+    {
+        pressure[i] = qrand() % 65536;
+
+        if(i == 0)
+            continue;
+
+        switch(qrand() % 16)
+        {
+        case 0:
+            x[i] = x[i - 1];
+            y[i] = y[i - 1];
+            break;
+        case 1:
+            x[i] = i > 1 ? x[i - 2] : x[0] + 1;
+            y[i] = i > 1 ? y[i - 2] : y[0];
+            break;
+        default:
+            angle += ((qrand() % 100) - 50) / 50.0;
+            x[i] = x[i - 1] + (qrand() % 100) / 10.0 * qCos(angle);
+            y[i] = y[i - 1] + (qrand() % 100) / 10.0 * qSin(angle);
+        }
+    }
+
+    QByteArray implementation = StrokeKernel::implementation();
+    QList<QByteArray> implementations = StrokeKernel::implementations();
+    QVector<QVector<float> > expected;
+
+    QCOMPARE(implementations.first(), QByteArray("scalar"));
+    QVERIFY(implementations.contains(implementation));
+
+    foreach(const QByteArray &name, implementations)
+    {
+        QVector<QVector<float> > results(6, QVector<float>(count));
+        int at = -1;
+
+        QVERIFY(StrokeKernel::setImplementation(name));
+        StrokeKernel::offsets(x.constData(), y.constData(), pressure.constData(), count, 0.5f, 4,
+                              results[0].data(), results[1].data(), results[2].data(), results[3].data());
+        StrokeKernel::normals(x.constData(), y.constData(), count, results[4].data(), results[5].data());
+
+        // Scalar is the reference the others are held to
+        if(expected.isEmpty())
+        {
+            expected = results;
+            continue;
+        }
+
+        for(int i = 0; i < results.size(); i++)
+        {
+            if(!fuzzyEqual(results[i], expected[i], &at))
+            {
+                StrokeKernel::setImplementation(implementation);
+                QFAIL(qPrintable(QString("%1 differs from scalar in output %2 at point %3: %4 instead of %5")
+                                 .arg(QString(name)).arg(i).arg(at).arg(results[i][at]).arg(expected[i][at])));
+            }
+        }
+    }
+
+    QVERIFY(StrokeKernel::setImplementation(implementation));
+    QVERIFY(!StrokeKernel::setImplementation("none"));
+}
+
+void TestQDrawingArea::spscQueueWrapsAround()
+{
+    SpscQueue<int, 8> queue;
+    int items[5];
+    int next = 0, expected = 0;
+
+    // 5 does not divide 8, so batches straddle the end of the ring
+    for(int round = 0; round < 100; round++)
+    {
+        for(int i = 0; i < 5; i++)
+            items[i] = next++;
+
+        QCOMPARE(queue.push(items, 5), 5);
+        QCOMPARE(queue.depth(), 5);
+        QCOMPARE(queue.pop(items, 8), 5);
+
+        for(int i = 0; i < 5; i++)
+            QCOMPARE(items[i], expected++);
+    }
+
+    QCOMPARE(queue.depth(), 0);
+    QCOMPARE(queue.pushed(), (quint32)500);
+    QCOMPARE(queue.peakDepth(), 5);
+    QCOMPARE(queue.overflows(), 0);
+}
+
+void TestQDrawingArea::spscQueueOverflows()
+{
+    SpscQueue<int, 8> queue;
+    int items[4] = { 100, 101, 102, 103 };
+    int popped[8];
+
+    for(int i = 0; i < 8; i++)
+        QVERIFY(queue.push(i));
+
+    QVERIFY(!queue.push(8));
+    QCOMPARE(queue.overflows(), 1);
+    QCOMPARE(queue.push(items, 4), 0);
+    QCOMPARE(queue.overflows(), 5);
+    QCOMPARE(queue.peakDepth(), 8);
+
+    // Rejected items leave the queued ones alone
+    QCOMPARE(queue.pop(popped, 2), 2);
+    QCOMPARE(queue.push(items, 4), 2);
+    QCOMPARE(queue.overflows(), 7);
+    QCOMPARE(queue.pop(popped, 8), 8);
+
+    for(int i = 0; i < 6; i++)
+        QCOMPARE(popped[i], i + 2);
+
+    QCOMPARE(popped[6], 100);
+    QCOMPARE(popped[7], 101);
+}
+
+void TestQDrawingArea::strokeStoreKeepsOrderAcrossCompaction()
+{
+    StrokeStore store;
+    quint32 a = store.insert(QDrawingStroke());
+    quint32 b = store.insert(QDrawingStroke());
+    quint32 c = store.insert(QDrawingStroke());
+    quint32 d = store.insertAfter(a, QDrawingStroke());
+
+    QCOMPARE(store.ids(), QList<quint32>() << a << d << b << c);
+    QCOMPARE(store.below(a), (quint32)-1);
+    QCOMPARE(store.below(b), d);
+
+    QList<QDrawingStroke> removed;
+
+    removed << *store.find(d) << *store.find(b);
+    store.remove(d);
+    store.remove(b);
+
+    QCOMPARE(store.count(), 2);
+    QCOMPARE(store.below(c), a);
+
+    // Compaction drops the old slots, restoring has to go by rank
+    store.compact();
+    QCOMPARE(store.slotCount(), 2);
+    QCOMPARE(store.ids(), QList<quint32>() << a << c);
+
+    store.restore(removed);
+    QCOMPARE(store.ids(), QList<quint32>() << a << d << b << c);
+    QCOMPARE(store.count(), 4);
+    QCOMPARE(store.find(d)->id(), d);
+}
+
+void TestQDrawingArea::strokeStoreRenumbersRanks()
+{
+    StrokeStore store;
+    QList<quint32> expected;
+    quint32 a = store.insert(QDrawingStroke());
+    quint32 b = store.insert(QDrawingStroke());
+
+    // Every insert halves the gap above a, well past the precision of a double
+    for(int i = 0; i < 100; i++)
+        expected.prepend(store.insertAfter(a, QDrawingStroke()));
+
+    expected.prepend(a);
+    expected.append(b);
+
+    QCOMPARE(store.ids(), expected);
+
+    for(int i = 1; i < expected.size(); i++)
+        QCOMPARE(store.below(expected[i]), expected[i - 1]);
+}
+
+void TestQDrawingArea::documentRoundTrip()
+{
+    QTemporaryDir dir;
+    QString fileName = dir.filePath("drawing.qda");
+    QAbstractDrawingModel saved, loaded;
+    QSharedPointer<QDrawingPen> pen(new QDrawingPen(Qt::LeftButton, QColor(Qt::red), 0.5, 2));
+    QSharedPointer<QDrawingPen> marker(new QDrawingPen(Qt::RightButton, QColor(0, 255, 0, 128), 4));
+
+    QVERIFY(dir.isValid());
+
+    appendStroke(saved, pen, 50, 0);
+    appendStroke(saved, marker, 3, 10);
+    appendStroke(saved, pen, 1000, 20);
+
+    QVERIFY(saved.save(fileName));
+    QVERIFY(loaded.load(fileName));
+
+    QDrawingSnapshot before = saved.snapshot(), after = loaded.snapshot();
+    QList<quint32> beforeIds = before.strokeIds(), afterIds = after.strokeIds();
+
+    QCOMPARE(afterIds.size(), beforeIds.size());
+
+    for(int i = 0; i < beforeIds.size(); i++)
+        QVERIFY(sameStroke(after.stroke(afterIds[i]), before.stroke(beforeIds[i])));
+}
+
+void TestQDrawingArea::journalRecoversTornTail()
+{
+    QTemporaryDir dir;
+    QString fileName = dir.filePath("drawing.qda");
+    QString journalName = fileName + ".journal";
+    QAbstractDrawingModel model;
+    QSharedPointer<QDrawingPen> pen(new QDrawingPen(Qt::LeftButton, QColor(Qt::blue), 1, 3));
+
+    QVERIFY(dir.isValid());
+    QVERIFY(model.startJournal(fileName));
+
+    for(int i = 0; i < 3; i++)
+        appendStroke(model, pen, 20 + i * 10, i * 5);
+
+    model.stopJournal();
+
+    QDrawingSnapshot expected = model.snapshot();
+    QList<quint32> expectedIds = expected.strokeIds();
+    QFile journal(journalName);
+    qint64 size = journal.size();
+
+    // A record whose length runs past the end of the file, as a crash mid-write leaves it
+    QVERIFY(journal.open(QIODevice::Append));
+    QDataStream stream(&journal);
+    TraceRecorder::setupStream(stream);
+    stream << (quint32)1000 << (quint8)0 << (quint32)expectedIds.last();
+    journal.close();
+
+    {
+        QAbstractDrawingModel recovered;
+
+        QVERIFY(recovered.recover(fileName));
+
+        QDrawingSnapshot snapshot = recovered.snapshot();
+        QList<quint32> ids = snapshot.strokeIds();
+
+        QCOMPARE(ids.size(), 3);
+
+        for(int i = 0; i < ids.size(); i++)
+            QVERIFY(sameStroke(snapshot.stroke(ids[i]), expected.stroke(expectedIds[i])));
+    }
+
+    // Cuts through the finish record and into the points of the last stroke
+    QVERIFY(journal.resize(size - 9 - 5));
+
+    {
+        QAbstractDrawingModel recovered;
+
+        QVERIFY(recovered.recover(fileName));
+
+        QDrawingSnapshot snapshot = recovered.snapshot();
+        QList<quint32> ids = snapshot.strokeIds();
+
+        // The last stroke may be left begun without points, the others are intact
+        QVERIFY(ids.size() >= 2);
+        QVERIFY(ids.size() <= 3);
+
+        for(int i = 0; i < 2; i++)
+            QVERIFY(sameStroke(snapshot.stroke(ids[i]), expected.stroke(expectedIds[i])));
+
+        if(ids.size() == 3)
+            QCOMPARE(snapshot.stroke(ids[2]).size(), 0ul);
+    }
+}
+
+void TestQDrawingArea::historyTrimsToBudget()
+{
+    QAbstractDrawingModel model;
+    QSharedPointer<QDrawingPen> pen(new QDrawingPen(Qt::LeftButton, QColor(Qt::black), 1));
+
+    appendStroke(model, pen, 100, 0);
+
+    qint64 cost = model.undoMemoryUsage();
+    qint64 limit = cost * 5 / 2;
+
+    QVERIFY(cost > 0);
+
+    // Room for two steps of the same size
+    model.setUndoLimit(limit);
+    QCOMPARE(model.undoMemoryUsage(), cost);
+
+    for(int i = 0; i < 4; i++)
+        appendStroke(model, pen, 100, 0);
+
+    QVERIFY(model.undoMemoryUsage() <= limit);
+    QCOMPARE(model.undoMemoryUsage(), 2 * cost);
+    QCOMPARE(model.snapshot().strokeCount(), 5);
+
+    model.undo();
+    model.undo();
+    QVERIFY(!model.canUndo());
+    QVERIFY(model.canRedo());
+    QCOMPARE(model.snapshot().strokeCount(), 3);
+
+    model.setUndoLimit(0);
+    QVERIFY(!model.canUndo());
+    QVERIFY(!model.canRedo());
+    QCOMPARE(model.undoMemoryUsage(), 0ll);
+
+    appendStroke(model, pen, 100, 0);
+    QVERIFY(!model.canUndo());
+}
+
+void TestQDrawingArea::curveFitStaysWithinTolerance()
+{
+    const qreal tolerance = 0.05;
+    const int count = 400;
+    CurveFitter fitter(tolerance, 2);
+    QVector<float> sx(count), sy(count), sp(count);
+
+    // A sine with a jitter below the tolerance, 0.25 mm apart
+    for(int i = 0; i < count; i++)
+    {
+        sx[i] = 10 + i * 0.25f;
+        sy[i] = 10 + 8 * qSin(i * 0.03) + 0.02 * qSin(i * 1.7);
+        sp[i] = 0.5f + 0.3f * qSin(i * 0.01);
+        fitter.add(sx[i], sy[i], sp[i]);
+    }
+
+    fitter.finish();
+
+    int size = fitter.size();
+
+    QCOMPARE((size - 1) % 3, 0);
+    QVERIFY(size > 1);
+    QVERIFY(size < count / 4);
+    QCOMPARE(fitter.x.first(), sx.first());
+    QCOMPARE(fitter.y.first(), sy.first());
+    QCOMPARE(fitter.x.last(), sx.last());
+    QCOMPARE(fitter.y.last(), sy.last());
+
+    QVector<quint16> pressure(size);
+    QVector<float> flatX, flatY;
+    QVector<quint16> flatPressure;
+
+    for(int i = 0; i < size; i++)
+        pressure[i] = qBound(0, qRound(fitter.pressure[i] * 65535), 65535);
+
+    CurveFitter::flatten(fitter.x.constData(), fitter.y.constData(), pressure.constData(), size, 0.01,
+                         flatX, flatY, flatPressure);
+
+    for(int i = 0; i < count; i++)
+    {
+        QPointF p(sx[i], sy[i]);
+        qreal distance = qInf();
+
+        for(int j = 1; j < flatX.size(); j++)
+        {
+            QPointF a(flatX[j - 1], flatY[j - 1]), b(flatX[j], flatY[j]);
+            QPointF ab = b - a;
+            qreal length = QPointF::dotProduct(ab, ab);
+            qreal t = length > 0 ? qBound(0.0, QPointF::dotProduct(p - a, ab) / length, 1.0) : 0;
+            QPointF d = a + ab * t - p;
+
+            distance = qMin(distance, qSqrt(QPointF::dotProduct(d, d)));
+        }
+
+        if(distance > tolerance + 0.01)
+            QFAIL(qPrintable(QString("Sample %1 is %2 mm from the curve").arg(i).arg(distance)));
+    }
+}
+
+bool TestQDrawingArea::fuzzyEqual(const QVector<float> &a, const QVector<float> &b, int *at)
+{
+    for(int i = 0; i < a.size(); i++)
+    {
+        // Exact division and square roots, only the order of operations may differ
+        if(qAbs(a[i] - b[i]) > 1e-4f * qMax(1.0f, qAbs(b[i])))
+        {
+            *at = i;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TestQDrawingArea::sameStroke(const QDrawingStroke &a, const QDrawingStroke &b)
+{
+    if(a.size() != b.size() || !a.pen() || !b.pen())
+        return false;
+
+    if(a.pen()->color() != b.pen()->color() || a.pen()->button() != b.pen()->button() ||
+            qAbs(a.pen()->minWidth() - b.pen()->minWidth()) > 1e-6 ||
+            qAbs(a.pen()->maxWidth() - b.pen()->maxWidth()) > 1e-6)
+        return false;
+
+    for(unsigned long i = 0; i < a.size(); i++)
+    {
+        QDrawingPoint p = a[i], q = b[i];
+
+        // Pressure is stored in 16 bits
+        if(qAbs(p.x() - q.x()) > 1e-4 || qAbs(p.y() - q.y()) > 1e-4 || qAbs(p.pressure() - q.pressure()) > 1e-4)
+            return false;
+    }
+
+    return true;
+}
+
+void TestQDrawingArea::appendStroke(QAbstractDrawingModel &model, const QSharedPointer<QDrawingPen> &pen, int points, qreal offset)
+{
+    QVector<float> x(points), y(points), pressure(points);
+
+    for(int i = 0; i < points; i++)
+    {
+        x[i] = offset + i * 0.5;
+        y[i] = offset + qSin(i * 0.2) * 3;
+        pressure[i] = (i % 10) / 10.0;
+    }
+
+    model.append(pen, x.constData(), y.constData(), pressure.constData(), points);
+}
+
+void TestQDrawingArea::drawLine(TestArea &area, quint32 deviceId, quint16 pen, const QPointF &from, const QPointF &to)
+{
+    const int steps = qCeil(QLineF(from, to).length() / 2);     // 2 mm apart
+
+    for(int i = 0; i <= steps; i++)
+    {
+        QPointF point = from + (to - from) * i / steps;
+
+        area.addStrokePoint(deviceId, pen, point.x(), point.y(), 1);
+    }
+
+    area.finishStroke(deviceId);
+}
+
+bool TestQDrawingArea::waitForIdle(TestArea &area)
+{
+    // The signal is queued to this thread, so it cannot fire between the check and the wait
+    QSignalSpy processed(&area, SIGNAL(inputProcessed()));
+
+    while(!area.isInputIdle())
+    {
+        if(!processed.wait(WaitTimeout))
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    // Headless by default
+    if(qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app(argc, argv);
+    TestQDrawingArea tests;
+
+    return QTest::qExec(&tests, argc, argv);
+}
+
+#include "tst_qdrawingarea.moc"
@@ -4,13 +4,13 @@
 TestUI::TestUI(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::TestUI),
-    pen(Qt::LeftButton, QColor(Qt::blue), (qreal)0.1, (qreal)15, (qreal)0)
+    pen(Qt::LeftButton, QColor(Qt::blue), (qreal)0.03, (qreal)4, (qreal)0)
 {
     ui->setupUi(this);
 
     ui->widget->addPen(pen);
     ui->widget->setFlag(QDrawingArea::SmoothCurves | QDrawingArea::D_EmulatePressure);
-    ui->widget->setUpdateRate(20);
+    ui->widget->setPredictionHorizon(20);
 
 }
 